@@ -1,5 +1,6 @@
 #include "base.h"
 #include "memory.h"
+#include "intern.h"
 #include <stdarg.h>
 
 
@@ -9,8 +10,9 @@
 const char *fmt(const char *format, ...)
 {
 	va_list args;
-	static char buffer[2][16000];
-	static int index = 0;
+	/* Per thread, so worker threads can trace() too. */
+	static __thread char buffer[2][16000];
+	static __thread int index = 0;
 	char *buf;
 
 	buf = buffer[index & 1];
@@ -31,6 +33,9 @@ ecode_t init_base()
         if (sstr_init() != EOK)
                 return EFAIL;
 
+        if (init_intern() != EOK)
+                return EFAIL;
+
 	return EOK;
 }
 
@@ -39,6 +44,9 @@ ecode_t init_base()
  */
 ecode_t shutdown_base()
 {
+        if (shutdown_intern() != EOK)
+                return EFAIL;
+
         if (sstr_shutdown() != EOK)
                 return EFAIL;
 
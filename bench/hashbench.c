@@ -0,0 +1,270 @@
+/*
+ * hashbench.c
+ *	Compares the functions in hash.c on the kinds of keys the engine
+ *	actually hashes: entity property names, asset paths and event names.
+ *
+ *	For each function and key set it reports throughput (hashing every
+ *	key in the set over and over) and, for a few power-of-two table
+ *	sizes, how many keys land in a bucket that's already taken when the
+ *	hash is masked down to that size. For comparison, the expected
+ *	number for an ideal random hash is given too.
+ *
+ *	Output is CSV on stdout (or the file given with -o):
+ *
+ *	    function,keyset,keys,avg_len,table_size,collisions,expected,
+ *	    mb_per_sec,ns_per_key
+ *
+ *	Usage: hashbench [-o file] [-n rounds]
+ */
+#include "base.h"
+#include "hash.h"
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_KEYS	4096
+#define KEY_LEN		64
+#define ROUNDS		200
+
+typedef uint32_t (*hash_fn)(const char *key, uint32_t len);
+
+static uint32_t HashElf(const char *key, uint32_t len)
+{
+	return ElfHash(key, len);
+}
+
+static uint32_t HashJenkins(const char *key, uint32_t len)
+{
+	return JenkinsHash((uint8_t *) key, len, 0);
+}
+
+static uint32_t HashFNV(const char *key, uint32_t len)
+{
+	return FNVHash((void *) key, len);
+}
+
+static uint32_t HashWy(const char *key, uint32_t len)
+{
+	return (uint32_t) hash64(key, len, 0);
+}
+
+static const struct {
+	const char *name;
+	hash_fn fn;
+} s_Functions[] = {
+	{"elf", HashElf},
+	{"jenkins", HashJenkins},
+	{"fnv", HashFNV},
+	{"hash64", HashWy},
+};
+#define NUM_FUNCTIONS (sizeof(s_Functions) / sizeof(s_Functions[0]))
+
+static const uint32_t s_TableSizes[] = {64, 256, 1024, 4096};
+#define NUM_TABLE_SIZES (sizeof(s_TableSizes) / sizeof(s_TableSizes[0]))
+
+struct KeySet {
+	const char *name;
+	uint32_t count;
+	uint32_t bytes;
+	char keys[MAX_KEYS][KEY_LEN];
+	uint32_t lens[MAX_KEYS];
+};
+
+static struct KeySet s_Sets[3];
+static uint32_t s_Rounds = ROUNDS;
+static FILE *s_Out = NULL;
+
+static void AddKey(struct KeySet *set, const char *key)
+{
+	if (set->count == MAX_KEYS)
+		return;
+
+	uint32_t len = strlen(key);
+	assert(len < KEY_LEN);
+
+	memcpy(set->keys[set->count], key, len + 1);
+	set->lens[set->count] = len;
+	set->bytes += len;
+	set->count++;
+}
+
+/* Short, lowercase, lots of shared prefixes and suffixes. */
+static const char *s_PropNames[] = {
+	"class", "name", "pos", "vel", "sprite", "health", "maxhealth",
+	"speed", "damage", "target", "owner", "team", "visible", "solid",
+	"model", "sound", "think", "delay", "radius", "angle", "scale",
+	"colour", "frame", "frames", "state", "flags", "spawnflags", "script",
+};
+
+static const char *s_Things[] = {
+	"door", "player", "enemy", "grenade", "light", "trigger", "crate",
+	"barrel", "turret", "pickup", "switch", "lift", "spawner", "camera",
+};
+
+static const char *s_Events[] = {
+	"opened", "closed", "slammed", "death", "spawned", "exploded",
+	"touched", "used", "hurt", "healed", "noticed", "lost",
+};
+
+/*
+ * MakeKeySets
+ */
+static void MakeKeySets()
+{
+	char buf[KEY_LEN];
+	uint32_t nprops = sizeof(s_PropNames) / sizeof(s_PropNames[0]);
+	uint32_t nthings = sizeof(s_Things) / sizeof(s_Things[0]);
+	uint32_t nevents = sizeof(s_Events) / sizeof(s_Events[0]);
+
+	struct KeySet *props = &s_Sets[0];
+	props->name = "properties";
+	for (uint32_t i = 0; i < nprops; i++)
+		AddKey(props, s_PropNames[i]);
+	for (uint32_t i = 0; i < nprops; i++) {
+		for (uint32_t j = 0; j < nthings; j++) {
+			snprintf(buf, sizeof(buf), "%s_%s", s_Things[j],
+				s_PropNames[i]);
+			AddKey(props, buf);
+		}
+	}
+
+	struct KeySet *paths = &s_Sets[1];
+	paths->name = "paths";
+	for (uint32_t i = 0; i < nthings; i++) {
+		snprintf(buf, sizeof(buf), "res/ent/%s.ent", s_Things[i]);
+		AddKey(paths, buf);
+
+		for (uint32_t f = 0; f < 64; f++) {
+			snprintf(buf, sizeof(buf), "res/sprites/%s/%s_%02u.png",
+				s_Things[i], s_Things[i], f);
+			AddKey(paths, buf);
+		}
+	}
+	for (uint32_t i = 0; i < 256; i++) {
+		snprintf(buf, sizeof(buf), "res/maps/level%03u.map", i);
+		AddKey(paths, buf);
+	}
+
+	struct KeySet *events = &s_Sets[2];
+	events->name = "events";
+	for (uint32_t i = 0; i < nthings; i++) {
+		for (uint32_t j = 0; j < nevents; j++) {
+			snprintf(buf, sizeof(buf), "%s-%s", s_Things[i],
+				s_Events[j]);
+			AddKey(events, buf);
+		}
+	}
+}
+
+static uint64_t NowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Collisions
+ *	Keys that hash to an already used bucket in a table of the given
+ *	size (a power of two).
+ */
+static uint32_t Collisions(struct KeySet *set, hash_fn fn, uint32_t size)
+{
+	static uint8_t used[MAX_KEYS];
+	uint32_t collisions = 0;
+
+	assert(size <= MAX_KEYS);
+	memset(used, 0, size);
+
+	for (uint32_t i = 0; i < set->count; i++) {
+		uint32_t b = fn(set->keys[i], set->lens[i]) & (size - 1);
+		if (used[b])
+			collisions++;
+		used[b] = 1;
+	}
+
+	return collisions;
+}
+
+/* n keys into m buckets: n - m * (1 - (1 - 1/m)^n) collide. */
+static double ExpectedCollisions(uint32_t n, uint32_t m)
+{
+	return n - m * (1.0 - pow(1.0 - 1.0 / m, n));
+}
+
+/*
+ * Bench
+ */
+static void Bench(struct KeySet *set, const char *fnName, hash_fn fn)
+{
+	volatile uint32_t sink = 0;
+	uint32_t acc = 0;
+
+	uint64_t start = NowNs();
+	for (uint32_t r = 0; r < s_Rounds; r++) {
+		for (uint32_t i = 0; i < set->count; i++)
+			acc += fn(set->keys[i], set->lens[i]);
+	}
+	uint64_t ns = NowNs() - start;
+	sink = acc;
+	(void) sink;
+
+	double secs = ns / 1e9;
+	double mbPerSec = (double) set->bytes * s_Rounds / secs / (1024 * 1024);
+	double nsPerKey = (double) ns / ((uint64_t) set->count * s_Rounds);
+
+	for (uint32_t t = 0; t < NUM_TABLE_SIZES; t++) {
+		uint32_t size = s_TableSizes[t];
+
+		fprintf(s_Out, "%s,%s,%u,%.1f,%u,%u,%.1f,%.1f,%.2f\n", fnName,
+			set->name, set->count, (double) set->bytes / set->count,
+			size, Collisions(set, fn, size),
+			ExpectedCollisions(set->count, size), mbPerSec,
+			nsPerKey);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const char *outName = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "o:n:")) != -1) {
+		switch (opt) {
+		case 'o':
+			outName = optarg;
+			break;
+		case 'n':
+			s_Rounds = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-o file] [-n rounds]\n",
+				argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	s_Out = stdout;
+	if (outName) {
+		s_Out = fopen(outName, "w");
+		if (!s_Out) {
+			fprintf(stderr, "couldn't open %s\n", outName);
+			return EXIT_FAILURE;
+		}
+	}
+
+	MakeKeySets();
+
+	fprintf(s_Out, "function,keyset,keys,avg_len,table_size,collisions,"
+		"expected,mb_per_sec,ns_per_key\n");
+
+	for (uint32_t s = 0; s < sizeof(s_Sets) / sizeof(s_Sets[0]); s++) {
+		for (uint32_t f = 0; f < NUM_FUNCTIONS; f++)
+			Bench(&s_Sets[s], s_Functions[f].name, s_Functions[f].fn);
+	}
+
+	if (s_Out != stdout)
+		fclose(s_Out);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,390 @@
+/*
+ * lz4bench.c
+ *	Load time against LZ4 compression level, for the kind of data the
+ *	game loads: map files, scripts and entity definitions. Give it files
+ *	to use (e.g. everything under res/), or with none it makes up a
+ *	corpus of text that looks like ours.
+ *
+ *	For each level it compresses every file, writes the results to a
+ *	temporary directory and then times loading them the way files.c
+ *	does: open(), read() the whole thing, close() and decompress. The
+ *	same is done for the uncompressed files, as the baseline. Loads are
+ *	from the page cache, so this is the CPU side of it; with a cold cache
+ *	(or a slow disk) the smaller reads count for much more.
+ *
+ *	Output is CSV on stdout (or the file given with -o):
+ *
+ *	    level,files,raw_bytes,packed_bytes,ratio,compress_mb_per_sec,
+ *	    decompress_mb_per_sec,load_ms,raw_load_ms
+ *
+ *	Usage: lz4bench [-o file] [-n rounds] [file...]
+ */
+#include "base.h"
+#include "lz4.h"
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ROUNDS		20
+#define PATH_LEN	4096
+
+/* Sizes of the made up files. */
+#define GEN_MAPS	8
+#define GEN_SCRIPTS	16
+#define GEN_ENTS	64
+
+struct BenchFile {
+	uint8_t *data;
+	size_t size;
+	uint8_t *packed;
+	size_t packedSize;
+};
+
+static struct BenchFile *s_Files = NULL;
+static uint32_t s_Count = 0;
+static uint32_t s_Rounds = ROUNDS;
+static FILE *s_Out = NULL;
+static char s_TmpDir[] = "/tmp/lz4benchXXXXXX";
+
+static void *Xalloc(size_t sz)
+{
+	void *p = malloc(sz ? sz : 1);
+	if (!p) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	return p;
+}
+
+static void AddFile(uint8_t *data, size_t size)
+{
+	s_Files = realloc(s_Files, (s_Count + 1) * sizeof(*s_Files));
+	if (!s_Files) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	struct BenchFile *f = &s_Files[s_Count++];
+	memset(f, 0, sizeof(*f));
+	f->data = data;
+	f->size = size;
+}
+
+static void LoadFile(const char *path)
+{
+	FILE *in = fopen(path, "rb");
+	if (!in) {
+		fprintf(stderr, "couldn't open %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	fseek(in, 0, SEEK_END);
+	size_t size = ftell(in);
+	rewind(in);
+
+	uint8_t *data = Xalloc(size);
+	if (fread(data, 1, size, in) != size) {
+		fprintf(stderr, "couldn't read %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	fclose(in);
+	AddFile(data, size);
+}
+
+static uint32_t s_Seed = 12345;
+
+static uint32_t Rand()
+{
+	s_Seed = s_Seed * 1103515245 + 12345;
+	return (s_Seed >> 16) & 0x7fff;
+}
+
+/*
+ * Generate
+ *	Text shaped like our maps (an INI header and a big CSV tile layer),
+ *	Tcl scripts and .ent files.
+ */
+static void Generate()
+{
+	static const char *s_Words[] = {
+		"set", "proc", "if", "return", "entity", "spawn", "door",
+		"player", "event", "pos", "vel", "health", "puts", "foreach",
+	};
+	const uint32_t nwords = sizeof(s_Words) / sizeof(s_Words[0]);
+	char *buf;
+	size_t len;
+
+	for (uint32_t i = 0; i < GEN_MAPS; i++) {
+		uint32_t w = 128, h = 128;
+		buf = Xalloc(256 + w * h * 5);
+		len = sprintf(buf, "[header]\nwidth=%u\nheight=%u\n"
+			"tilewidth=32\ntileheight=32\n\n[tilesets]\n"
+			"tileset=tiles%u.png,32,32,0,0\n\n[layer]\n"
+			"type=Tiles\ndata=\n", w, h, i);
+
+		for (uint32_t y = 0; y < h; y++) {
+			for (uint32_t x = 0; x < w; x++) {
+				/* mostly floor, some walls and clutter */
+				uint32_t r = Rand() % 100;
+				uint32_t t = r < 70 ? 1 : r < 90 ? 2 : r % 40;
+				len += sprintf(buf + len, "%u,", t);
+			}
+			buf[len++] = '\n';
+		}
+
+		AddFile((uint8_t *) buf, len);
+	}
+
+	for (uint32_t i = 0; i < GEN_SCRIPTS; i++) {
+		size_t cap = 64 * 1024;
+		buf = Xalloc(cap);
+		len = 0;
+
+		while (len < cap - 256) {
+			len += sprintf(buf + len, "proc %s_%u {self} {\n",
+				s_Words[Rand() % nwords], Rand() % 100);
+			for (uint32_t l = Rand() % 8; l > 0; l--) {
+				len += sprintf(buf + len, "    %s %s $%s\n",
+					s_Words[Rand() % nwords],
+					s_Words[Rand() % nwords],
+					s_Words[Rand() % nwords]);
+			}
+			len += sprintf(buf + len, "}\n\n");
+		}
+
+		AddFile((uint8_t *) buf, len);
+	}
+
+	for (uint32_t i = 0; i < GEN_ENTS; i++) {
+		buf = Xalloc(512);
+		len = sprintf(buf, "[Entity]\nclass = %s\nname = %s%u\n"
+			"pos = %u %u\nvel = 0 0\nhealth = %u\n",
+			s_Words[Rand() % nwords], s_Words[Rand() % nwords], i,
+			Rand() % 1000, Rand() % 1000, Rand() % 200);
+
+		AddFile((uint8_t *) buf, len);
+	}
+}
+
+static uint64_t NowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void TmpPath(char *buf, uint32_t i, const char *ext)
+{
+	snprintf(buf, PATH_LEN, "%s/%u%s", s_TmpDir, i, ext);
+}
+
+static void WriteTmp(uint32_t i, const char *ext, const void *data,
+	size_t size)
+{
+	char path[PATH_LEN];
+	TmpPath(path, i, ext);
+
+	FILE *out = fopen(path, "wb");
+	if (!out || fwrite(data, 1, size, out) != size || fclose(out) != 0) {
+		fprintf(stderr, "couldn't write %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * ReadTmp
+ *	What LoadRaw() in files.c does, for buffered files.
+ */
+static size_t ReadTmp(uint32_t i, const char *ext, uint8_t *buf,
+	size_t cap)
+{
+	char path[PATH_LEN];
+	TmpPath(path, i, ext);
+
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1 || (size_t) st.st_size > cap ||
+		read(fd, buf, st.st_size) != st.st_size) {
+		fprintf(stderr, "couldn't read %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	close(fd);
+	return st.st_size;
+}
+
+static void RemoveTmp(uint32_t i, const char *ext)
+{
+	char path[PATH_LEN];
+	TmpPath(path, i, ext);
+	unlink(path);
+}
+
+/*
+ * TimeRawLoads
+ */
+static double TimeRawLoads(uint8_t *buf, size_t cap)
+{
+	for (uint32_t i = 0; i < s_Count; i++)
+		WriteTmp(i, ".raw", s_Files[i].data, s_Files[i].size);
+
+	uint64_t start = NowNs();
+	for (uint32_t r = 0; r < s_Rounds; r++) {
+		for (uint32_t i = 0; i < s_Count; i++)
+			ReadTmp(i, ".raw", buf, cap);
+	}
+	uint64_t ns = NowNs() - start;
+
+	for (uint32_t i = 0; i < s_Count; i++)
+		RemoveTmp(i, ".raw");
+
+	return ns / 1e6 / s_Rounds;
+}
+
+/*
+ * Bench
+ */
+static void Bench(int level, void *work, uint8_t *buf, uint8_t *out,
+	size_t cap, double rawLoadMs)
+{
+	uint64_t raw = 0, packed = 0;
+
+	uint64_t start = NowNs();
+	for (uint32_t i = 0; i < s_Count; i++) {
+		struct BenchFile *f = &s_Files[i];
+
+		f->packedSize = lz4_compress(f->data, f->size, f->packed,
+			lz4_compress_bound(f->size), level, work);
+		assert(f->packedSize != 0);
+
+		raw += f->size;
+		packed += f->packedSize;
+	}
+	double compressSecs = (NowNs() - start) / 1e9;
+
+	/* Decompression alone, checking it round trips the first time */
+	start = NowNs();
+	for (uint32_t r = 0; r < s_Rounds; r++) {
+		for (uint32_t i = 0; i < s_Count; i++) {
+			struct BenchFile *f = &s_Files[i];
+			size_t len;
+
+			if (lz4_decompress(f->packed, f->packedSize, out, cap,
+				&len) != LZ4_OK || len != f->size ||
+				(r == 0 && memcmp(out, f->data, len) != 0)) {
+				fprintf(stderr, "level %d didn't round trip\n",
+					level);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	double decompressSecs = (NowNs() - start) / 1e9;
+
+	/* Read and decompress */
+	for (uint32_t i = 0; i < s_Count; i++)
+		WriteTmp(i, ".lz4", s_Files[i].packed, s_Files[i].packedSize);
+
+	start = NowNs();
+	for (uint32_t r = 0; r < s_Rounds; r++) {
+		for (uint32_t i = 0; i < s_Count; i++) {
+			size_t n = ReadTmp(i, ".lz4", buf, cap), len;
+			lz4_decompress(buf, n, out, cap, &len);
+		}
+	}
+	double loadMs = (NowNs() - start) / 1e6 / s_Rounds;
+
+	for (uint32_t i = 0; i < s_Count; i++)
+		RemoveTmp(i, ".lz4");
+
+	double mb = raw / (1024.0 * 1024.0);
+	fprintf(s_Out, "%d,%u,%llu,%llu,%.3f,%.1f,%.1f,%.3f,%.3f\n", level,
+		s_Count, (unsigned long long) raw, (unsigned long long) packed,
+		(double) packed / raw, mb / compressSecs,
+		mb * s_Rounds / decompressSecs, loadMs, rawLoadMs);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *outName = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "o:n:")) != -1) {
+		switch (opt) {
+		case 'o':
+			outName = optarg;
+			break;
+		case 'n':
+			s_Rounds = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-o file] [-n rounds] "
+				"[file...]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	s_Out = stdout;
+	if (outName) {
+		s_Out = fopen(outName, "w");
+		if (!s_Out) {
+			fprintf(stderr, "couldn't open %s\n", outName);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc) {
+		for (int i = optind; i < argc; i++)
+			LoadFile(argv[i]);
+	} else {
+		Generate();
+	}
+
+	if (s_Rounds == 0 || s_Count == 0) {
+		fprintf(stderr, "nothing to do\n");
+		return EXIT_FAILURE;
+	}
+
+	if (!mkdtemp(s_TmpDir)) {
+		fprintf(stderr, "couldn't make a temporary directory\n");
+		return EXIT_FAILURE;
+	}
+
+	size_t cap = 0;
+	for (uint32_t i = 0; i < s_Count; i++) {
+		size_t bound = lz4_compress_bound(s_Files[i].size);
+		s_Files[i].packed = Xalloc(bound);
+		if (bound > cap)
+			cap = bound;
+	}
+
+	void *work = Xalloc(LZ4_WORK_SIZE);
+	uint8_t *buf = Xalloc(cap);
+	uint8_t *out = Xalloc(cap);
+
+	fprintf(s_Out, "level,files,raw_bytes,packed_bytes,ratio,"
+		"compress_mb_per_sec,decompress_mb_per_sec,load_ms,"
+		"raw_load_ms\n");
+
+	double rawLoadMs = TimeRawLoads(buf, cap);
+	for (int level = LZ4_MIN_LEVEL; level <= LZ4_MAX_LEVEL; level++)
+		Bench(level, work, buf, out, cap, rawLoadMs);
+
+	rmdir(s_TmpDir);
+
+	for (uint32_t i = 0; i < s_Count; i++) {
+		free(s_Files[i].data);
+		free(s_Files[i].packed);
+	}
+	free(s_Files);
+	free(work);
+	free(buf);
+	free(out);
+
+	if (s_Out != stdout)
+		fclose(s_Out);
+
+	return EXIT_SUCCESS;
+}
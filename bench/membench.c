@@ -0,0 +1,270 @@
+/*
+ * membench.c
+ *	Micro-benchmarks for the allocators: MemAlloc() / MemFree(),
+ *	PAlloc() / PFree() on fixed and POOL_DYNGROW pools, LAlloc() /
+ *	LAlloc_Reset() and sstrdup() / sstrfree().
+ *
+ *	Each run allocates a live set of blocks and then frees them all in
+ *	one of a few orders, over and over until it has done roughly
+ *	TARGET_OPS allocs + frees. Results go to stdout (or the file given
+ *	with -o) as CSV, one line per run, so they can be diffed or plotted
+ *	when the allocators change:
+ *
+ *	    mode,allocator,pattern,live,size,ops,ns_per_op,mops_per_sec
+ *
+ *	mode is "tracking" or "release" (see MEM_RELEASE in memory.h), since
+ *	MemAlloc() numbers mean very different things in the two.
+ *
+ *	Usage: membench [-o file] [-n ops]
+ */
+#include "base.h"
+#include "panic.h"
+#include "memory.h"
+#include <time.h>
+#include <unistd.h>
+
+#define TARGET_OPS	2000000
+#define MAX_LIVE	16384
+
+typedef enum pattern {
+	PAT_LIFO,	/* free in reverse order of allocation */
+	PAT_FIFO,	/* free in order of allocation */
+	PAT_RANDOM,	/* free in a shuffled order */
+	PAT_COUNT
+} pattern_t;
+
+static const char *s_PatternNames[PAT_COUNT] = {"lifo", "fifo", "random"};
+
+static const uint32_t s_LiveSets[] = {16, 256, 4096, MAX_LIVE};
+#define NUM_LIVE_SETS (sizeof(s_LiveSets) / sizeof(s_LiveSets[0]))
+
+static const size_t s_MemSizes[] = {16, 128, 1024, 8192};
+#define NUM_MEM_SIZES (sizeof(s_MemSizes) / sizeof(s_MemSizes[0]))
+
+#define POOL_BLOCK_SIZE	64
+#define LALLOC_SIZE	48
+
+static const char *s_SstrSource = "data/entities/some_entity_name.ent";
+
+static void *s_Blocks[MAX_LIVE];
+static uint32_t s_Order[PAT_COUNT][MAX_LIVE];
+static uint64_t s_TargetOps = TARGET_OPS;
+static FILE *s_Out = NULL;
+
+/* Don't want the benchmark depending on mtrand/dSFMT; xorshift is plenty
+ * for shuffling. */
+static uint32_t s_Rand = 2463534242u;
+
+static uint32_t NextRand()
+{
+	s_Rand ^= s_Rand << 13;
+	s_Rand ^= s_Rand >> 17;
+	s_Rand ^= s_Rand << 5;
+	return s_Rand;
+}
+
+/*
+ * MakeOrders
+ *	Fill out the order blocks are freed in for each pattern, for a live
+ *	set of the given size.
+ */
+static void MakeOrders(uint32_t live)
+{
+	for (uint32_t i = 0; i < live; i++) {
+		s_Order[PAT_LIFO][i] = live - 1 - i;
+		s_Order[PAT_FIFO][i] = i;
+		s_Order[PAT_RANDOM][i] = i;
+	}
+
+	for (uint32_t i = live - 1; i > 0; i--) {
+		uint32_t j = NextRand() % (i + 1);
+		uint32_t tmp = s_Order[PAT_RANDOM][i];
+		s_Order[PAT_RANDOM][i] = s_Order[PAT_RANDOM][j];
+		s_Order[PAT_RANDOM][j] = tmp;
+	}
+}
+
+static uint64_t NowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint32_t RoundsFor(uint32_t live)
+{
+	uint64_t rounds = s_TargetOps / (2 * live);
+	return rounds > 0 ? rounds : 1;
+}
+
+static void Report(const char *allocator, const char *pattern, uint32_t live,
+	size_t size, uint64_t ops, uint64_t ns)
+{
+	double nsPerOp = (double) ns / ops;
+
+	fprintf(s_Out, "%s,%s,%s,%u,%zu,%lu,%.2f,%.2f\n",
+#ifdef MEM_RELEASE
+		"release",
+#else
+		"tracking",
+#endif
+		allocator, pattern, live, size, ops, nsPerOp,
+		nsPerOp > 0 ? 1000.0 / nsPerOp : 0.0);
+	fflush(s_Out);
+}
+
+/*
+ * BenchMemAlloc
+ */
+static void BenchMemAlloc(uint32_t live, pattern_t pat, size_t size)
+{
+	uint32_t rounds = RoundsFor(live);
+	const uint32_t *order = s_Order[pat];
+
+	uint64_t start = NowNs();
+	for (uint32_t r = 0; r < rounds; r++) {
+		for (uint32_t i = 0; i < live; i++)
+			s_Blocks[i] = MemAlloc(size);
+		for (uint32_t i = 0; i < live; i++)
+			MemFree(s_Blocks[order[i]]);
+	}
+	uint64_t ns = NowNs() - start;
+
+	Report("memalloc", s_PatternNames[pat], live, size,
+		(uint64_t) rounds * live * 2, ns);
+}
+
+/*
+ * BenchPool
+ *	Dynamic pools start off small, so the first round includes growing
+ *	them to fit the live set.
+ */
+static void BenchPool(uint32_t live, pattern_t pat, pool_policy_t policy)
+{
+	uint32_t rounds = RoundsFor(live);
+	const uint32_t *order = s_Order[pat];
+
+	mem_pool_t *pool = create_pool(policy == POOL_DYNGROW ? 16 : live,
+		POOL_BLOCK_SIZE, policy, MEM_SYS_GENERAL, "membench");
+
+	uint64_t start = NowNs();
+	for (uint32_t r = 0; r < rounds; r++) {
+		for (uint32_t i = 0; i < live; i++)
+			s_Blocks[i] = PAlloc(pool);
+		for (uint32_t i = 0; i < live; i++)
+			PFree(pool, s_Blocks[order[i]]);
+	}
+	uint64_t ns = NowNs() - start;
+
+	destroy_pool(pool);
+
+	Report(policy == POOL_DYNGROW ? "pool_dyngrow" : "pool_fixed",
+		s_PatternNames[pat], live, POOL_BLOCK_SIZE,
+		(uint64_t) rounds * live * 2, ns);
+}
+
+/*
+ * BenchLAlloc
+ *	Linear allocators can only free everything at once, so there's just
+ *	the one pattern; each reset counts as an op.
+ */
+static void BenchLAlloc(uint32_t live)
+{
+	uint32_t rounds = RoundsFor(live);
+	LAllocState *state = LAlloc_CreateChained(16 * 1024, MEM_SYS_GENERAL,
+		"membench");
+
+	uint64_t start = NowNs();
+	for (uint32_t r = 0; r < rounds; r++) {
+		for (uint32_t i = 0; i < live; i++)
+			s_Blocks[i] = LAlloc(state, LALLOC_SIZE);
+		LAlloc_Reset(state);
+	}
+	uint64_t ns = NowNs() - start;
+
+	LAlloc_Destroy(state);
+
+	Report("lalloc", "reset", live, LALLOC_SIZE,
+		(uint64_t) rounds * (live + 1), ns);
+}
+
+/*
+ * BenchSstr
+ */
+static void BenchSstr(uint32_t live, pattern_t pat)
+{
+	uint32_t rounds = RoundsFor(live);
+	const uint32_t *order = s_Order[pat];
+
+	uint64_t start = NowNs();
+	for (uint32_t r = 0; r < rounds; r++) {
+		for (uint32_t i = 0; i < live; i++)
+			s_Blocks[i] = sstrdup(s_SstrSource);
+		for (uint32_t i = 0; i < live; i++)
+			sstrfree(s_Blocks[order[i]]);
+	}
+	uint64_t ns = NowNs() - start;
+
+	Report("sstr", s_PatternNames[pat], live, strlen(s_SstrSource) + 1,
+		(uint64_t) rounds * live * 2, ns);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *outName = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "o:n:")) != -1) {
+		switch (opt) {
+		case 'o':
+			outName = optarg;
+			break;
+		case 'n':
+			s_TargetOps = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-o file] [-n ops]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	s_Out = stdout;
+	if (outName) {
+		s_Out = fopen(outName, "w");
+		if (!s_Out) {
+			fprintf(stderr, "couldn't open %s\n", outName);
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* trace() goes to stdout too; keep it out of the results. */
+	set_trace_channels(0);
+	if (init_base() != EOK)
+		panic("Failed to init base");
+
+	fprintf(s_Out, "mode,allocator,pattern,live,size,ops,ns_per_op,"
+		"mops_per_sec\n");
+
+	for (uint32_t l = 0; l < NUM_LIVE_SETS; l++) {
+		uint32_t live = s_LiveSets[l];
+		MakeOrders(live);
+
+		for (pattern_t pat = 0; pat < PAT_COUNT; pat++) {
+			for (uint32_t s = 0; s < NUM_MEM_SIZES; s++)
+				BenchMemAlloc(live, pat, s_MemSizes[s]);
+
+			BenchPool(live, pat, POOL_FIXEDSIZE);
+			BenchPool(live, pat, POOL_DYNGROW);
+			BenchSstr(live, pat);
+		}
+
+		BenchLAlloc(live);
+	}
+
+	shutdown_base();
+
+	if (s_Out != stdout)
+		fclose(s_Out);
+
+	return EXIT_SUCCESS;
+}
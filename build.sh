@@ -9,7 +9,10 @@ BINDIR="../bin"
 CC=clang
 # _POSIX_C_SOURCE is defined to enable strdup() which isn't part of C99
 # TODO: Remove _POSIX_C_SOURCE? Replaced strdup(), for now...
-CFLAGS="-std=gnu99 -Wall -Wno-format-security -march=native -g -D_POSIX_C_SOURCE=200809L"
+CFLAGS="-std=gnu99 -Wall -Wno-format-security -march=native -g -pthread -D_POSIX_C_SOURCE=200809L"
+# Uncomment to swap the tagged MemAlloc() for the size-class slab allocator
+# (see memory.h). NDEBUG builds do this anyway.
+# CFLAGS="$CFLAGS -DMEM_RELEASE"
 LIBS="-lSDL2 -lSDL2_image -lSDL2_ttf -ltcl8.6 -L$BINDIR -lgus -L./dSFMT/ -ldsfmt"
 EXE="titan"
 
@@ -20,3 +23,20 @@ ar rcs $BINDIR/libgus.a $BINDIR/gus.o
 # build titan
 echo "Building $EXE..."
 $CC *.c $CFLAGS -Wno-missing-braces $LIBS -o $BINDIR/$EXE
+
+# build the allocator benchmarks; they only need the base and memory modules
+echo "Building benchmarks..."
+$CC bench/membench.c memory.c mem_slab.c mem_pool.c slot_map.c sstr.c intern.c \
+	hash.c base.c panic.c $CFLAGS -Wno-missing-braces -I. -o $BINDIR/membench
+$CC bench/hashbench.c hash.c $CFLAGS -I. -lm -o $BINDIR/hashbench
+$CC bench/lz4bench.c lz4.c $CFLAGS -I. -o $BINDIR/lz4bench
+
+# build the tests; run them from ../bin, they print "ok" if they pass
+echo "Building tests..."
+$CC tests/hashtest.c ch_hashtable.c memory.c mem_slab.c mem_pool.c slot_map.c \
+	sstr.c intern.c hash.c base.c panic.c $CFLAGS -Wno-missing-braces -I. \
+	-o $BINDIR/hashtest
+
+# build the tools
+echo "Building tools..."
+$CC tools/mkpak.c lz4.c $CFLAGS -I. -o $BINDIR/mkpak
@@ -0,0 +1,365 @@
+#include "base.h"
+#include "panic.h"
+#include "memory.h"
+#include "files.h"
+#include "intern.h"
+#include "ch_hashtable.h"
+#include "list.h"
+#include "cache.h"
+
+/* Assets are in a hash table keyed by the atom of their name. Assets with
+ * the same name but different types (rare) are chained off the one in the
+ * table. Unreferenced assets are also on s_LRU, oldest first.
+ */
+struct asset {
+	struct asset *next;		/* same name, other types */
+	struct list_head lru;		/* while unreferenced */
+
+	const asset_type_t *type;	/* NULL for plain files */
+	const char *name;		/* interned */
+	filehandle_t file;		/* plain files only */
+	void *obj;			/* typed assets only */
+	size_t size;
+	uint32_t refs;
+};
+
+#define DEFAULT_BUDGET	(32 * 1024 * 1024)
+#define INITIAL_ASSETS	256
+
+static hashtable_t *s_Assets = NULL;
+static LIST_HEAD(s_LRU);
+
+static uint64_t s_Budget = DEFAULT_BUDGET;
+static uint64_t s_Bytes = 0;		/* everything cached */
+static uint64_t s_IdleBytes = 0;	/* unreferenced */
+static uint32_t s_Count = 0;
+
+static uint64_t s_Hits = 0;
+static uint64_t s_Misses = 0;
+static uint64_t s_Evictions = 0;
+
+/*
+ * init_cache
+ */
+ecode_t init_cache(uint64_t budget)
+{
+	if (s_Assets != NULL) {
+		trace(CHAN_INFO, "asset cache already initialised");
+		return EFAIL;
+	}
+
+	s_Assets = create_hashtable(INITIAL_ASSETS, HT_KEY_INT,
+		MEM_SYS_FILES, "AssetCache");
+	s_Budget = budget ? budget : DEFAULT_BUDGET;
+
+	trace(CHAN_DBG, fmt("asset cache budget %u %s", SaneVal(s_Budget),
+		SaneAff(s_Budget)));
+
+	return EOK;
+}
+
+/*
+ * DestroyAsset
+ *	Unlink it from everything and free it.
+ */
+static void DestroyAsset(asset_t *a)
+{
+	uint64_t key = atom_of(a->name);
+	asset_t *head = HTGetInt(s_Assets, key);
+
+	if (head == a) {
+		if (a->next)
+			HTSetInt(s_Assets, key, a->next);
+		else
+			HTRemoveInt(s_Assets, key);
+	} else {
+		asset_t *prev = head;
+		while (prev->next != a)
+			prev = prev->next;
+		prev->next = a->next;
+	}
+
+	if (a->refs == 0) {
+		list_del(&a->lru);
+		s_IdleBytes -= a->size;
+	}
+
+	if (a->type)
+		a->type->free(a->obj);
+	else
+		close_file(a->file);
+
+	s_Bytes -= a->size;
+	s_Count--;
+	MemFree(a);
+}
+
+/*
+ * Evict
+ *	Free unreferenced assets, oldest first, until we're within budget.
+ */
+static void Evict()
+{
+	while (s_Bytes > s_Budget && !list_empty(&s_LRU)) {
+		asset_t *a = list_entry(s_LRU.next, asset_t, lru);
+
+		trace(CHAN_DBG, fmt("evicting %s", a->name));
+		DestroyAsset(a);
+		s_Evictions++;
+	}
+}
+
+/*
+ * shutdown_cache
+ */
+ecode_t shutdown_cache()
+{
+	if (!s_Assets) {
+		trace(CHAN_INFO, "asset cache not initialised");
+		return EFAIL;
+	}
+
+	cache_stats();
+
+	uint32_t leaked = 0;
+	ht_iter_t it = HTIterate(s_Assets);
+	void *val;
+
+	while (HTNext(&it, NULL, &val)) {
+		asset_t *a = val, *next;
+
+		for (; a; a = next) {
+			next = a->next;
+			if (a->refs) {
+				trace(CHAN_INFO, fmt("%s still has %u references",
+					a->name, a->refs));
+				leaked++;
+			}
+
+			/* Unlinking isn't needed; the table's going too */
+			if (a->type)
+				a->type->free(a->obj);
+			else
+				close_file(a->file);
+			MemFree(a);
+		}
+	}
+
+	if (leaked) {
+		trace(CHAN_INFO, fmt("%u assets were never released", leaked));
+	}
+
+	destroy_hashtable(s_Assets);
+	s_Assets = NULL;
+	INIT_LIST_HEAD(&s_LRU);
+	s_Bytes = s_IdleBytes = 0;
+	s_Count = 0;
+	s_Hits = s_Misses = s_Evictions = 0;
+
+	return EOK;
+}
+
+/*
+ * cache_get
+ */
+asset_t *cache_get(const asset_type_t *type, const char *name)
+{
+	assert(name != NULL);
+
+	if (!s_Assets) {
+		panic("asset cache not initialised");
+	}
+
+	const char *iname = intern(name);
+	uint64_t key = atom_of(iname);
+	asset_t *head = HTGetInt(s_Assets, key);
+
+	for (asset_t *a = head; a; a = a->next) {
+		if (a->type != type)
+			continue;
+
+		if (a->refs++ == 0) {
+			list_del(&a->lru);
+			s_IdleBytes -= a->size;
+		}
+
+		s_Hits++;
+		return a;
+	}
+
+	s_Misses++;
+
+	asset_t *a = MemAllocSys(sizeof(*a), MEM_SYS_FILES);
+	a->type = type;
+	a->name = iname;
+	a->refs = 1;
+
+	filehandle_t file = open_file(iname);
+	if (type) {
+		a->obj = type->load(file, iname, &a->size);
+		close_file(file);
+
+		if (!a->obj) {
+			panic(fmt("failed to load %s '%s'", type->name, iname));
+		}
+	} else {
+		a->file = file;
+		a->size = file_get_size(file);
+	}
+
+	a->next = head;
+	HTSetInt(s_Assets, key, a);
+	s_Bytes += a->size;
+	s_Count++;
+
+	Evict();
+
+	return a;
+}
+
+/*
+ * cache_release
+ */
+void cache_release(asset_t *a)
+{
+	assert(a != NULL);
+
+	if (a->refs == 0) {
+		panic(fmt("%s released too many times", a->name));
+	}
+
+	if (--a->refs > 0)
+		return;
+
+	list_add_tail(&a->lru, &s_LRU);
+	s_IdleBytes += a->size;
+
+	Evict();
+}
+
+asset_t *cache_ref(asset_t *a)
+{
+	assert(a != NULL && a->refs > 0);
+
+	a->refs++;
+	return a;
+}
+
+const uint8_t *asset_data(asset_t *a)
+{
+	assert(a != NULL && a->type == NULL);
+	return file_get_data(a->file);
+}
+
+size_t asset_size(asset_t *a)
+{
+	assert(a != NULL);
+	return a->size;
+}
+
+void *asset_object(asset_t *a)
+{
+	assert(a != NULL && a->type != NULL);
+	return a->obj;
+}
+
+const char *asset_name(asset_t *a)
+{
+	assert(a != NULL);
+	return a->name;
+}
+
+/*
+ * ReloadAsset
+ */
+static bool ReloadAsset(asset_t *a)
+{
+	filehandle_t file = open_file_ex(a->name, FILE_MAYFAIL);
+	if (file == FILE_INVALID)
+		return false;
+
+	size_t size;
+	if (a->type) {
+		void *obj = a->type->load(file, a->name, &size);
+		close_file(file);
+
+		if (!obj) {
+			trace(CHAN_INFO, fmt("failed to reload %s '%s'",
+				a->type->name, a->name));
+			return false;
+		}
+
+		a->type->free(a->obj);
+		a->obj = obj;
+	} else {
+		size = file_get_size(file);
+		close_file(a->file);
+		a->file = file;
+	}
+
+	s_Bytes += size - a->size;
+	if (a->refs == 0)
+		s_IdleBytes += size - a->size;
+	a->size = size;
+
+	return true;
+}
+
+/*
+ * cache_reload
+ */
+uint32_t cache_reload(const char *name)
+{
+	assert(name != NULL);
+
+	const char *iname = intern_find(name);
+	if (!s_Assets || !iname)
+		return 0;
+
+	uint32_t count = 0;
+	for (asset_t *a = HTGetInt(s_Assets, atom_of(iname)); a; a = a->next) {
+		if (ReloadAsset(a))
+			count++;
+	}
+
+	Evict();
+
+	return count;
+}
+
+/*
+ * cache_set_budget
+ */
+void cache_set_budget(uint64_t budget)
+{
+	s_Budget = budget ? budget : DEFAULT_BUDGET;
+	Evict();
+}
+
+/*
+ * cache_flush
+ */
+void cache_flush()
+{
+	uint64_t budget = s_Budget;
+
+	s_Budget = 0;
+	Evict();
+	s_Budget = budget;
+}
+
+/*
+ * cache_stats
+ */
+void cache_stats()
+{
+	uint64_t lookups = s_Hits + s_Misses;
+
+	trace(CHAN_MEM, fmt("Asset cache: %u assets, %u %s (%u %s idle) of "
+		"%u %s", s_Count, SaneVal(s_Bytes), SaneAff(s_Bytes),
+		SaneVal(s_IdleBytes), SaneAff(s_IdleBytes), SaneVal(s_Budget),
+		SaneAff(s_Budget)));
+	trace(CHAN_MEM, fmt("  %lu hits, %lu misses (%.1f%% hit rate), "
+		"%lu evictions", s_Hits, s_Misses,
+		lookups ? 100.0 * s_Hits / lookups : 0.0, s_Evictions));
+}
@@ -0,0 +1,73 @@
+/*
+ * cache.h
+ *	The asset cache. Sits on top of files.c so that everything loading
+ *	the same asset shares one copy of it: cache_get() returns the cached
+ *	asset if there is one (adding a reference) and only loads it if not,
+ *	and cache_release() drops the reference.
+ *
+ *	Assets nobody references aren't freed straight away; they stay
+ *	cached in case they're wanted again, until the total size of
+ *	everything cached goes over the budget. Then the least recently
+ *	released are evicted first. Referenced assets are never evicted, so
+ *	the budget can be exceeded if they add up to more than it.
+ *
+ *	An asset is either a plain file (type NULL), or something built from
+ *	one by an asset_type_t's load function: a texture, a parsed map, and
+ *	so on. Assets are looked up by name and type, so the same file can
+ *	be cached as more than one type. Names are interned.
+ *
+ *	Like files.c, cache_get() panic()s if the file can't be loaded.
+ *
+ *	Main thread only.
+ */
+#pragma once
+#include "files.h"
+
+typedef struct asset asset_t;
+
+typedef struct asset_type {
+	const char *name;
+
+	/* Build the asset from the file, setting *size to roughly how much
+	 * memory it uses. The file is closed afterwards, so copy anything
+	 * that's needed. Return NULL if it can't be done. */
+	void *(*load)(filehandle_t file, const char *name, size_t *size);
+	void (*free)(void *obj);
+} asset_type_t;
+
+/* budget is in bytes; 0 for the default. */
+ecode_t init_cache(uint64_t budget);
+ecode_t shutdown_cache();
+
+/* Get the named asset, loading it if it isn't cached. Each call needs a
+ * matching cache_release(). */
+asset_t *cache_get(const asset_type_t *type, const char *name);
+void cache_release(asset_t *asset);
+
+/* Another reference to an asset that's already referenced. */
+asset_t *cache_ref(asset_t *asset);
+
+/* The contents of a plain file asset. */
+const uint8_t *asset_data(asset_t *asset);
+size_t asset_size(asset_t *asset);
+
+/* What a typed asset's load function returned. */
+void *asset_object(asset_t *asset);
+
+/* The interned name. */
+const char *asset_name(asset_t *asset);
+
+/* Load the named file again and replace every cached asset made from it,
+ * for hot reloading (see watch.h). Pointers to the assets stay good, but
+ * what asset_data() and asset_object() return changes. Any that can't be
+ * reloaded are left as they were. Returns how many were replaced. */
+uint32_t cache_reload(const char *name);
+
+/* Change the budget, evicting if it's now exceeded. */
+void cache_set_budget(uint64_t budget);
+
+/* Evict everything that isn't referenced, e.g. between levels. */
+void cache_flush();
+
+/* Print hits, misses, evictions and usage. */
+void cache_stats();
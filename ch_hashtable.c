@@ -1 +1,491 @@
 #include "base.h"
+#include "panic.h"
+#include "memory.h"
+#include "hash.h"
+#include "ch_hashtable.h"
+
+/* Removed entries leave a tombstone so the probe sequences running through
+ * them still work. Tombstones count towards the load factor and get cleared
+ * out by the next resize.
+ */
+enum {
+	SLOT_EMPTY = 0,
+	SLOT_FULL,
+	SLOT_TOMB
+};
+
+struct HTEntry {
+	ht_key_t key;
+	void *val;
+	uint32_t hash;
+	uint32_t state;
+};
+
+struct HTTable {
+	struct HTEntry *entries;
+	uint32_t size;		/* always a power of two */
+	uint32_t used;
+	uint32_t tombs;
+};
+
+/* tables[1] is the one everything is added to. While resizing, tables[0]
+ * is the old one and entries up to migrated have been moved out of it;
+ * otherwise its entries are NULL. A key is only ever in one of them.
+ */
+struct hashtable {
+	struct HTTable tables[2];
+	uint32_t migrated;
+	ht_keytype_t keyType;
+	mem_sys_t sys;
+	const char *debugName;
+};
+
+#define MIN_SIZE	16
+
+/* Resize once this many out of 4 slots are full or tombstones. */
+#define MAX_LOAD	3
+
+/* Old slots looked at per HTSet() while resizing. */
+#define MIGRATE_STEP	32
+
+#define OLD(ht) (&(ht)->tables[0])
+#define CUR(ht) (&(ht)->tables[1])
+#define RESIZING(ht) ((ht)->tables[0].entries != NULL)
+
+/*
+ * HashInt
+ *	The murmur3 finaliser; integer keys are often sequential, so they
+ *	need scattering.
+ */
+static inline uint32_t HashInt(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdull;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ull;
+	k ^= k >> 33;
+	return (uint32_t) k;
+}
+
+static inline uint32_t HashKey(hashtable_t *ht, ht_key_t key)
+{
+	if (ht->keyType == HT_KEY_STR)
+		return hash(key.str, strlen(key.str));
+
+	return HashInt(key.num);
+}
+
+static inline bool SameKey(hashtable_t *ht, ht_key_t a, ht_key_t b)
+{
+	if (ht->keyType == HT_KEY_STR)
+		return strcmp(a.str, b.str) == 0;
+
+	return a.num == b.num;
+}
+
+static void CheckKeyType(hashtable_t *ht, ht_keytype_t type)
+{
+	assert(ht != NULL);
+
+	if (ht->keyType != type) {
+		panic(fmt("'%s' has %s keys", ht->debugName,
+			ht->keyType == HT_KEY_STR ? "string" : "integer"));
+	}
+}
+
+static void AllocTable(hashtable_t *ht, struct HTTable *t, uint32_t size)
+{
+	t->entries = MemAllocSys(size * sizeof(*t->entries), ht->sys);
+	t->size = size;
+	t->used = 0;
+	t->tombs = 0;
+}
+
+static void FreeTable(struct HTTable *t)
+{
+	MemFree(t->entries);
+	memset(t, 0, sizeof(*t));
+}
+
+/*
+ * Find
+ *	Returns the entry for key in the given table, or NULL.
+ */
+static struct HTEntry *Find(hashtable_t *ht, struct HTTable *t,
+	ht_key_t key, uint32_t h)
+{
+	if (!t->entries || t->used == 0)
+		return NULL;
+
+	uint32_t mask = t->size - 1;
+
+	for (uint32_t i = h & mask; ; i = (i + 1) & mask) {
+		struct HTEntry *e = &t->entries[i];
+
+		if (e->state == SLOT_EMPTY)
+			return NULL;
+
+		if (e->state == SLOT_FULL && e->hash == h &&
+			SameKey(ht, e->key, key))
+			return e;
+	}
+}
+
+/*
+ * Place
+ *	Put an entry that's known not to be in the table into the first free
+ *	slot along its probe sequence.
+ */
+static void Place(struct HTTable *t, ht_key_t key, uint32_t h, void *val)
+{
+	uint32_t mask = t->size - 1;
+	uint32_t i = h & mask;
+
+	/* There has to be a free slot, or this never finishes */
+	assert(t->used < t->size);
+
+	while (t->entries[i].state == SLOT_FULL)
+		i = (i + 1) & mask;
+
+	struct HTEntry *e = &t->entries[i];
+	if (e->state == SLOT_TOMB)
+		t->tombs--;
+
+	e->key = key;
+	e->val = val;
+	e->hash = h;
+	e->state = SLOT_FULL;
+	t->used++;
+}
+
+/*
+ * Migrate
+ *	Move the entries from up to count more of the old table's slots
+ *	into the new one, freeing the old table once it's empty. Moved
+ *	entries become tombstones so lookups in the old table still work.
+ */
+static void Migrate(hashtable_t *ht, uint32_t count)
+{
+	struct HTTable *old = OLD(ht);
+
+	while (count-- > 0 && ht->migrated < old->size) {
+		struct HTEntry *e = &old->entries[ht->migrated++];
+
+		if (e->state != SLOT_FULL)
+			continue;
+
+		Place(CUR(ht), e->key, e->hash, e->val);
+		e->state = SLOT_TOMB;
+		old->used--;
+	}
+
+	if (ht->migrated == old->size || old->used == 0)
+		FreeTable(old);
+}
+
+/*
+ * StartResize
+ *	Make a new table big enough that everything (and the entry about to
+ *	be added) fits in half of it, and start moving things over. It might
+ *	be the same size as the current one, if it was mostly tombstones.
+ *	If the last resize hasn't finished, whatever's left in its old table
+ *	goes straight into the new one, so that has to be counted too.
+ */
+static void StartResize(hashtable_t *ht)
+{
+	struct HTTable left = {0};
+	uint32_t leftFrom = 0;
+
+	if (RESIZING(ht)) {
+		left = *OLD(ht);
+		leftFrom = ht->migrated;
+	}
+
+	uint32_t want = (CUR(ht)->used + left.used + 1) * 2;
+	uint32_t size = MIN_SIZE;
+	while (size < want)
+		size *= 2;
+
+	trace(CHAN_DBG, fmt("'%s' resizing %u -> %u", ht->debugName,
+		CUR(ht)->size, size));
+
+	*OLD(ht) = *CUR(ht);
+	AllocTable(ht, CUR(ht), size);
+	ht->migrated = 0;
+
+	if (!left.entries)
+		return;
+
+	for (uint32_t i = leftFrom; i < left.size; i++) {
+		struct HTEntry *e = &left.entries[i];
+
+		if (e->state == SLOT_FULL)
+			Place(CUR(ht), e->key, e->hash, e->val);
+	}
+
+	FreeTable(&left);
+}
+
+/*
+ * create_hashtable
+ */
+hashtable_t *create_hashtable(uint32_t capacity,
+	ht_keytype_t keyType,
+	mem_sys_t sys,
+	const char *debugName)
+{
+	hashtable_t *ht = MemAllocSys(sizeof(*ht), sys);
+	ht->keyType = keyType;
+	ht->sys = sys;
+	ht->debugName = debugName ? debugName : "unnamed";
+
+	uint32_t size = MIN_SIZE;
+	while (size * MAX_LOAD / 4 < capacity)
+		size *= 2;
+
+	AllocTable(ht, CUR(ht), size);
+	return ht;
+}
+
+/*
+ * FreeKeys
+ *	String keys belong to the table.
+ */
+static void FreeKeys(hashtable_t *ht, struct HTTable *t)
+{
+	if (ht->keyType != HT_KEY_STR || !t->entries)
+		return;
+
+	for (uint32_t i = 0; i < t->size; i++) {
+		if (t->entries[i].state == SLOT_FULL)
+			sstrfree((char *) t->entries[i].key.str);
+	}
+}
+
+/*
+ * destroy_hashtable
+ */
+void destroy_hashtable(hashtable_t *ht)
+{
+	assert(ht != NULL);
+
+	FreeKeys(ht, OLD(ht));
+	FreeKeys(ht, CUR(ht));
+
+	if (RESIZING(ht))
+		FreeTable(OLD(ht));
+	FreeTable(CUR(ht));
+
+	MemFree(ht);
+}
+
+/*
+ * HTClear
+ */
+void HTClear(hashtable_t *ht)
+{
+	assert(ht != NULL);
+
+	FreeKeys(ht, OLD(ht));
+	FreeKeys(ht, CUR(ht));
+
+	if (RESIZING(ht))
+		FreeTable(OLD(ht));
+
+	struct HTTable *cur = CUR(ht);
+	memset(cur->entries, 0, cur->size * sizeof(*cur->entries));
+	cur->used = 0;
+	cur->tombs = 0;
+}
+
+/*
+ * Lookup
+ */
+static struct HTEntry *Lookup(hashtable_t *ht, ht_key_t key, uint32_t h)
+{
+	struct HTEntry *e = Find(ht, CUR(ht), key, h);
+
+	if (!e && RESIZING(ht))
+		e = Find(ht, OLD(ht), key, h);
+
+	return e;
+}
+
+/*
+ * Set
+ */
+static void Set(hashtable_t *ht, ht_key_t key, void *val)
+{
+	uint32_t h = HashKey(ht, key);
+
+	if (RESIZING(ht))
+		Migrate(ht, MIGRATE_STEP);
+
+	struct HTEntry *e = Find(ht, CUR(ht), key, h);
+	if (e) {
+		e->val = val;
+		return;
+	}
+
+	/* Not moved over yet; take it out of the old table and carry on as
+	 * if it were new, but keep its copy of the key. */
+	e = RESIZING(ht) ? Find(ht, OLD(ht), key, h) : NULL;
+	if (e) {
+		key = e->key;
+		e->state = SLOT_TOMB;
+		OLD(ht)->used--;
+	} else if (ht->keyType == HT_KEY_STR) {
+		key.str = sstrdup(key.str);
+	}
+
+	struct HTTable *cur = CUR(ht);
+	if ((cur->used + cur->tombs + 1) * 4 > cur->size * MAX_LOAD)
+		StartResize(ht);
+
+	Place(CUR(ht), key, h, val);
+}
+
+/*
+ * Remove
+ */
+static void *Remove(hashtable_t *ht, ht_key_t key)
+{
+	uint32_t h = HashKey(ht, key);
+	struct HTTable *t = CUR(ht);
+	struct HTEntry *e = Find(ht, t, key, h);
+
+	if (!e && RESIZING(ht)) {
+		t = OLD(ht);
+		e = Find(ht, t, key, h);
+	}
+
+	if (!e)
+		return NULL;
+
+	void *val = e->val;
+	if (ht->keyType == HT_KEY_STR)
+		sstrfree((char *) e->key.str);
+
+	e->state = SLOT_TOMB;
+	t->used--;
+	if (t == CUR(ht))
+		t->tombs++;
+
+	return val;
+}
+
+/*
+ * String keys
+ */
+void HTSetStr(hashtable_t *ht, const char *key, void *val)
+{
+	assert(key != NULL);
+	CheckKeyType(ht, HT_KEY_STR);
+
+	Set(ht, (ht_key_t) {.str = key}, val);
+}
+
+void *HTGetStr(hashtable_t *ht, const char *key)
+{
+	assert(key != NULL);
+	CheckKeyType(ht, HT_KEY_STR);
+
+	ht_key_t k = {.str = key};
+	struct HTEntry *e = Lookup(ht, k, HashKey(ht, k));
+	return e ? e->val : NULL;
+}
+
+bool HTHasStr(hashtable_t *ht, const char *key)
+{
+	assert(key != NULL);
+	CheckKeyType(ht, HT_KEY_STR);
+
+	ht_key_t k = {.str = key};
+	return Lookup(ht, k, HashKey(ht, k)) != NULL;
+}
+
+void *HTRemoveStr(hashtable_t *ht, const char *key)
+{
+	assert(key != NULL);
+	CheckKeyType(ht, HT_KEY_STR);
+
+	return Remove(ht, (ht_key_t) {.str = key});
+}
+
+/*
+ * Integer keys
+ */
+void HTSetInt(hashtable_t *ht, uint64_t key, void *val)
+{
+	CheckKeyType(ht, HT_KEY_INT);
+	Set(ht, (ht_key_t) {.num = key}, val);
+}
+
+void *HTGetInt(hashtable_t *ht, uint64_t key)
+{
+	CheckKeyType(ht, HT_KEY_INT);
+
+	ht_key_t k = {.num = key};
+	struct HTEntry *e = Lookup(ht, k, HashInt(key));
+	return e ? e->val : NULL;
+}
+
+bool HTHasInt(hashtable_t *ht, uint64_t key)
+{
+	CheckKeyType(ht, HT_KEY_INT);
+
+	ht_key_t k = {.num = key};
+	return Lookup(ht, k, HashInt(key)) != NULL;
+}
+
+void *HTRemoveInt(hashtable_t *ht, uint64_t key)
+{
+	CheckKeyType(ht, HT_KEY_INT);
+	return Remove(ht, (ht_key_t) {.num = key});
+}
+
+uint32_t HTCount(hashtable_t *ht)
+{
+	assert(ht != NULL);
+	return OLD(ht)->used + CUR(ht)->used;
+}
+
+/*
+ * HTIterate
+ */
+ht_iter_t HTIterate(hashtable_t *ht)
+{
+	assert(ht != NULL);
+
+	ht_iter_t it = {ht, RESIZING(ht) ? 0 : 1, 0};
+	return it;
+}
+
+/*
+ * HTNext
+ */
+bool HTNext(ht_iter_t *it, ht_key_t *key, void **val)
+{
+	assert(it != NULL);
+
+	while (it->table < 2) {
+		struct HTTable *t = &it->ht->tables[it->table];
+
+		while (t->entries && it->index < t->size) {
+			struct HTEntry *e = &t->entries[it->index++];
+			if (e->state != SLOT_FULL)
+				continue;
+
+			if (key)
+				*key = e->key;
+			if (val)
+				*val = e->val;
+			return true;
+		}
+
+		it->table++;
+		it->index = 0;
+	}
+
+	return false;
+}
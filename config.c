@@ -38,6 +38,36 @@ handler(void *usr, const char *sec, const char *key, const char *val)
                 sstrfree(dup);
 	} else if (MATCH("FileSystem", "FilesRoot")) {
 		g_Config.filesRoot = sstrdup(val);
+	} else if (MATCH("FileSystem", "Pack")) {
+		sstrfree(g_Config.pack);
+		g_Config.pack = sstrdup(val);
+	} else if (MATCH("FileSystem", "MapFiles")) {
+		char *dup = sstrdup_lower(val);
+		g_Config.mapFiles = strcmp(dup, "true") == 0 ||
+			strcmp(dup, "on") == 0;
+		sstrfree(dup);
+	} else if (MATCH("FileSystem", "HotReload")) {
+		char *dup = sstrdup_lower(val);
+		g_Config.hotReload = strcmp(dup, "true") == 0 ||
+			strcmp(dup, "on") == 0;
+		sstrfree(dup);
+	} else if (MATCH("FileSystem", "CacheBudget")) {
+		g_Config.cacheBudget = strtoull(val, NULL, 10) * 1024;
+	} else if (MATCH("Debug", "WarnMissingProperties")) {
+		char *dup = sstrdup_lower(val);
+		g_Config.warnMissingProps = strcmp(dup, "true") == 0 ||
+			strcmp(dup, "on") == 0;
+		sstrfree(dup);
+	} else if (strcmp(sec, "MemoryBudgets") == 0) {
+		mem_sys_t sys = MemSysFromName(key);
+		if (sys == MEM_SYS_COUNT) {
+			trace(CHAN_INFO, fmt("unknown subsystem '%s' in [%s]",
+				key, sec));
+			return 1;
+		}
+
+		g_Config.memBudgets[sys] = strtoull(val, NULL, 10) * 1024;
+		MemSetBudget(sys, g_Config.memBudgets[sys]);
 	}
 
 	return 1;
@@ -76,6 +106,7 @@ ecode_t save_config(const char *filename)
         sstrfree(g_Config.gameName);
         sstrfree(g_Config.version);
         sstrfree(g_Config.filesRoot);
+        sstrfree(g_Config.pack);
 
 	return EOK;
 }
@@ -1,5 +1,6 @@
 #ifndef __CONFIG_H__
 #define __CONFIG_H__
+#include "memory.h"
 
 /* Holds configuration data, loaded at startup
  * and saved at exit. Available globally as g_Config.
@@ -20,6 +21,18 @@ struct ConfigData {
 
 	/* filesystem */
 	char *filesRoot;
+	bool mapFiles;
+	char *pack;		/* mounted at startup if set */
+	uint64_t cacheBudget;	/* KB in the file, bytes here; 0 for default */
+	bool hotReload;		/* watch filesRoot for changes */
+
+	/* debug */
+	bool warnMissingProps;	/* trace() entity property misses */
+
+	/* memorybudgets: KB in the file, bytes here, 0 for no budget. The
+	 * keys are MemSysName()s. They're handed to MemSetBudget() as soon
+	 * as they're read. */
+	uint64_t memBudgets[MEM_SYS_COUNT];
 };
 
 extern struct ConfigData g_Config;
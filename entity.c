@@ -3,35 +3,72 @@
 #include "memory.h"
 #include "panic.h"
 #include "globals.h"
+#include "config.h"
 #include "ini.h"
 #include "files.h"
-
-/* Not using a mem_pool_t here because we need to iterate over the entities
- * all the time. I *could* use a mem_pool_t, but I'd have to either A) change
- * the mem_pool_t API to include iteration, or B) keep an array of pointers
- * like this anyway / be redundant.
+#include "cache.h"
+#include "watch.h"
+#include "intern.h"
+#include "ch_hashtable.h"
+#include "keys.h"
+
+/* Entities are kept in a slot map rather than a mem_pool_t because we need
+ * to iterate over them all the time; the slot map keeps the live ones
+ * packed together so that's cheap.
  */
-#define MAX_ENTITIES	64
-static entity_t *s_Entities[MAX_ENTITIES] = {NULL};
+#define MAX_ENTITIES	1024
+static slot_map_t *s_Entities = NULL;
 
 #define DEFAULT_ENTDEF_FILE "./res/ent/default.ent"
 
+/* Each class's definition is parsed once, the first time it's spawned, into
+ * a template that's kept in the asset cache until shutdown_entities().
+ * Entities read through to their class's template, and only get their own
+ * copy of a property when it's set on them, so spawning doesn't touch the
+ * disk or allocate anything per property.
+ */
+struct ent_class {
+        struct property_tbl props;      /* never changed once loaded */
+        const char *class;              /* interned */
+        const char *name;
+        vec2_t pos;
+        vec2_t vel;
+};
+
+static void *load_class(filehandle_t file, const char *entfile, size_t *size);
+static void free_class(void *obj);
+
+static const asset_type_t s_ClassType = {
+        "entity class", load_class, free_class
+};
+
+/* Spawn name's atom -> asset_t of its template. Each holds a reference. */
+static hashtable_t *s_Classes = NULL;
+#define INITIAL_CLASSES 64
+
+static void reload_definition(const char *name, void *user);
+
+/* Property tables start with this many slots and double when they're
+ * three quarters full. */
+#define PROPS_INITIAL   8
+#define PROPS_MAX_LOAD  3
+
 /*
  * init_entities
- *	Allocate the Entity pool and set them all to unused, ready for
- *	Ent_New() to make use of them.
+ *	Create the Entity slot map, ready for Ent_New() to make use of.
  */
 ecode_t init_entities()
 {
-	if (s_Entities[0] != NULL) {
+	if (s_Entities != NULL) {
 		trace(CHAN_INFO, "Entity manager already initialised");
 		return EFAIL;
 	}
 
-	for (int i = 0; i < MAX_ENTITIES; i++) {
-		s_Entities[i] = MemAlloc(sizeof(struct entity));
-		s_Entities[i]->inUse = false;
-	}
+	s_Entities = create_slot_map(MAX_ENTITIES, sizeof(entity_t),
+		NULL, MEM_SYS_ENTITIES, "entities");
+	s_Classes = create_hashtable(INITIAL_CLASSES, HT_KEY_INT,
+		MEM_SYS_ENTITIES, "EntityClasses");
+	watch_add_handler(".ent", reload_definition, NULL);
 
 	trace(CHAN_DBG, fmt("Allocated entity pool size %d", MAX_ENTITIES));
 
@@ -40,77 +77,239 @@ ecode_t init_entities()
 
 /*
  * shutdown_entities
- *	Free the Entity pool and NULL it out.
+ *	Free every live Entity, then the slot map, and NULL it out.
  */
 ecode_t shutdown_entities()
 {
-	if (s_Entities[0] == NULL) {
+	if (s_Entities == NULL) {
 		trace(CHAN_INFO, "Already called or init_entities not called");
 		return EFAIL;
 	}
 
-	for (int i = 0; i < MAX_ENTITIES; i++) {
-		if (s_Entities[i] != NULL) {
-                        Ent_Free(s_Entities[i]);
-			MemFree(s_Entities[i]);
-                }
+        uint32_t count = SMCount(s_Entities);
+        entity_t *ent = NULL;
+        slot_map_for_each(ent, s_Entities) {
+                Ent_Free(ent);
+        }
 
-		s_Entities[i] = NULL;
-	}
+        watch_remove_handler(".ent", reload_definition);
+        destroy_slot_map(s_Entities);
+        s_Entities = NULL;
+
+        ht_iter_t it = HTIterate(s_Classes);
+        void *proto;
+        while (HTNext(&it, NULL, &proto))
+                cache_release(proto);
 
-	trace(CHAN_DBG, fmt("Freed %d entities", MAX_ENTITIES));
+        destroy_hashtable(s_Classes);
+        s_Classes = NULL;
+
+	trace(CHAN_DBG, fmt("Freed %u entities", count));
 
 	return EOK;
 }
 
+/*
+ * find_property
+ *      Return the value of the property in the table, or NULL. Keys are
+ *      interned, so comparing them is comparing pointers, and their hashes
+ *      are already worked out.
+ */
+static const char *find_property(const struct property_tbl *ptbl,
+        const char *ikey)
+{
+        if (!ptbl->slots)
+                return NULL;
+
+        uint32_t i = intern_hash(ikey) & ptbl->mask;
+        for (;;) {
+                const struct property *p = &ptbl->slots[i];
+                if (p->key == ikey)
+                        return p->val;
+                if (!p->key)
+                        return NULL;
+
+                i = (i + 1) & ptbl->mask;
+        }
+}
+
+/*
+ * insert_property
+ *      Put the property in the first free slot for it. The key mustn't be
+ *      in the table already, and there must be room.
+ */
+static void insert_property(struct property_tbl *ptbl, const char *ikey,
+        char *val)
+{
+        uint32_t i = intern_hash(ikey) & ptbl->mask;
+        while (ptbl->slots[i].key)
+                i = (i + 1) & ptbl->mask;
+
+        ptbl->slots[i].key = ikey;
+        ptbl->slots[i].val = val;
+        ptbl->size++;
+}
+
+/*
+ * grow_property_table
+ */
+static void grow_property_table(struct property_tbl *ptbl)
+{
+        struct property *old = ptbl->slots;
+        uint32_t oldCount = old ? ptbl->mask + 1 : 0;
+        uint32_t count = old ? oldCount * 2 : PROPS_INITIAL;
+
+        ptbl->slots = MemAllocSys(count * sizeof(*ptbl->slots),
+                MEM_SYS_ENTITIES);
+        ptbl->mask = count - 1;
+        ptbl->size = 0;
+
+        for (uint32_t i = 0; i < oldCount; i++) {
+                if (old[i].key)
+                        insert_property(ptbl, old[i].key, old[i].val);
+        }
+
+        MemFree(old);
+}
+
+/*
+ * set_property
+ *      Add the property to the table, or replace its value.
+ */
+static void set_property(struct property_tbl *ptbl, const char *ikey,
+        const char *val)
+{
+        if (ptbl->slots) {
+                uint32_t i = intern_hash(ikey) & ptbl->mask;
+                for (; ptbl->slots[i].key; i = (i + 1) & ptbl->mask) {
+                        if (ptbl->slots[i].key == ikey) {
+                                sstrfree(ptbl->slots[i].val);
+                                ptbl->slots[i].val = sstrdup_lower(val);
+                                return;
+                        }
+                }
+        }
+
+        if (!ptbl->slots ||
+            (ptbl->size + 1) * 4 > (ptbl->mask + 1) * PROPS_MAX_LOAD)
+                grow_property_table(ptbl);
+
+        insert_property(ptbl, ikey, sstrdup_lower(val));
+}
+
 // TODO: use sections?
 static int
 handle_prop(void *usr, const char *sec, const char *key, const char *val)
 {
         //trace(CHAN_DBG, fmt("[%s] %s=%s", sec, key, val));
 
-        struct property_tbl *prop_tbl = usr;
-        struct property *prop = MemAlloc(sizeof(*prop));
-        prop->key = sstrdup_lower(key);
-        prop->val = sstrdup_lower(val);
-        list_add(&prop->list, &prop_tbl->props);
-        prop_tbl->size++;
+        set_property(usr, intern_lower(key), val);
 
         return 1;
 }
 
 /*
- * load_properties
- *      Load and parse the specified entity definition file.
+ * free_property_table
  */
-static void load_properties(entity_t *ent, const char *entfile)
+static void free_property_table(struct property_tbl *ptbl)
 {
-        assert(ent != NULL);
-        assert(entfile != NULL);
+        assert(ptbl != NULL);
+
+        for (uint32_t i = 0; ptbl->slots && i <= ptbl->mask; i++) {
+                if (ptbl->slots[i].key)
+                        sstrfree(ptbl->slots[i].val);
+        }
 
+        MemFree(ptbl->slots);
+        memset(ptbl, 0, sizeof(*ptbl));
+}
+
+/*
+ * load_class
+ *      Parse an entity definition file (relative to the files root) into a
+ *      template. Returns NULL, and the cache keeps any old one, if it's no
+ *      good.
+ */
+static void *load_class(filehandle_t file, const char *entfile, size_t *size)
+{
         trace(CHAN_DBG, fmt("loading %s", entfile));
 
-        if (ini_parse(entfile, handle_prop, &ent->properties) < 0) {
-                panic(fmt("Failed to parse entity defintion '%s'", entfile));
+        struct ent_class *c = MemAllocSys(sizeof(*c), MEM_SYS_ENTITIES);
+
+        if (ini_parse_buffer((const char *) file_get_data(file),
+            file_get_size(file), handle_prop, &c->props) < 0) {
+                trace(CHAN_INFO, fmt("Failed to parse entity defintion '%s'",
+                        entfile));
+                free_class(c);
+                return NULL;
+        }
+
+        /* Must have a class specified, set name to 'unnamed' if it wasn't */
+        c->class = find_property(&c->props, KEY(CLASS));
+        if (!c->class) {
+                trace(CHAN_INFO, fmt("no class defined in %s", entfile));
+                free_class(c);
+                return NULL;
+        }
+        c->class = intern(c->class);
+
+        c->name = find_property(&c->props, KEY(NAME));
+        if (!c->name)
+                c->name = "unnamed";
+
+        /* If an initial position and velocity were specified, parse them */
+        const char *pos = find_property(&c->props, KEY(POS));
+        const char *vel = find_property(&c->props, KEY(VEL));
+        if (pos) {
+                VParseStr(pos, c->pos);
+        }
+
+        if (vel) {
+                VParseStr(vel, c->vel);
+        }
+
+        *size = sizeof(*c);
+        for (uint32_t i = 0; c->props.slots && i <= c->props.mask; i++) {
+                *size += sizeof(struct property);
+                if (c->props.slots[i].key)
+                        *size += sstrlen(c->props.slots[i].val) + 1;
         }
 
-        trace(CHAN_DBG, fmt("loaded %u properties", ent->properties.size));
+        trace(CHAN_DBG, fmt("loaded %u properties", c->props.size));
+
+        return c;
 }
 
 /*
- * free_property_table
+ * free_class
  */
-static void free_property_table(struct property_tbl *ptbl)
+static void free_class(void *obj)
 {
-        assert(ptbl != NULL);
+        struct ent_class *c = obj;
 
-        struct property *i, *tmp;
-        list_for_each_entry_safe(i, tmp, &ptbl->props, list) {
-                sstrfree(i->key);
-                sstrfree(i->val);
-                list_del(&i->list);
-                MemFree(i);
-        }
+        free_property_table(&c->props);
+        MemFree(c);
+}
+
+/*
+ * find_class
+ *      Return the template for the class, loading it if this is the first
+ *      one spawned.
+ */
+static asset_t *find_class(const char *class)
+{
+        atom_t atom = intern_atom(class);
+        asset_t *proto = HTGetInt(s_Classes, atom);
+        if (proto)
+                return proto;
+
+        char *entfile = SSTRJOIN(SV_LIT("ent/"), sv(class), SV_LIT(".ent"));
+        proto = cache_get(&s_ClassType, entfile);
+        sstrfree(entfile);
+
+        HTSetInt(s_Classes, atom, proto);
+
+        return proto;
 }
 
 /*
@@ -142,31 +341,26 @@ static void set_basic_fields(entity_t *ent)
         ent->visible = true;
         ent->render = EntityDefaultRender;
 
-        INIT_LIST_HEAD(&ent->properties.props);
+        memset(&ent->properties, 0, sizeof(ent->properties));
 }
 
 /*
  * Ent_New
- *	Return a pointer to the first unused Entity in the pool.
- *	If we don't find one, panic().
+ *	Return a pointer to a fresh, zeroed Entity from the slot map.
+ *	SMAlloc() panic()s if there aren't any left.
  */
 entity_t *Ent_New()
 {
-	if (s_Entities[0] == NULL) {
+	if (s_Entities == NULL) {
 		panic("Entity pool not initialised");
 	}
 
-	for (int i = 0; i < MAX_ENTITIES; i++) {
-		if (!s_Entities[i]->inUse) {
-			trace(CHAN_DBG, fmt("Entity slot %d selected", i));
+        entity_t *ent = NULL;
+        slot_handle_t handle = SMAlloc(s_Entities, (void **) &ent);
+        ent->handle = handle;
+	trace(CHAN_DBG, fmt("Entity handle %08x selected", ent->handle));
 
-			s_Entities[i]->inUse = true;
-			return s_Entities[i];
-		}
-	}
-
-	panic("No free Entities");
-	return NULL; /* not reached; shuts warning up */
+        return ent;
 }
 
 /*
@@ -176,49 +370,38 @@ ecode_t Ent_Free(entity_t *ent)
 {
 	assert(ent != NULL);
 
-	for (int i = 0; i < MAX_ENTITIES; i++) {
-		if (s_Entities[i] == ent) {
-			// trace(CHAN_DBG,
-			// 	fmt("marking entity in slot %d as free", i));
-
-                        if (s_Entities[i]->inUse) {
-        			s_Entities[i]->inUse = false;
-                                free_property_table(&s_Entities[i]->properties);
-                        }
+        if (SMGet(s_Entities, ent->handle) != ent) {
+                panic("Invalid entity_t pointer");
+        }
 
-			return EOK;
-		}
-	}
+        free_property_table(&ent->properties);
+        SMFree(s_Entities, ent->handle);
 
-	panic("Invalid entity_t pointer");
-	return EFAIL; /* not reached */
+        return EOK;
 }
 
 /*
- * parse_loaded_properties
+ * Ent_Get
  */
-static void parse_loaded_properties(entity_t *ent, const char *entfile)
+entity_t *Ent_Get(slot_handle_t handle)
 {
-        /* Must have a class specified, set name to 'unnamed' if it wasn't */
-        ent->class = Ent_GetProperty(ent, "class");
-        if (!ent->class) {
-                panic(fmt("no class defined in %s", entfile));
-        }
+        return SMGet(s_Entities, handle);
+}
 
-        ent->name = Ent_GetProperty(ent, "name");
-        if (!ent->name)
-        	ent->name = "unnamed";
+/*
+ * set_identity
+ *      Point class and name at their properties, the entity's own if it
+ *      has them.
+ */
+static void set_identity(entity_t *ent)
+{
+        const struct ent_class *c = asset_object(ent->proto);
 
-        /* If an initial position and velocity were specified, parse them */
-        const char *pos = Ent_GetProperty(ent, "pos");
-        const char *vel = Ent_GetProperty(ent, "vel");
-        if (pos) {
-                VParseStr(pos, ent->pos);
-        }
+        const char *class = find_property(&ent->properties, KEY(CLASS));
+        ent->class = class ? intern(class) : c->class;
 
-        if (vel) {
-                VParseStr(vel, ent->vel);
-        }
+        const char *name = find_property(&ent->properties, KEY(NAME));
+        ent->name = name ? name : c->name;
 }
 
 /*
@@ -231,35 +414,66 @@ entity_t *Ent_Spawn(const char *class)
         entity_t *ent = Ent_New();
         set_basic_fields(ent);
 
-        char *root = sstrcat(get_root_path(), "ent/");
-        char *full = sstrfname(root, class, ".ent");
-        load_properties(ent, full);
-        parse_loaded_properties(ent, full);
+        ent->proto = find_class(class);
+        set_identity(ent);
+
+        const struct ent_class *c = asset_object(ent->proto);
+        VCopy(ent->pos, c->pos);
+        VCopy(ent->vel, c->vel);
 
-        sstrfree(full);
-        sstrfree(root);
         return ent;
 }
 
 
+/*
+ * Ent_FindProperty
+ */
+const char *Ent_FindProperty(entity_t *ent, const char *ikey)
+{
+        assert(ent != NULL);
+        assert(ikey != NULL);
+
+        const char *val = find_property(&ent->properties, ikey);
+        if (val)
+                return val;
+
+        if (ent->proto) {
+                struct ent_class *c = asset_object(ent->proto);
+
+                val = find_property(&c->props, ikey);
+                if (val)
+                        return val;
+        }
+
+        /* Looking for optional properties is normal, and this is called
+         * every frame, so only complain when asked to */
+        if (g_Config.warnMissingProps) {
+                trace(CHAN_GAME, fmt("Warning: entity has no property '%s'",
+                        ikey));
+        }
+
+        return NULL;
+}
+
 /*
  * Ent_GetProperty
+ *      If key was never interned then no entity has it.
  */
 const char *Ent_GetProperty(entity_t *ent, const char *key)
 {
         assert(ent != NULL);
         assert(key != NULL);
 
-        struct property *i = NULL;
-        list_for_each_entry(i, &ent->properties.props, list) {
-                if (strcmp(i->key, key) == 0) {
-                        return i->val;
+        const char *ikey = intern_find(key);
+        if (!ikey) {
+                if (g_Config.warnMissingProps) {
+                        trace(CHAN_GAME, fmt("Warning: entity has no "
+                                "property '%s'", key));
                 }
+                return NULL;
         }
 
-        trace(CHAN_GAME, fmt("Warning: entity has no property '%s'", key));
-
-        return NULL;
+        return Ent_FindProperty(ent, ikey);
 }
 
 /*
@@ -270,16 +484,38 @@ void Ent_SetProperty(entity_t *ent, const char *key, const char *val)
         assert(ent != NULL);
         assert(key != NULL);
 
-        struct property *i = NULL;
-        list_for_each_entry(i, &ent->properties.props, list) {
-                if (strcmp(i->key, key) == 0) {
-                        sstrfree(i->val);
-                        i->val = sstrdup_lower(val);
-                        return;
-                }
+        const char *ikey = intern_lower(key);
+        set_property(&ent->properties, ikey, val);
+
+        /* name points at the value, which might just have been freed */
+        if (ent->proto && (ikey == KEY(NAME) || ikey == KEY(CLASS)))
+                set_identity(ent);
+}
+
+/*
+ * reload_definition
+ *      Called by the file watcher when an entity definition changes. The
+ *      cache has already swapped in the new template, so entities pick up
+ *      its properties (apart from ones set on them) straight away; all
+ *      that's left is to point them at its strings. Position and velocity
+ *      are only initial values, so nobody gets moved.
+ */
+static void reload_definition(const char *name, void *user)
+{
+        uint32_t count = 0;
+        entity_t *ent = NULL;
+        slot_map_for_each(ent, s_Entities) {
+                if (!ent->proto || asset_name(ent->proto) != name)
+                        continue;
+
+                set_identity(ent);
+                count++;
         }
 
-        handle_prop(&ent->properties, "api-set", key, val);
+        if (count) {
+                trace(CHAN_DBG, fmt("updated %u entities from %s", count,
+                        name));
+        }
 }
 
 /*
@@ -315,17 +551,13 @@ static ecode_t UpdateEntity(entity_t *ent, float dT)
 
 ecode_t update_entities(float dT)
 {
-	if (s_Entities[0] == NULL) {
+	if (s_Entities == NULL) {
 		trace(CHAN_INFO, "Entity pool not initialised");
 		return EFAIL;
 	}
 
-	for (int i = 0; i < MAX_ENTITIES; i++) {
-		entity_t *ent = s_Entities[i];
-
-		if (!ent->inUse)
-			continue;
-
+        entity_t *ent = NULL;
+        slot_map_for_each(ent, s_Entities) {
 		if (UpdateEntity(ent, dT) != EOK)
 			return EFAIL;
 	}
@@ -340,15 +572,14 @@ ecode_t update_entities(float dT)
  */
 ecode_t render_all_entities()
 {
-        if (s_Entities[0] == NULL) {
+        if (s_Entities == NULL) {
                 trace(CHAN_INFO, "Entity pool not initialised");
                 return EFAIL;
         }
 
-        for (int i = 0; i < MAX_ENTITIES; i++) {
-                entity_t *ent = s_Entities[i];
-
-                if (!ent->inUse || !ent->visible)
+        entity_t *ent = NULL;
+        slot_map_for_each(ent, s_Entities) {
+                if (!ent->visible)
                         continue;
 
                 if (ent->render(ent) != EOK)
@@ -1,21 +1,28 @@
 #pragma once
 #include "list.h"
 #include "vec.h"
+#include "memory.h"
+#include "cache.h"
 
 /* If you define every Entity's Update and Render functions first argument
  * as 'self' then you can use this macro for convenience. */
 #define SelfProperty(key) Ent_GetProperty(self, (key))
 
-/* Each Entity has a property table.
+/* Each Entity has a property table, holding just the properties that have
+ * been set on it since it spawned; the rest come from its class's template.
+ * It's a flat open-addressed hash table keyed by the interned key, so a
+ * lookup is usually one probe and a pointer compare. The slots aren't
+ * allocated until the first property is set.
  */
 struct property {
-        char *key, *val;
-        struct list_head list;
+        const char *key;        /* interned; NULL for an empty slot */
+        char *val;
 };
 
 struct property_tbl {
-        struct list_head props;         /* list of struct property */
+        struct property *slots;
         uint32_t size;
+        uint32_t mask;          /* slot count - 1 */
 };
 
 /* Determines how Entities are updated */
@@ -25,7 +32,10 @@ enum ent_update_type {
 };
 
 typedef struct entity {
-	bool inUse;
+        /* Entities live in a slot map, so they move around as others are
+         * freed. Keep the handle rather than the pointer if you need to
+         * find this one again later; see Ent_Get(). */
+        slot_handle_t handle;
 
         /* class is the type of entity, name is the name of the specific
          * instance of that class, and can be NULL.
@@ -33,8 +43,9 @@ typedef struct entity {
          * will also be in the property table, but we keep pointers to them
          * here for easy access.
          */
-	const char *class;
+	const char *class;      /* interned */
         const char *name;
+        asset_t *proto;         /* the class template; see Ent_Spawn() */
         struct property_tbl properties;
 
         /* Position and velocity
@@ -60,19 +71,31 @@ typedef struct entity {
  * Ent_Spawn("default"); loads default.ent. It returns a relatively bare-
  * bones Entity that only has a property table and Update() and Render()
  * stubs (both of which you should replace immediately).
+ * The definition is only read the first time a class is spawned; later
+ * spawns share what was read then, and cost the same however many
+ * properties it has.
  * After this call, the Entity returned will be processed on the next frame.
  */
 entity_t *Ent_Spawn(const char *class);
 
-/* Mark the given Entity as unused and free its property table. */
+/* Mark the given Entity as unused and free its property table.
+ * Any entity_t pointers you're holding are invalid after this. */
 ecode_t Ent_Free(entity_t *ent);
 
+/* Look up an Entity by handle. Returns NULL if it's been freed. */
+entity_t *Ent_Get(slot_handle_t handle);
+
 /* Get the given property string from the entity's property table.
- * Returns NULL if it can't be found.
+ * Returns NULL if it can't be found (quietly, unless the config's
+ * [Debug] WarnMissingProperties is on).
  * DO NOT free the string returned, it's allocated from the global string
  * pool and will be freed for you. */
 const char *Ent_GetProperty(entity_t *ent, const char *key);
 
+/* Ent_GetProperty() for a key you've already intern()ed. This is the one
+ * to use every frame; it never touches strcmp(). */
+const char *Ent_FindProperty(entity_t *ent, const char *ikey);
+
 /* Add the given key / value property to the given entity's property
  * table, or update its value if key already exists. */
 void Ent_SetProperty(entity_t *ent, const char *key, const char *val);
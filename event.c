@@ -3,6 +3,7 @@
 #include "memory.h"
 #include "panic.h"
 #include "globals.h"
+#include "intern.h"
 
 /* There are two event queues, one for events to be processed next frame
  * ("queued events"), and one for events that are timestamped ("future events").
@@ -36,7 +37,7 @@ ecode_t init_events()
 	}
 
 	s_EventPool = create_pool(MAX_QUEUED_EVENTS, sizeof(event_t),
-		POOL_DYNGROW, "EventPool");
+		POOL_DYNGROW, MEM_SYS_GENERAL, "EventPool");
 
 	return EOK;
 }
@@ -73,7 +74,7 @@ event_t *create_event(const char *name, uint32_t flags)
         }
 
         event_t *evt = PAlloc(s_EventPool);
-        evt->name = name;
+        evt->name = intern(name);
         evt->flags = flags;
 
         return evt;
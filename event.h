@@ -17,8 +17,8 @@
  *
  *	Events are differentiated by strings, and the general naming
  *	convention is all-lowercase-with-hyphens. For e.g.: "door-slammed",
- *	"player-death", etc.
- *	TODO: Strings + hash for quick comparisons
+ *	"player-death", etc. Names are interned by create_event(), so
+ *	compare them by pointer (or atom_of() them) rather than strcmp().
  *
  *
  */
@@ -33,7 +33,7 @@
 #define EVENT_FUTURE	(1 << 4)
 
 typedef struct event {
-	const char *name;
+	const char *name;	/* interned */
 	uint32_t flags;
 } event_t;
 
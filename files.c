@@ -2,28 +2,86 @@
 #include "panic.h"
 #include "files.h"
 #include "memory.h"
+#include "pack.h"
+#include "lz4.h"
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 
 struct File {
 	bool inUse;
+	bool mapped;		/* data is mmap()ed rather than MemAlloc()ed */
+	bool packed;		/* data points into a mounted pack */
+	bool pooled;		/* data came from GetBuffer() */
+	uint16_t gen;		/* bumped every time the slot is freed */
+	uint16_t nextFree;	/* while not in use */
 
 	char *path;
-	int fd;
 	size_t size;
+	size_t cap;		/* of a pooled buffer */
 	filehandle_t handle;
 	uint8_t *data;
 };
 
-#define MAX_OPENFILES	64
-static struct File *s_Files[MAX_OPENFILES] = {NULL};
+/* Handles are the slot index in the low 16 bits and the slot's generation
+ * in the high 16. Generations start at 1 and skip 0 when they wrap, so no
+ * handle is ever FILE_INVALID, and a handle to a closed file stops
+ * matching as soon as its slot is reused.
+ */
+#define HANDLE_INDEX(h) ((h) & 0xffff)
+#define HANDLE_GEN(h) ((h) >> 16)
+#define MAKE_HANDLE(idx, gen) (((filehandle_t) (gen) << 16) | (idx))
+
+#define INITIAL_FILES	64
+#define MAX_FILES	0xffff
+#define NO_FREE		0xffff
+
+/* With FILE_DEFAULT, files smaller than this are read into a buffer even
+ * if mapping is on; for those the syscalls and page faults cost more than
+ * the copy. */
+#define MAP_MIN_SIZE	(16 * 1024)
 
-/* The next handle that will be returned by open_file().
- * We start at 1 because we use 0 as invalid.
+/* s_Files grows as needed; nothing outside this module ever sees a
+ * struct File *, so it's fine for them to move. */
+static struct File *s_Files = NULL;
+static uint32_t s_FileCount = 0;
+static uint16_t s_FreeFile = NO_FREE;
+
+static bool s_MapFiles = false;
+static size_t s_MappedBytes = 0;
+
+/* Decompressed files go in buffers from here. They're power of two sizes
+ * from 4K to 16M, and a few of each size are kept around after their files
+ * are closed, so streaming in a level doesn't allocate and free a buffer
+ * for every file. Bigger ones aren't pooled. The I/O threads use it too.
  */
-static filehandle_t s_NextHandle = 1;
+#define POOL_MIN_SHIFT	12
+#define POOL_CLASSES	13
+#define POOL_KEEP	4
+
+static struct {
+	uint8_t *bufs[POOL_KEEP];
+	uint32_t count;
+} s_Pool[POOL_CLASSES];
+static pthread_mutex_t s_PoolLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Mounted packs, most recently mounted first; each is mapped whole. */
+struct Pack {
+	struct Pack *next;
+	char *path;
+	uint8_t *base;
+	size_t size;
+	const struct pack_header *hdr;
+	const struct pack_entry *toc;
+	const char *names;
+};
+
+static struct Pack *s_Packs = NULL;
 
 /* All file access are relative to here */
 static const char *s_FilesRoot = NULL;
@@ -33,161 +91,916 @@ const char *get_root_path()
         return s_FilesRoot;
 }
 
+/*
+ * GrowFiles
+ *	Double s_Files, threading the new slots onto the free list.
+ */
+static void GrowFiles()
+{
+	uint32_t count = s_FileCount ? s_FileCount * 2 : INITIAL_FILES;
+	if (count > MAX_FILES)
+		count = MAX_FILES;
+
+	if (count == s_FileCount) {
+		panic(fmt("%u files open, can't open any more", s_FileCount));
+	}
+
+	struct File *files = MemAllocSys(count * sizeof(*files), MEM_SYS_FILES);
+	if (s_Files) {
+		memcpy(files, s_Files, s_FileCount * sizeof(*files));
+		MemFree(s_Files);
+	}
+
+	memset(&files[s_FileCount], 0,
+		(count - s_FileCount) * sizeof(*files));
+
+	for (uint32_t i = count; i-- > s_FileCount; ) {
+		files[i].gen = 1;
+		files[i].nextFree = s_FreeFile;
+		s_FreeFile = i;
+	}
+
+	trace(CHAN_DBG, fmt("room for %u files", count));
+
+	s_Files = files;
+	s_FileCount = count;
+}
+
 /*
  * NextFreeFile
- *	Returns a pointer to the next free File slot, or calls panic().
+ *	Returns a pointer to the next free File slot, growing s_Files if
+ *	there isn't one.
  */
 static struct File *NextFreeFile()
 {
-	for (int i = 0; i < MAX_OPENFILES; i++) {
-		if (s_Files[i] == NULL || s_Files[i]->inUse == false) {
-			if (s_Files[i] == NULL)
-				s_Files[i] = MemAlloc(sizeof(struct File));
+	if (s_FreeFile == NO_FREE)
+		GrowFiles();
 
-			//trace(fmt("selected slot %d", i));
-			s_Files[i]->inUse = true;
-			return s_Files[i];
-		}
-	}
+	uint32_t idx = s_FreeFile;
+	struct File *f = &s_Files[idx];
+	s_FreeFile = f->nextFree;
 
-	panic(fmt("reached MAX_OPENFILES, which is %d", MAX_OPENFILES));
-	return NULL;	/* not reached; shuts up warning */
+	f->inUse = true;
+	f->handle = MAKE_HANDLE(idx, f->gen);
+	return f;
 }
 
 /*
  * GetFileByHandle
- *	Returns the struct File * associated with the given filehandle_t.
+ *	Returns the struct File * associated with the given filehandle_t, or
+ *	NULL if it's stale or was never valid.
  */
 static struct File *GetFileByHandle(filehandle_t handle)
 {
-	for (int i = 0; i < MAX_OPENFILES; i++) {
-		if (s_Files[i]->handle == handle)
-			return s_Files[i];
+	uint32_t idx = HANDLE_INDEX(handle);
+
+	if (idx >= s_FileCount)
+		return NULL;
+
+	struct File *f = &s_Files[idx];
+	if (!f->inUse || f->gen != HANDLE_GEN(handle))
+		return NULL;
+
+	return f;
+}
+
+/*
+ * PoolClass
+ *	The smallest class that holds size bytes, or POOL_CLASSES if none do.
+ */
+static uint32_t PoolClass(size_t size)
+{
+	uint32_t cls = 0;
+
+	while (cls < POOL_CLASSES &&
+		((size_t) 1 << (cls + POOL_MIN_SHIFT)) < size)
+		cls++;
+
+	return cls;
+}
+
+/*
+ * GetBuffer
+ *	A buffer of at least size bytes; *cap is its actual size, which must
+ *	be given back to PutBuffer().
+ */
+static uint8_t *GetBuffer(size_t size, size_t *cap)
+{
+	uint32_t cls = PoolClass(size);
+	uint8_t *buf = NULL;
+
+	if (cls == POOL_CLASSES) {
+		*cap = size;
+		return MemAllocSys(size, MEM_SYS_FILES);
 	}
 
-	return NULL;
+	*cap = (size_t) 1 << (cls + POOL_MIN_SHIFT);
+
+	pthread_mutex_lock(&s_PoolLock);
+	if (s_Pool[cls].count > 0)
+		buf = s_Pool[cls].bufs[--s_Pool[cls].count];
+	pthread_mutex_unlock(&s_PoolLock);
+
+	return buf ? buf : MemAllocSys(*cap, MEM_SYS_FILES);
+}
+
+static void PutBuffer(uint8_t *buf, size_t cap)
+{
+	uint32_t cls = PoolClass(cap);
+
+	if (cls < POOL_CLASSES && cap == (size_t) 1 << (cls + POOL_MIN_SHIFT)) {
+		pthread_mutex_lock(&s_PoolLock);
+		if (s_Pool[cls].count < POOL_KEEP) {
+			s_Pool[cls].bufs[s_Pool[cls].count++] = buf;
+			buf = NULL;
+		}
+		pthread_mutex_unlock(&s_PoolLock);
+	}
+
+	MemFree(buf);
+}
+
+static void DrainPool()
+{
+	for (uint32_t cls = 0; cls < POOL_CLASSES; cls++) {
+		while (s_Pool[cls].count > 0)
+			MemFree(s_Pool[cls].bufs[--s_Pool[cls].count]);
+	}
 }
 
 /*
  * DestroyFile
- *	Cleans up the given struct File *; closes the file descriptor
- *	and frees all the memory it used.
+ *	Cleans up the given struct File *; unmaps or frees its data,
+ *	then puts the slot back on the free list.
  */
 static void DestroyFile(struct File *f)
 {
-	close(f->fd);
-	f->fd = -1;
-	f->handle = 0;
-	MemFree(f->data);
+	if (f->packed) {
+		/* Belongs to the pack */
+	} else if (f->pooled) {
+		PutBuffer(f->data, f->cap);
+	} else if (f->mapped) {
+		munmap(f->data, f->size);
+		s_MappedBytes -= f->size;
+	} else {
+		MemFree(f->data);
+	}
+
+	f->handle = FILE_INVALID;
+	f->mapped = false;
+	f->packed = false;
+	f->pooled = false;
 	f->data = NULL;
 	f->size = 0;
+	f->cap = 0;
 	sstrfree(f->path);
 	f->path = NULL;
 
+	f->gen++;
+	if (f->gen == 0)
+		f->gen = 1;
+
 	f->inUse = false;
+	f->nextFree = s_FreeFile;
+	s_FreeFile = f - s_Files;
 }
 
+/* What a load produces. Workers fill these in, so nothing that touches
+ * them may use trace(), fmt() or sstrs; the main thread hands them to a
+ * struct File afterwards.
+ */
+struct FileData {
+	uint8_t *data;
+	size_t size;
+	size_t cap;
+	bool mapped;
+	bool packed;
+	bool pooled;
+
+	/* data is an LZ4 frame that still needs Inflate()ing; rawSize is
+	 * its decompressed size if known, otherwise 0 */
+	bool compressed;
+	uint64_t rawSize;
+};
+
 /*
- * init_files
+ * MapData
+ *	Map the whole file copy-on-write, so callers can still scribble on
+ *	the data like they could on a buffer. Returns false if it can't be
+ *	mapped (empty, not a regular file, mmap() failed) so the caller can
+ *	read it instead.
  */
-ecode_t init_files(const char *rootDir)
+static bool MapData(struct FileData *out, int fd, const struct stat *st,
+	uint32_t flags)
 {
-        if (rootDir[strlen(rootDir)-1] != '/')
-                panic("root directory must end with /");
+	if (!S_ISREG(st->st_mode) || st->st_size == 0)
+		return false;
 
-	trace(CHAN_DBG, fmt("setting root directory to %s", rootDir));
-	s_FilesRoot = rootDir;
+	void *data = mmap(NULL, st->st_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		return false;
 
-	return EOK;
+	int advice = POSIX_MADV_WILLNEED;
+	if (flags & FILE_SEQUENTIAL)
+		advice = POSIX_MADV_SEQUENTIAL;
+	else if (flags & FILE_RANDOM)
+		advice = POSIX_MADV_RANDOM;
+	posix_madvise(data, st->st_size, advice);
+
+	out->data = data;
+	out->size = st->st_size;
+	out->mapped = true;
+
+	return true;
 }
 
 /*
- * shutdown_files
- *	Close all open files and free all buffers.
+ * ReadData
+ *	Returns 0 or an errno value.
  */
-ecode_t shutdown_files()
+static int ReadData(struct FileData *out, int fd, const struct stat *st)
 {
-	uint32_t closed = 0;
-	uint32_t used = 0;
+	out->size = st->st_size;
+	if (out->size == 0)
+		return 0;
 
-	for (int i = 0; i < MAX_OPENFILES; i++) {
-		if (s_Files[i] == NULL)
-			continue;
+	out->data = MemAllocSys(out->size, MEM_SYS_FILES);
 
-		closed++;
-		if (s_Files[i]->inUse) used++;
+	/* We want read() to read the entire file at once, or we consider
+	 * it to have failed.
+	 */
+	ssize_t ret = read(fd, out->data, out->size);
+	if (ret == -1 || (size_t) ret < out->size) {
+		int err = ret == -1 ? errno : EIO;
+		MemFree(out->data);
+		out->data = NULL;
+		return err;
+	}
+
+	return 0;
+}
+
+/*
+ * LoadRaw
+ *	Open, load and close the file at path. Either way the descriptor is
+ *	closed before returning; a mapping doesn't need it. Returns 0 or an
+ *	errno value.
+ */
+static int LoadRaw(const char *path, uint32_t flags, struct FileData *out)
+{
+	memset(out, 0, sizeof(*out));
 
-		DestroyFile(s_Files[i]);
-		MemFree(s_Files[i]);
-		s_Files[i] = NULL;
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return errno;
+
+	struct stat status;
+	if (fstat(fd, &status) == -1) {
+		int err = errno;
+		close(fd);
+		return err;
 	}
 
-	trace(CHAN_DBG,
-		fmt("freed %u file structures (%u were in use)", closed, used));
+	bool map;
+	if (flags & FILE_MAP)
+		map = true;
+	else if (flags & FILE_BUFFER)
+		map = false;
+	else
+		map = s_MapFiles && status.st_size >= MAP_MIN_SIZE;
 
-	return EOK;
+	int err = 0;
+	if (!map || !MapData(out, fd, &status, flags))
+		err = ReadData(out, fd, &status);
+
+	close(fd);
+	return err;
+}
+
+static void FreeData(struct FileData *d)
+{
+	if (d->packed)
+		return;
+
+	if (d->pooled)
+		PutBuffer(d->data, d->cap);
+	else if (d->mapped)
+		munmap(d->data, d->size);
+	else
+		MemFree(d->data);
 }
 
 /*
- * open_file
+ * Inflate
+ *	Replace compressed data with a pooled buffer holding its contents.
+ *	If the size isn't known, guess and keep doubling until it fits.
+ *	Sizes the data couldn't possibly expand to are treated as corrupt,
+ *	rather than trying to allocate them. Returns 0 or an errno value.
  */
-static void OpenAndRead(struct File *file)
+static int Inflate(struct FileData *d)
 {
-	file->fd = open(file->path, O_RDONLY);
-	if (file->fd == -1)
-		panic(fmt("failed to open %s", file->path));
+	size_t limit = (d->size + 1) * LZ4_MAX_RATIO;
+	size_t want = d->rawSize ? d->rawSize :
+		lz4_content_size(d->data, d->size);
 
-	struct stat status;
-	fstat(file->fd, &status);
-	file->data = MemAlloc(status.st_size);
-	file->size = status.st_size;
+	if (want > limit)
+		return EILSEQ;
+	if (want == 0)
+		want = d->size * 4;
 
-	/* We want read() to read the entire file at once, or we consider
-	 * it to have failed.
-	 */
-	ssize_t ret = read(file->fd, file->data, file->size);
-	if (ret == -1 || ret < file->size) {
-		panic(fmt("read() returned %d", ret));
+	for (;;) {
+		size_t cap, len;
+		uint8_t *buf = GetBuffer(want, &cap);
+		lz4_result_t ret = lz4_decompress(d->data, d->size, buf, cap,
+			&len);
+
+		if (ret == LZ4_OK) {
+			FreeData(d);
+			d->data = buf;
+			d->size = len;
+			d->cap = cap;
+			d->pooled = true;
+			d->mapped = d->packed = d->compressed = false;
+			return 0;
+		}
+
+		PutBuffer(buf, cap);
+		if (ret == LZ4_CORRUPT || cap >= limit)
+			return EILSEQ;
+
+		want = cap * 2;
+		if (want > limit)
+			want = limit;
+	}
+}
+
+/*
+ * LoadData
+ *	Load path, or if there's no such file, path.lz4 decompressed. Safe
+ *	to call from any thread.
+ */
+static int LoadData(const char *path, uint32_t flags, struct FileData *out)
+{
+	int err = LoadRaw(path, flags, out);
+	if (err != ENOENT)
+		return err;
+
+	char lzPath[PATH_MAX];
+	if (snprintf(lzPath, sizeof(lzPath), "%s.lz4", path) >= PATH_MAX)
+		return ENAMETOOLONG;
+
+	/* It's only needed until it's decompressed, so map it if we can */
+	err = LoadRaw(lzPath, (flags & ~FILE_BUFFER) | FILE_MAP |
+		FILE_SEQUENTIAL, out);
+	if (err)
+		return err;
+
+	if (!lz4_is_frame(out->data, out->size)) {
+		FreeData(out);
+		return EILSEQ;
+	}
+
+	out->compressed = true;
+	return Inflate(out);
+}
+
+/*
+ * AttachData
+ *	Give loaded data (and path, an sstr) to a new struct File.
+ */
+static struct File *AttachData(char *path, struct FileData *d)
+{
+	struct File *file = NextFreeFile();
+
+	file->path = path;
+	file->data = d->data;
+	file->size = d->size;
+	file->mapped = d->mapped;
+	file->packed = d->packed;
+	file->pooled = d->pooled;
+	file->cap = d->cap;
+	if (file->mapped)
+		s_MappedBytes += file->size;
+
+	return file;
+}
+
+/*
+ * FindInPacks
+ *	Binary search each mounted pack's table of contents for filename.
+ */
+static bool FindInPacks(const char *filename, struct FileData *out)
+{
+	for (struct Pack *p = s_Packs; p; p = p->next) {
+		uint32_t lo = 0, hi = p->hdr->count;
+
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+			const struct pack_entry *e = &p->toc[mid];
+			int cmp = strcmp(filename, p->names + e->nameOffset);
+
+			if (cmp == 0) {
+				memset(out, 0, sizeof(*out));
+				out->data = p->base + e->offset;
+				out->size = e->size;
+				out->packed = true;
+				out->compressed = e->flags & PACK_LZ4;
+				out->rawSize = e->rawSize;
+				return true;
+			}
+
+			if (cmp < 0)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
 	}
+
+	return false;
 }
 
+/*
+ * open_file
+ */
 filehandle_t open_file(const char *filename)
+{
+	return open_file_ex(filename, FILE_DEFAULT);
+}
+
+filehandle_t open_file_ex(const char *filename, uint32_t flags)
 {
 	assert(filename != NULL);
 
 	char *fullPath = sstrcat(s_FilesRoot, filename);
-	struct File *file = NextFreeFile();
+	struct FileData data;
+
+	int err = 0;
+	if (!FindInPacks(filename, &data))
+		err = LoadData(fullPath, flags, &data);
+	else if (data.compressed)
+		err = Inflate(&data);
+
+	if (err) {
+		if (!(flags & FILE_MAYFAIL)) {
+			panic(fmt("failed to load %s (%s)", fullPath,
+				strerror(err)));
+		}
 
-	file->path = fullPath;
-	file->handle = s_NextHandle++;
-	OpenAndRead(file);
+		trace(CHAN_DBG, fmt("failed to load %s (%s)", fullPath,
+			strerror(err)));
+		sstrfree(fullPath);
+		return FILE_INVALID;
+	}
+
+	struct File *file = AttachData(fullPath, &data);
 
-	trace(CHAN_DBG, fmt("opened %s (handle %u)", fullPath, file->handle));
+	trace(CHAN_DBG, fmt("opened %s (handle %08x%s)", fullPath,
+		file->handle, file->packed ? ", packed" :
+		file->mapped ? ", mapped" : ""));
 
 	return file->handle;
 }
 
+/* Async loads. Requests go on s_Pending, the I/O threads take them off,
+ * load them and put them on s_Done, and process_file_loads() turns them
+ * into files and calls their callbacks on the main thread. Both lists are
+ * FIFO and share s_IOLock. The threads are started by the first
+ * open_file_async().
+ */
+struct FileLoad {
+	struct FileLoad *next;
+
+	char *path;
+	uint32_t flags;
+	file_load_fn fn;
+	file_drop_fn drop;
+	void *user;
+
+	struct FileData data;
+	int err;
+};
+
+struct LoadList {
+	struct FileLoad *head, *tail;
+};
+
+#define IO_THREADS	2
+
+static pthread_t s_IOThreads[IO_THREADS];
+static bool s_IOStarted = false;
+static bool s_IOQuit = false;
+static pthread_mutex_t s_IOLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_IOWake = PTHREAD_COND_INITIALIZER;
+static struct LoadList s_Pending = {NULL, NULL};
+static struct LoadList s_Done = {NULL, NULL};
+static uint32_t s_LoadsInFlight = 0;	/* main thread only */
+
+static void ListAppend(struct LoadList *l, struct FileLoad *load)
+{
+	load->next = NULL;
+	if (l->tail)
+		l->tail->next = load;
+	else
+		l->head = load;
+	l->tail = load;
+}
+
+/*
+ * IOThread
+ */
+static void *IOThread(void *arg)
+{
+	pthread_mutex_lock(&s_IOLock);
+
+	for (;;) {
+		while (!s_Pending.head && !s_IOQuit)
+			pthread_cond_wait(&s_IOWake, &s_IOLock);
+
+		if (s_IOQuit)
+			break;
+
+		struct FileLoad *load = s_Pending.head;
+		s_Pending.head = load->next;
+		if (!s_Pending.head)
+			s_Pending.tail = NULL;
+
+		pthread_mutex_unlock(&s_IOLock);
+		if (load->data.compressed)
+			load->err = Inflate(&load->data);
+		else
+			load->err = LoadData(load->path, load->flags,
+				&load->data);
+		pthread_mutex_lock(&s_IOLock);
+
+		ListAppend(&s_Done, load);
+	}
+
+	pthread_mutex_unlock(&s_IOLock);
+	return NULL;
+}
+
+static void StartIOThreads()
+{
+	s_IOQuit = false;
+
+	for (int i = 0; i < IO_THREADS; i++) {
+		if (pthread_create(&s_IOThreads[i], NULL, IOThread, NULL) != 0)
+			panic("failed to start I/O threads");
+	}
+
+	s_IOStarted = true;
+	trace(CHAN_DBG, fmt("started %d I/O threads", IO_THREADS));
+}
+
+/*
+ * StopIOThreads
+ *	Loads that were in progress finish; anything that hasn't been
+ *	delivered yet is thrown away without calling its callback.
+ */
+static void StopIOThreads()
+{
+	if (!s_IOStarted)
+		return;
+
+	pthread_mutex_lock(&s_IOLock);
+	s_IOQuit = true;
+	pthread_cond_broadcast(&s_IOWake);
+	pthread_mutex_unlock(&s_IOLock);
+
+	for (int i = 0; i < IO_THREADS; i++)
+		pthread_join(s_IOThreads[i], NULL);
+
+	uint32_t dropped = 0;
+	struct FileLoad *load, *next;
+
+	for (load = s_Pending.head; load; load = next, dropped++) {
+		next = load->next;
+		if (load->drop)
+			load->drop(load->user);
+		sstrfree(load->path);
+		MemFree(load);
+	}
+
+	for (load = s_Done.head; load; load = next, dropped++) {
+		next = load->next;
+		if (!load->err)
+			FreeData(&load->data);
+		if (load->drop)
+			load->drop(load->user);
+		sstrfree(load->path);
+		MemFree(load);
+	}
+
+	if (dropped) {
+		trace(CHAN_DBG, fmt("dropped %u unfinished loads", dropped));
+	}
+
+	s_Pending.head = s_Pending.tail = NULL;
+	s_Done.head = s_Done.tail = NULL;
+	s_LoadsInFlight = 0;
+	s_IOStarted = false;
+}
+
+/*
+ * open_file_async
+ */
+void open_file_async(const char *filename, uint32_t flags, file_load_fn fn,
+	file_drop_fn drop, void *user)
+{
+	assert(filename != NULL);
+	assert(fn != NULL);
+
+	if (!s_IOStarted)
+		StartIOThreads();
+
+	struct FileLoad *load = MemAllocSys(sizeof(*load), MEM_SYS_FILES);
+	load->path = sstrcat(s_FilesRoot, filename);
+	load->flags = flags;
+	load->fn = fn;
+	load->drop = drop;
+	load->user = user;
+
+	/* Files in packs are already loaded, so they skip the I/O threads
+	 * unless they need decompressing; the callback still waits for
+	 * process_file_loads(). */
+	pthread_mutex_lock(&s_IOLock);
+	if (FindInPacks(filename, &load->data) && !load->data.compressed) {
+		ListAppend(&s_Done, load);
+	} else {
+		ListAppend(&s_Pending, load);
+		pthread_cond_signal(&s_IOWake);
+	}
+	pthread_mutex_unlock(&s_IOLock);
+
+	s_LoadsInFlight++;
+}
+
+/*
+ * process_file_loads
+ *	Deliver every load that's finished since the last call. Callbacks
+ *	can start more loads; those are delivered next time at the earliest.
+ */
+ecode_t process_file_loads()
+{
+	if (!s_IOStarted)
+		return EOK;
+
+	pthread_mutex_lock(&s_IOLock);
+	struct FileLoad *load = s_Done.head;
+	s_Done.head = s_Done.tail = NULL;
+	pthread_mutex_unlock(&s_IOLock);
+
+	while (load) {
+		struct FileLoad *next = load->next;
+		filehandle_t handle = FILE_INVALID;
+
+		s_LoadsInFlight--;
+
+		if (load->err) {
+			if (!(load->flags & FILE_MAYFAIL)) {
+				panic(fmt("failed to load %s (%s)", load->path,
+					strerror(load->err)));
+			}
+
+			trace(CHAN_DBG, fmt("failed to load %s (%s)",
+				load->path, strerror(load->err)));
+			sstrfree(load->path);
+		} else {
+			struct File *file = AttachData(load->path, &load->data);
+			handle = file->handle;
+
+			trace(CHAN_DBG, fmt("loaded %s (handle %08x%s)",
+				file->path, handle, file->packed ? ", packed" :
+				file->mapped ? ", mapped" : ""));
+		}
+
+		file_load_fn fn = load->fn;
+		void *user = load->user;
+		MemFree(load);
+
+		fn(handle, user);
+		load = next;
+	}
+
+	return EOK;
+}
+
+uint32_t files_loading()
+{
+	return s_LoadsInFlight;
+}
+
+/*
+ * CheckPack
+ *	Make sure everything in the header and table of contents is inside
+ *	the file, so lookups needn't check anything.
+ */
+static bool CheckPack(struct Pack *p)
+{
+	const struct pack_header *hdr = p->hdr;
+
+	if (p->size < sizeof(*hdr) ||
+		memcmp(hdr->magic, PACK_MAGIC, sizeof(hdr->magic)) != 0) {
+		trace(CHAN_INFO, fmt("%s isn't a pack", p->path));
+		return false;
+	}
+
+	if (hdr->version != PACK_VERSION) {
+		trace(CHAN_INFO, fmt("%s is version %u, wanted %u", p->path,
+			hdr->version, PACK_VERSION));
+		return false;
+	}
+
+	if (hdr->tocOffset % sizeof(uint64_t) != 0 ||
+		hdr->tocOffset > p->size ||
+		hdr->count > (p->size - hdr->tocOffset) / sizeof(*p->toc) ||
+		hdr->namesOffset > p->size ||
+		hdr->namesSize > p->size - hdr->namesOffset) {
+		trace(CHAN_INFO, fmt("%s is truncated", p->path));
+		return false;
+	}
+
+	for (uint32_t i = 0; i < hdr->count; i++) {
+		const struct pack_entry *e = &p->toc[i];
+
+		if (e->offset > p->size || e->size > p->size - e->offset ||
+			e->nameOffset >= hdr->namesSize ||
+			e->nameLen >= hdr->namesSize - e->nameOffset ||
+			p->names[e->nameOffset + e->nameLen] != '\0' ||
+			(e->flags & ~PACK_LZ4) != 0) {
+			trace(CHAN_INFO, fmt("%s has a bad entry (%u)", p->path,
+				i));
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * mount_pack
+ */
+ecode_t mount_pack(const char *packname)
+{
+	assert(packname != NULL);
+
+	struct Pack *p = MemAllocSys(sizeof(*p), MEM_SYS_FILES);
+	p->path = sstrcat(s_FilesRoot, packname);
+
+	int fd = open(p->path, O_RDONLY);
+	struct stat st;
+
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		trace(CHAN_INFO, fmt("can't mount %s (%s)", p->path,
+			strerror(errno)));
+		goto fail;
+	}
+
+	if (st.st_size == 0) {
+		trace(CHAN_INFO, fmt("can't mount %s (empty)", p->path));
+		goto fail;
+	}
+
+	p->size = st.st_size;
+	p->base = mmap(NULL, p->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p->base == MAP_FAILED) {
+		p->base = NULL;
+		trace(CHAN_INFO, fmt("can't map %s (%s)", p->path,
+			strerror(errno)));
+		goto fail;
+	}
+
+	close(fd);
+	fd = -1;
+
+	p->hdr = (const struct pack_header *) p->base;
+	p->toc = (const struct pack_entry *) (p->base + p->hdr->tocOffset);
+	p->names = (const char *) (p->base + p->hdr->namesOffset);
+
+	if (!CheckPack(p))
+		goto fail;
+
+	posix_madvise(p->base, p->size, POSIX_MADV_RANDOM);
+
+	p->next = s_Packs;
+	s_Packs = p;
+
+	trace(CHAN_INFO, fmt("mounted %s: %u files, %u %s", p->path,
+		p->hdr->count, SaneVal(p->size), SaneAff(p->size)));
+
+	return EOK;
+
+fail:
+	if (fd != -1)
+		close(fd);
+	if (p->base)
+		munmap(p->base, p->size);
+	sstrfree(p->path);
+	MemFree(p);
+
+	return EFAIL;
+}
+
+/*
+ * UnmountPacks
+ *	Only once no files point into them.
+ */
+static void UnmountPacks()
+{
+	struct Pack *p, *next;
+
+	for (p = s_Packs; p; p = next) {
+		next = p->next;
+
+		trace(CHAN_DBG, fmt("unmounting %s", p->path));
+		munmap(p->base, p->size);
+		sstrfree(p->path);
+		MemFree(p);
+	}
+
+	s_Packs = NULL;
+}
+
+/*
+ * init_files
+ */
+ecode_t init_files(const char *rootDir, bool mapFiles)
+{
+        if (rootDir[strlen(rootDir)-1] != '/')
+                panic("root directory must end with /");
+
+	trace(CHAN_DBG, fmt("setting root directory to %s", rootDir));
+	s_FilesRoot = rootDir;
+
+	s_MapFiles = mapFiles;
+	trace(CHAN_DBG, fmt("mapping files %s", mapFiles ? "on" : "off"));
+
+	return EOK;
+}
+
+/*
+ * shutdown_files
+ *	Close all open files and free all buffers.
+ */
+ecode_t shutdown_files()
+{
+	uint32_t used = 0;
+
+	StopIOThreads();
+
+	for (uint32_t i = 0; i < s_FileCount; i++) {
+		if (!s_Files[i].inUse)
+			continue;
+
+		used++;
+		DestroyFile(&s_Files[i]);
+	}
+
+	trace(CHAN_DBG,
+		fmt("freed %u file structures (%u were in use)", s_FileCount,
+		used));
+	assert(s_MappedBytes == 0);
+
+	UnmountPacks();
+	DrainPool();
+
+	MemFree(s_Files);
+	s_Files = NULL;
+	s_FileCount = 0;
+	s_FreeFile = NO_FREE;
+
+	return EOK;
+}
+
 /*
  * close_file
  */
 void close_file(filehandle_t handle)
 {
 	struct File *file = GetFileByHandle(handle);
-	if (!file)
-		panic(fmt("no file for handle %u", handle));
+	if (!file) {
+		panic(fmt("no file for handle %08x", handle));
+	}
 
-	trace(CHAN_DBG, fmt("closed %s (handle %u)", file->path, handle));
+	trace(CHAN_DBG, fmt("closed %s (handle %08x)", file->path, handle));
 	DestroyFile(file);
 }
 
+bool file_valid(filehandle_t handle)
+{
+	return GetFileByHandle(handle) != NULL;
+}
+
 /*
  * file_get_data
  */
 uint8_t *file_get_data(filehandle_t handle)
 {
 	struct File *file = GetFileByHandle(handle);
-	if (!file)
-		panic(fmt("no file for handle %u", handle));
+	if (!file) {
+		panic(fmt("no file for handle %08x", handle));
+	}
 
 	return file->data;
 }
@@ -196,12 +1009,22 @@ size_t file_get_size(filehandle_t handle)
 {
 	struct File *file = GetFileByHandle(handle);
 	if (!file) {
-		panic(fmt("no file for handle %u", handle));
+		panic(fmt("no file for handle %08x", handle));
 	}
 
 	return file->size;
 }
 
+bool file_is_mapped(filehandle_t handle)
+{
+	struct File *file = GetFileByHandle(handle);
+	if (!file) {
+		panic(fmt("no file for handle %08x", handle));
+	}
+
+	return file->mapped;
+}
+
 /*
  * file_get_path
  */
@@ -209,7 +1032,7 @@ const char *file_get_path(filehandle_t handle)
 {
 	struct File *file = GetFileByHandle(handle);
 	if (!file) {
-		panic(fmt("no file for handle %u", handle));
+		panic(fmt("no file for handle %08x", handle));
 	}
 
 	return file->path;
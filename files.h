@@ -5,27 +5,103 @@
  *	All file accesses for the game should go through here.
  *	Error handling here is simple; we always panic() if a file cannot
  *	be found, hence little use of ecode_t.
+ *
+ *	Files can also come from packs (see pack.h) mounted with
+ *	mount_pack(); open_file() looks in those first, newest first, and
+ *	only goes to the disk if the file isn't in any of them.
+ *
+ *	Compressed files are decompressed as they're loaded (on the I/O
+ *	threads, for open_file_async()), so callers never see the difference.
+ *	That's pack entries made with mkpak -z, and any file that's missing
+ *	but has a .lz4 version next to it (foo.map -> foo.map.lz4).
  */
 
+/* Handles are checked on every use, so using one after close_file()
+ * panic()s rather than reading some other file; file_valid() says whether
+ * one is still good. Looking a handle up is O(1), and there's no fixed
+ * limit on how many files can be open. */
 typedef uint32_t filehandle_t;
 
+/* No valid handle is ever zero. */
+#define FILE_INVALID	0
+
+/* Flags for open_file_ex(). By default, files over a certain size are
+ * mapped if mapFiles was given to init_files(), and everything else is
+ * read into a buffer. FILE_MAP and FILE_BUFFER override that for one file.
+ *
+ * A mapped file is served straight from the page cache, so it doesn't
+ * count towards MEM_SYS_FILES and isn't copied at load. Its data can still
+ * be written to (the mapping is private), but it's NOT NUL terminated,
+ * and neither is a buffered one; always use file_get_size(). If a file
+ * can't be mapped it's quietly read instead.
+ *
+ * FILE_SEQUENTIAL and FILE_RANDOM are hints to the kernel (posix_madvise())
+ * about how a mapped file will be read; without either it's asked to read
+ * the whole thing in ahead of time. */
+enum {
+	FILE_DEFAULT = 0,
+	FILE_MAP = 1 << 0,
+	FILE_BUFFER = 1 << 1,
+	FILE_SEQUENTIAL = 1 << 2,
+	FILE_RANDOM = 1 << 3,
+
+	/* Return FILE_INVALID (or pass it to the callback) rather than
+	 * panic() if the file can't be loaded. */
+	FILE_MAYFAIL = 1 << 4
+};
+
+/* Called on the main thread, from process_file_loads(), when a load
+ * started by open_file_async() is done. The handle belongs to the callback
+ * (close_file() it when done), and is FILE_INVALID if the load failed and
+ * FILE_MAYFAIL was given. */
+typedef void (*file_load_fn)(filehandle_t handle, void *user);
+
+/* Called instead, from shutdown_files(), for a load that was still in
+ * progress, so whatever user points to can be freed. */
+typedef void (*file_drop_fn)(void *user);
+
 /* Initialise the file system. All file accesses are relative to rootDir,
  * which must end with a '/' */
-ecode_t init_files(const char *rootDir);
+ecode_t init_files(const char *rootDir, bool mapFiles);
 
 /* Shutdown the file system, closing all open files and freeing all buffers */
 ecode_t shutdown_files();
 
+/* Map the pack file (relative to the root) and serve files from it. The
+ * data of files opened from a pack is shared and read-only; writing to it
+ * crashes. Returns EFAIL (after tracing why) if it isn't a valid pack.
+ * Packs stay mounted until shutdown_files(). */
+ecode_t mount_pack(const char *packname);
+
 /* Open the specified file and buffer it up. Returns a handle to it. */
 filehandle_t open_file(const char *filename);
+filehandle_t open_file_ex(const char *filename, uint32_t flags);
+
+/* Load a file on one of the I/O threads, without blocking. The callback
+ * is called once, from process_file_loads(), which the main loop calls
+ * every frame. Loads still in progress at shutdown_files() are dropped
+ * without their callbacks being called; drop (if not NULL) is called for
+ * them instead. */
+void open_file_async(const char *filename, uint32_t flags, file_load_fn fn,
+	file_drop_fn drop, void *user);
+ecode_t process_file_loads();
+
+/* Number of async loads whose callbacks haven't been called yet. */
+uint32_t files_loading();
 void close_file(filehandle_t handle);
 
+/* Returns true if the handle refers to a file that's still open. */
+bool file_valid(filehandle_t handle);
+
 /* Get a pointer to the buffer associated with the given handle */
 uint8_t *file_get_data(filehandle_t handle);
 
 /* Get the size of the given file */
 size_t file_get_size(filehandle_t handle);
 
+/* Returns true if the file's data is mapped rather than buffered */
+bool file_is_mapped(filehandle_t handle);
+
 /* Get a pointer to the file's full path */
 const char *file_get_path(filehandle_t handle);
 
@@ -12,8 +12,13 @@
 #include "input.h"
 #include "event.h"
 #include "config.h"
+#include "files.h"
+#include "cache.h"
+#include "watch.h"
 #include <SDL2/SDL.h>
 
+/* Initial size of each of the frame allocators' chunks. */
+#define FRAME_MEM_CHUNK (64 * 1024)
 
 UNUSED static ecode_t test_update(entity_t *self, float dT)
 {
@@ -38,6 +43,9 @@ static void check_dbg_keys(SDL_Keycode code)
 	switch (code) {
 	case SDLK_F12:
 		MemStats();
+		MemSiteStats(20);
+		sstr_stats();
+		cache_stats();
 		break;
 	}
 }
@@ -48,6 +56,15 @@ static void check_dbg_keys(SDL_Keycode code)
  */
 static void update_gameworld(float dT)
 {
+	if (process_file_loads() != EOK) {
+		panic("Failed to process file loads");
+	}
+
+	/* Before anything uses this frame's assets */
+	if (process_file_changes() != EOK) {
+		panic("Failed to process file changes");
+	}
+
 	if (update_entities(dT) != EOK) {
 		panic("Failed to update Entities");
 	}
@@ -73,6 +90,11 @@ ecode_t mainloop()
 	struct timer stepTimer;
 	uint32_t frameCount = 0, nextFPS = 0, fps = 0;
 
+	if (FrameMem_Init(FRAME_MEM_CHUNK) != EOK) {
+		trace(CHAN_INFO, "failed to init frame memory");
+		return EFAIL;
+	}
+
 	if (init_renderer() != EOK) {
 		trace(CHAN_INFO, "failed to init renderer");
 		return EFAIL;
@@ -93,6 +115,9 @@ ecode_t mainloop()
         start_timer(&gameTimer);
 
 	while (!quit) {
+		/* Anything FrameAlloc()'d two frames ago is gone after this */
+		FrameMem_NextFrame();
+
 		/* input */
 		while (SDL_PollEvent(&event) != 0) {
 			if (event.type == SDL_QUIT) {
@@ -125,9 +150,12 @@ ecode_t mainloop()
 
 		/* Render */
                 r_begin_commands();
+                size_t frameMem = FrameMem_LastFrame();
                 r_add_string(FONT_NORMAL, COLOUR_WHITE, 10, 10,
-                        fmt("FPS: %u - dT: %3.4f - T: %u - M: %lu bytes", fps, dT,
-                        g_globals.timeNowMs, MemCurrentUsage()));
+                        fmt("FPS: %u - dT: %3.4f - T: %u - M: %lu bytes"
+                        " - F: %u %s", fps, dT, g_globals.timeNowMs,
+                        MemCurrentUsage(), SaneVal(frameMem),
+                        SaneAff(frameMem)));
 
                 if (render_all_entities() != EOK) {
                         panic("Failed to render entities");
@@ -148,5 +176,10 @@ ecode_t mainloop()
 		return EFAIL;
 	}
 
+	if (FrameMem_Shutdown() != EOK) {
+		trace(CHAN_INFO, "failed to shutdown frame memory");
+		return EFAIL;
+	}
+
 	return EOK;
 }
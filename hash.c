@@ -1,4 +1,6 @@
 #include <stdint.h>
+#include <stddef.h>
+#include <string.h>
 
 #define HASHSIZE(n) (1U << (n))
 #define HASHMASK(n) (HASHSIZE(n) - 1)
@@ -89,11 +91,108 @@ uint32_t FNVHash(void *data, int32_t len)
 	return h;
 }
 
+/* hash64 is built the same way as wyhash (Wang Yi's public domain hash):
+ * fold the input into two 64-bit words at a time, multiply them together
+ * into 128 bits and XOR the halves. These are its constants.
+ */
+#define P0 0xa0761d6478bd642full
+#define P1 0xe7037ed1a0b428dbull
+#define P2 0x8ebc6af09c88c6e3ull
+#define P3 0x589965cc75374cc3ull
+
+static inline uint64_t Mix(uint64_t a, uint64_t b)
+{
+	__uint128_t r = (__uint128_t) a * b;
+	return (uint64_t) r ^ (uint64_t) (r >> 64);
+}
+
+static inline uint64_t Read64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t Read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/* 1 to 3 bytes, reading each at most twice but never past the end. */
+static inline uint64_t Read3(const uint8_t *p, size_t len)
+{
+	return ((uint64_t) p[0] << 16) | ((uint64_t) p[len >> 1] << 8) |
+		p[len - 1];
+}
+
+/*
+ * hash64
+ */
+uint64_t hash64(const void *data, size_t len, uint64_t seed)
+{
+	const uint8_t *p = data;
+	uint64_t a, b;
+
+	seed ^= Mix(seed ^ P0, P1);
+
+	if (len <= 16) {
+		if (len >= 4) {
+			/* Two overlapping pairs of 4 byte reads cover 4..16. */
+			size_t off = (len >> 3) << 2;
+			a = (Read32(p) << 32) | Read32(p + off);
+			b = (Read32(p + len - 4) << 32) | Read32(p + len - 4 - off);
+		} else if (len > 0) {
+			a = Read3(p, len);
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		size_t i = len;
+
+		if (i > 48) {
+			uint64_t s1 = seed, s2 = seed;
+
+			do {
+				seed = Mix(Read64(p) ^ P1, Read64(p + 8) ^ seed);
+				s1 = Mix(Read64(p + 16) ^ P2, Read64(p + 24) ^ s1);
+				s2 = Mix(Read64(p + 32) ^ P3, Read64(p + 40) ^ s2);
+				p += 48;
+				i -= 48;
+			} while (i > 48);
+
+			seed ^= s1 ^ s2;
+		}
+
+		while (i > 16) {
+			seed = Mix(Read64(p) ^ P1, Read64(p + 8) ^ seed);
+			p += 16;
+			i -= 16;
+		}
+
+		/* The last 16 bytes, overlapping what's been done already. */
+		a = Read64(p + i - 16);
+		b = Read64(p + i - 8);
+	}
+
+	a ^= P1;
+	b ^= seed;
+
+	__uint128_t r = (__uint128_t) a * b;
+	a = (uint64_t) r;
+	b = (uint64_t) (r >> 64);
+
+	return Mix(a ^ P0 ^ len, b ^ P1);
+}
+
 /*
  * hash
- *
+ *	Used to be ElfHash(), which is slow and clusters badly on the short
+ *	keys we mostly hash.
  */
 uint32_t hash(const void *data, int32_t len)
 {
-	return ElfHash(data, len);
+	return (uint32_t) hash64(data, len, 0);
 }
@@ -1,7 +1,19 @@
 #ifndef __HASH_H__
 #define __HASH_H__
 
-/* ELF hash the given data */
+/* Hash the given data for a hash table. This is hash64() folded to 32
+ * bits; the results aren't stable between versions, so don't store them. */
 uint32_t hash(const void *data, int32_t len);
 
+/* A wyhash-style 64-bit hash: reads 8 or 16 bytes at a time and mixes with
+ * 64x64->128 bit multiplies, so it's fast on short keys as well as long
+ * ones. */
+uint64_t hash64(const void *data, size_t len, uint64_t seed);
+
+/* Older byte-at-a-time hashes, kept for comparison (see bench/hashbench.c).
+ */
+uint32_t JenkinsHash(uint8_t *k, uint32_t length, uint32_t initval);
+uint32_t ElfHash(const void *data, int32_t len);
+uint32_t FNVHash(void *data, int32_t len);
+
 #endif /* __HASH_H__ */
@@ -179,6 +179,45 @@ int ini_parse_file(FILE* file, ini_handler handler, void* user)
     return ini_parse_stream((ini_reader)fgets, file, handler, user);
 }
 
+/* Stream state for ini_parse_buffer(). */
+typedef struct {
+    const char* ptr;
+    size_t num_left;
+} ini_buffer_ctx;
+
+/* An fgets() work-alike for ini_buffer_ctx. */
+static char* ini_reader_buffer(char* str, int num, void* stream)
+{
+    ini_buffer_ctx* ctx = (ini_buffer_ctx*)stream;
+    char* strp = str;
+    char c;
+
+    if (ctx->num_left == 0 || num < 2)
+        return NULL;
+
+    while (num > 1 && ctx->num_left != 0) {
+        c = *ctx->ptr++;
+        ctx->num_left--;
+        *strp++ = c;
+        num--;
+        if (c == '\n')
+            break;
+    }
+    *strp = '\0';
+    return str;
+}
+
+/* See documentation in header file. */
+int ini_parse_buffer(const char* data, size_t len, ini_handler handler,
+                     void* user)
+{
+    ini_buffer_ctx ctx;
+
+    ctx.ptr = data;
+    ctx.num_left = len;
+    return ini_parse_stream(ini_reader_buffer, &ctx, handler, user);
+}
+
 /* See documentation in header file. */
 int ini_parse(const char* filename, ini_handler handler, void* user)
 {
@@ -48,6 +48,11 @@ int ini_parse_file(FILE* file, ini_handler handler, void* user);
 int ini_parse_stream(ini_reader reader, void* stream, ini_handler handler,
                      void* user);
 
+/* Same as ini_parse(), but parses len bytes of data (which needn't be
+   NUL terminated) instead of a file. */
+int ini_parse_buffer(const char* data, size_t len, ini_handler handler,
+                     void* user);
+
 /* Nonzero to allow multi-line value parsing, in the style of Python's
    configparser. If allowed, ini_parse() will call the handler with the same
    name for each subsequent line parsed. */
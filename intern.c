@@ -0,0 +1,292 @@
+#include "base.h"
+#include "panic.h"
+#include "memory.h"
+#include "hash.h"
+#include "intern.h"
+#include "keys.h"
+
+/* Strings are copied into a chained linear allocator, each one just after
+ * a header holding its hash, length and atom. The table itself is open
+ * addressed (linear probing) and holds atoms, so it stays small and dense.
+ * Atom n is s_Strings[n - 1].
+ */
+struct InternHdr {
+	uint32_t hash;
+	uint32_t len;
+	atom_t atom;
+};
+
+#define HDR_TO_STR(h) ((const char *) ((struct InternHdr *) (h) + 1))
+#define STR_TO_HDR(s) ((struct InternHdr *) (s) - 1)
+
+#define INTERN_CHUNK	(16 * 1024)
+#define INITIAL_SLOTS	256
+
+/* Strings longer than this are lowercased into a heap buffer. */
+#define LOWER_BUF	256
+
+static LAllocState *s_Storage = NULL;
+static const char **s_Strings = NULL;
+static uint32_t s_Count = 0;
+static uint32_t s_MaxCount = 0;
+
+static atom_t *s_Slots = NULL;
+static uint32_t s_SlotCount = 0;
+
+const char *g_EngineKeys[KEY_COUNT];
+
+static const char *s_EngineKeyStrs[KEY_COUNT] = {
+#define KEY_STR(id, str) [KEY_##id] = str,
+	ENGINE_KEYS(KEY_STR)
+#undef KEY_STR
+};
+
+/*
+ * RegisterKeys
+ *	Must be the first thing interned, so KEY_ATOM() holds.
+ */
+static void RegisterKeys()
+{
+	for (int i = 0; i < KEY_COUNT; i++) {
+		g_EngineKeys[i] = intern(s_EngineKeyStrs[i]);
+
+		if (atom_of(g_EngineKeys[i]) != (atom_t) i + 1) {
+			panic(fmt("engine key '%s' is listed twice",
+				s_EngineKeyStrs[i]));
+		}
+	}
+}
+
+/*
+ * init_intern
+ */
+ecode_t init_intern()
+{
+	if (s_Storage != NULL) {
+		trace(CHAN_DBG, "intern table already initialised");
+		return EFAIL;
+	}
+
+	s_Storage = LAlloc_CreateChained(INTERN_CHUNK, MEM_SYS_SSTR, "intern");
+
+	s_SlotCount = INITIAL_SLOTS;
+	s_Slots = MemAllocSys(s_SlotCount * sizeof(*s_Slots), MEM_SYS_SSTR);
+
+	s_MaxCount = INITIAL_SLOTS / 2;
+	s_Strings = MemAllocSys(s_MaxCount * sizeof(*s_Strings), MEM_SYS_SSTR);
+	s_Count = 0;
+
+	RegisterKeys();
+
+	return EOK;
+}
+
+/*
+ * shutdown_intern
+ */
+ecode_t shutdown_intern()
+{
+	if (s_Storage == NULL) {
+		trace(CHAN_DBG, "intern table not initialised");
+		return EFAIL;
+	}
+
+	trace(CHAN_DBG, fmt("%u strings interned, %u %s", s_Count,
+		SaneVal(LAlloc_Used(s_Storage)),
+		SaneAff(LAlloc_Used(s_Storage))));
+
+	MemFree(s_Strings);
+	MemFree(s_Slots);
+	LAlloc_Destroy(s_Storage);
+
+	s_Storage = NULL;
+	s_Strings = NULL;
+	s_Slots = NULL;
+	s_Count = s_MaxCount = s_SlotCount = 0;
+	memset(g_EngineKeys, 0, sizeof(g_EngineKeys));
+
+	return EOK;
+}
+
+/*
+ * Lookup
+ *	Returns the slot that holds str, or the empty slot it would go in.
+ */
+static atom_t *Lookup(const char *str, uint32_t len, uint32_t h)
+{
+	uint32_t mask = s_SlotCount - 1;
+
+	for (uint32_t i = h & mask; ; i = (i + 1) & mask) {
+		atom_t *slot = &s_Slots[i];
+		if (*slot == ATOM_NONE)
+			return slot;
+
+		const char *s = s_Strings[*slot - 1];
+		struct InternHdr *hdr = STR_TO_HDR(s);
+		if (hdr->hash == h && hdr->len == len &&
+			memcmp(s, str, len) == 0)
+			return slot;
+	}
+}
+
+/*
+ * Grow
+ *	Double the table and rehash everything into it. Called when it gets
+ *	half full, which also leaves s_Strings room for the next batch.
+ */
+static void Grow()
+{
+	uint32_t newCount = s_SlotCount * 2;
+	atom_t *slots = MemAllocSys(newCount * sizeof(*slots), MEM_SYS_SSTR);
+	uint32_t mask = newCount - 1;
+
+	for (uint32_t a = 0; a < s_Count; a++) {
+		uint32_t i = STR_TO_HDR(s_Strings[a])->hash & mask;
+		while (slots[i] != ATOM_NONE)
+			i = (i + 1) & mask;
+
+		slots[i] = a + 1;
+	}
+
+	const char **strings = MemAllocSys(newCount / 2 * sizeof(*strings),
+		MEM_SYS_SSTR);
+	memcpy(strings, s_Strings, s_Count * sizeof(*strings));
+
+	MemFree(s_Slots);
+	MemFree(s_Strings);
+	s_Slots = slots;
+	s_SlotCount = newCount;
+	s_Strings = strings;
+	s_MaxCount = newCount / 2;
+}
+
+/*
+ * Insert
+ */
+static const char *Insert(const char *str, uint32_t len, uint32_t h)
+{
+	if (!s_Storage) {
+		panic("intern table not initialised");
+	}
+
+	atom_t *slot = Lookup(str, len, h);
+	if (*slot != ATOM_NONE)
+		return s_Strings[*slot - 1];
+
+	if (s_Count == s_MaxCount) {
+		Grow();
+		slot = Lookup(str, len, h);
+	}
+
+	struct InternHdr *hdr = LAlloc_Aligned(s_Storage,
+		sizeof(*hdr) + len + 1, sizeof(uint32_t));
+	hdr->hash = h;
+	hdr->len = len;
+	hdr->atom = ++s_Count;
+
+	char *copy = (char *) HDR_TO_STR(hdr);
+	memcpy(copy, str, len);
+	copy[len] = '\0';
+
+	s_Strings[hdr->atom - 1] = copy;
+	*slot = hdr->atom;
+
+	return copy;
+}
+
+/*
+ * intern
+ */
+const char *intern(const char *str)
+{
+	assert(str != NULL);
+
+	uint32_t len = strlen(str);
+	return Insert(str, len, hash(str, len));
+}
+
+/*
+ * intern_lower
+ */
+const char *intern_lower(const char *str)
+{
+	assert(str != NULL);
+
+	uint32_t len = strlen(str);
+	char buf[LOWER_BUF];
+	char *lower = len < LOWER_BUF ? buf : MemAlloc(len + 1);
+
+	for (uint32_t i = 0; i < len; i++)
+		lower[i] = tolower((unsigned char) str[i]);
+	lower[len] = '\0';
+
+	const char *ret = Insert(lower, len, hash(lower, len));
+
+	if (lower != buf)
+		MemFree(lower);
+
+	return ret;
+}
+
+/*
+ * intern_find
+ */
+const char *intern_find(const char *str)
+{
+	assert(str != NULL);
+
+	if (!s_Storage) {
+		panic("intern table not initialised");
+	}
+
+	uint32_t len = strlen(str);
+	atom_t *slot = Lookup(str, len, hash(str, len));
+
+	return *slot != ATOM_NONE ? s_Strings[*slot - 1] : NULL;
+}
+
+atom_t intern_atom(const char *str)
+{
+	return STR_TO_HDR(intern(str))->atom;
+}
+
+atom_t atom_find(const char *str)
+{
+	const char *istr = intern_find(str);
+	return istr ? STR_TO_HDR(istr)->atom : ATOM_NONE;
+}
+
+/*
+ * atom_str
+ */
+const char *atom_str(atom_t atom)
+{
+	if (atom == ATOM_NONE || atom > s_Count) {
+		panic(fmt("invalid atom %u", atom));
+	}
+
+	return s_Strings[atom - 1];
+}
+
+atom_t atom_of(const char *istr)
+{
+	assert(istr != NULL);
+	return STR_TO_HDR(istr)->atom;
+}
+
+uint32_t intern_hash(const char *istr)
+{
+	assert(istr != NULL);
+	return STR_TO_HDR(istr)->hash;
+}
+
+uint32_t intern_len(const char *istr)
+{
+	assert(istr != NULL);
+	return STR_TO_HDR(istr)->len;
+}
+
+uint32_t intern_count()
+{
+	return s_Count;
+}
@@ -0,0 +1,55 @@
+/*
+ * intern.h
+ *	The string intern table. Interning a string returns the one canonical
+ *	copy of it, so two interned strings are equal if and only if the
+ *	pointers are, and comparing them never needs strcmp(). Each interned
+ *	string also has a 32-bit atom, a small number that's just as good for
+ *	comparisons and can be stored or used as an array index.
+ *
+ *	Interned strings live until shutdown_intern(); never free them. The
+ *	hash is worked out once, when the string is first interned, and kept
+ *	alongside it.
+ *
+ *	Anything that takes strings from outside (ini files, scripts, the
+ *	Ent_*Property() API) should intern them on the way in, so the code
+ *	behind it only ever deals with interned pointers or atoms.
+ *
+ *	Main thread only.
+ *
+ *	Keys the engine itself uses are interned up front; see keys.h.
+ */
+#pragma once
+
+typedef uint32_t atom_t;
+
+/* No string ever has this atom. */
+#define ATOM_NONE	0
+
+/* These are called by the base layer. */
+ecode_t init_intern();
+ecode_t shutdown_intern();
+
+/* Return the interned copy of str, adding it if it's not there yet.
+ * intern_lower() interns a lowercase copy of str instead. */
+const char *intern(const char *str);
+const char *intern_lower(const char *str);
+
+/* Return the interned copy of str if there is one, NULL if not. Handy for
+ * lookups: if the key was never interned, nothing can be using it. */
+const char *intern_find(const char *str);
+
+/* The same as above, but for atoms. */
+atom_t intern_atom(const char *str);
+atom_t atom_find(const char *str);
+
+/* Convert between atoms and interned strings. These are O(1), and istr
+ * MUST have come from intern(). */
+const char *atom_str(atom_t atom);
+atom_t atom_of(const char *istr);
+
+/* The cached hash() and strlen() of an interned string. */
+uint32_t intern_hash(const char *istr);
+uint32_t intern_len(const char *istr);
+
+/* How many strings have been interned. */
+uint32_t intern_count();
@@ -0,0 +1,34 @@
+/*
+ * keys.h
+ *	Strings the engine itself looks things up by: property names, event
+ *	names and so on. Each is interned once when the intern table starts,
+ *	before anything else, so they get the first atoms in the order listed
+ *	here. That means:
+ *
+ *	    KEY(CLASS)		the interned "class", no hashing needed
+ *	    KEY_ATOM(CLASS)	its atom, a compile-time constant you can
+ *				switch() on
+ *
+ *	Use these instead of string literals on hot paths, e.g.
+ *	Ent_FindProperty(ent, KEY(POS)). Add new ones to the end of the list.
+ */
+#pragma once
+#include "intern.h"
+
+#define ENGINE_KEYS(K) \
+	K(CLASS, "class") \
+	K(NAME, "name") \
+	K(POS, "pos") \
+	K(VEL, "vel")
+
+enum engine_key {
+#define KEY_ENUM(id, str) KEY_##id,
+	ENGINE_KEYS(KEY_ENUM)
+#undef KEY_ENUM
+	KEY_COUNT
+};
+
+extern const char *g_EngineKeys[KEY_COUNT];
+
+#define KEY(id) (g_EngineKeys[KEY_##id])
+#define KEY_ATOM(id) ((atom_t) KEY_##id + 1)
@@ -0,0 +1,519 @@
+#include "base.h"
+#include "lz4.h"
+
+/* Frame descriptor bits. */
+#define FLG_VERSION	0x40
+#define FLG_VERSION_MASK 0xc0
+#define FLG_INDEPENDENT	0x20
+#define FLG_BLOCK_SUM	0x10
+#define FLG_CONTENT_SIZE 0x08
+#define FLG_CONTENT_SUM	0x04
+#define FLG_RESERVED	0x02
+#define FLG_DICT_ID	0x01
+
+#define BD_MAX_SIZE(bd)	(((bd) >> 4) & 7)
+#define BD_RESERVED	0x8f
+
+/* Block size high bit: stored uncompressed. */
+#define BLOCK_RAW	0x80000000u
+
+/* We always write 4MB blocks. */
+#define BLOCK_MAX_CODE	7
+#define BLOCK_MAX	(4 * 1024 * 1024)
+
+#define MAX_HEADER	19	/* magic, FLG, BD, size, dict ID, HC */
+
+#define MIN_MATCH	4
+#define LAST_LITERALS	5	/* a block always ends with this many */
+#define MF_LIMIT	12	/* no match starts closer than this to the end */
+#define MAX_OFFSET	65535
+
+#define HASH_LOG	16
+#define WINDOW		65536
+
+static inline uint32_t Get32(const uint8_t *p)
+{
+	return p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 |
+		(uint32_t) p[3] << 24;
+}
+
+static inline uint64_t Get64(const uint8_t *p)
+{
+	return Get32(p) | (uint64_t) Get32(p + 4) << 32;
+}
+
+static inline void Put32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static inline void Put64(uint8_t *p, uint64_t v)
+{
+	Put32(p, (uint32_t) v);
+	Put32(p + 4, (uint32_t) (v >> 32));
+}
+
+static inline uint32_t Rotl(uint32_t x, int r)
+{
+	return (x << r) | (x >> (32 - r));
+}
+
+/*
+ * DescriptorSum
+ *	The header checksum is the second byte of the XXH32 of the frame
+ *	descriptor. Descriptors are never 16 bytes long, so this is just
+ *	XXH32's short input path.
+ */
+static uint8_t DescriptorSum(const uint8_t *p, size_t len)
+{
+	const uint32_t P1 = 2654435761u, P2 = 2246822519u, P3 = 3266489917u,
+		P4 = 668265263u, P5 = 374761393u;
+	const uint8_t *end = p + len;
+	uint32_t h = P5 + (uint32_t) len;
+
+	assert(len < 16);
+
+	for (; p + 4 <= end; p += 4)
+		h = Rotl(h + Get32(p) * P3, 17) * P4;
+	for (; p < end; p++)
+		h = Rotl(h + *p * P5, 11) * P1;
+
+	h ^= h >> 15;
+	h *= P2;
+	h ^= h >> 13;
+	h *= P3;
+	h ^= h >> 16;
+
+	return (h >> 8) & 0xff;
+}
+
+struct FrameInfo {
+	size_t headerLen;
+	size_t blockMax;
+	uint64_t contentSize;
+	bool blockSums;
+	bool contentSum;
+};
+
+/*
+ * ParseHeader
+ */
+static lz4_result_t ParseHeader(const uint8_t *p, size_t len,
+	struct FrameInfo *fi)
+{
+	if (len < 7 || Get32(p) != LZ4_MAGIC)
+		return LZ4_CORRUPT;
+
+	uint8_t flg = p[4], bd = p[5];
+
+	if ((flg & FLG_VERSION_MASK) != FLG_VERSION || (flg & FLG_RESERVED) ||
+		(bd & BD_RESERVED) || BD_MAX_SIZE(bd) < 4)
+		return LZ4_CORRUPT;
+
+	fi->headerLen = 6 + (flg & FLG_CONTENT_SIZE ? 8 : 0) +
+		(flg & FLG_DICT_ID ? 4 : 0) + 1;
+	if (len < fi->headerLen)
+		return LZ4_CORRUPT;
+
+	if (DescriptorSum(p + 4, fi->headerLen - 5) != p[fi->headerLen - 1])
+		return LZ4_CORRUPT;
+
+	/* A dictionary is something we'd never have */
+	if (flg & FLG_DICT_ID)
+		return LZ4_CORRUPT;
+
+	fi->blockMax = (size_t) 1 << (2 * BD_MAX_SIZE(bd) + 8);
+	fi->contentSize = flg & FLG_CONTENT_SIZE ? Get64(p + 6) : 0;
+	fi->blockSums = flg & FLG_BLOCK_SUM;
+	fi->contentSum = flg & FLG_CONTENT_SUM;
+
+	return LZ4_OK;
+}
+
+bool lz4_is_frame(const void *src, size_t len)
+{
+	struct FrameInfo fi;
+	return ParseHeader(src, len, &fi) == LZ4_OK;
+}
+
+uint64_t lz4_content_size(const void *src, size_t len)
+{
+	struct FrameInfo fi;
+
+	if (ParseHeader(src, len, &fi) != LZ4_OK)
+		return 0;
+
+	return fi.contentSize;
+}
+
+/*
+ * ReadLength
+ *	The 255, 255, ..., n extension of a 15 in a token.
+ */
+static inline bool ReadLength(const uint8_t **ip, const uint8_t *iend,
+	size_t *len)
+{
+	uint32_t b;
+
+	do {
+		if (*ip >= iend)
+			return false;
+
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+
+	return true;
+}
+
+/*
+ * CopyMatch
+ *	The source and destination overlap when off < len, and the overlap is
+ *	how runs are encoded, so it has to go forwards.
+ */
+static inline void CopyMatch(uint8_t *d, size_t off, size_t len)
+{
+	const uint8_t *m = d - off;
+
+	if (off >= len) {
+		memcpy(d, m, len);
+	} else if (off >= 8) {
+		size_t i = 0;
+		for (; i + 8 <= len; i += 8)
+			memcpy(d + i, m + i, 8);
+		for (; i < len; i++)
+			d[i] = m[i];
+	} else {
+		for (size_t i = 0; i < len; i++)
+			d[i] = m[i];
+	}
+}
+
+/*
+ * DecodeBlock
+ *	Decode one block into dst at *pos. Matches can reach back into
+ *	earlier blocks, which is how linked blocks work.
+ */
+static lz4_result_t DecodeBlock(const uint8_t *ip, size_t len, uint8_t *dst,
+	size_t *pos, size_t cap)
+{
+	const uint8_t *iend = ip + len;
+	size_t op = *pos;
+
+	for (;;) {
+		if (ip >= iend)
+			return LZ4_CORRUPT;
+
+		uint32_t token = *ip++;
+
+		size_t lit = token >> 4;
+		if (lit == 15 && !ReadLength(&ip, iend, &lit))
+			return LZ4_CORRUPT;
+
+		if (lit > (size_t) (iend - ip))
+			return LZ4_CORRUPT;
+		if (lit > cap - op)
+			return LZ4_NOROOM;
+
+		memcpy(dst + op, ip, lit);
+		ip += lit;
+		op += lit;
+
+		/* The last sequence is only literals */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return LZ4_CORRUPT;
+
+		size_t off = ip[0] | (size_t) ip[1] << 8;
+		ip += 2;
+		if (off == 0 || off > op)
+			return LZ4_CORRUPT;
+
+		size_t mlen = token & 15;
+		if (mlen == 15 && !ReadLength(&ip, iend, &mlen))
+			return LZ4_CORRUPT;
+		mlen += MIN_MATCH;
+
+		if (mlen > cap - op)
+			return LZ4_NOROOM;
+
+		CopyMatch(dst + op, off, mlen);
+		op += mlen;
+	}
+
+	*pos = op;
+	return LZ4_OK;
+}
+
+/*
+ * lz4_decompress
+ */
+lz4_result_t lz4_decompress(const void *src, size_t srcLen, void *dst,
+	size_t dstCap, size_t *outLen)
+{
+	struct FrameInfo fi;
+	lz4_result_t ret = ParseHeader(src, srcLen, &fi);
+	if (ret != LZ4_OK)
+		return ret;
+
+	if (fi.contentSize > dstCap)
+		return LZ4_NOROOM;
+
+	const uint8_t *ip = (const uint8_t *) src + fi.headerLen;
+	const uint8_t *iend = (const uint8_t *) src + srcLen;
+	size_t op = 0;
+
+	for (;;) {
+		if (iend - ip < 4)
+			return LZ4_CORRUPT;
+
+		uint32_t size = Get32(ip);
+		ip += 4;
+
+		if (size == 0)
+			break;
+
+		bool raw = size & BLOCK_RAW;
+		size &= ~BLOCK_RAW;
+
+		if (size > fi.blockMax || size > (size_t) (iend - ip))
+			return LZ4_CORRUPT;
+
+		if (raw) {
+			if (size > dstCap - op)
+				return LZ4_NOROOM;
+
+			memcpy((uint8_t *) dst + op, ip, size);
+			op += size;
+		} else {
+			ret = DecodeBlock(ip, size, dst, &op, dstCap);
+			if (ret != LZ4_OK)
+				return ret;
+		}
+
+		ip += size;
+
+		/* Checksums are skipped, not checked; files are trusted */
+		if (fi.blockSums) {
+			if (iend - ip < 4)
+				return LZ4_CORRUPT;
+			ip += 4;
+		}
+	}
+
+	if (fi.contentSum && iend - ip < 4)
+		return LZ4_CORRUPT;
+
+	if (fi.contentSize && op != fi.contentSize)
+		return LZ4_CORRUPT;
+
+	*outLen = op;
+	return LZ4_OK;
+}
+
+/*
+ * lz4_compress_bound
+ *	Blocks that don't shrink are stored, so the worst case is the
+ *	header, the data, a size for each block and the end mark.
+ */
+size_t lz4_compress_bound(size_t len)
+{
+	size_t blocks = (len + BLOCK_MAX - 1) / BLOCK_MAX;
+	return MAX_HEADER + len + blocks * 4 + 4;
+}
+
+static inline uint32_t Hash4(const uint8_t *p)
+{
+	return (Get32(p) * 2654435761u) >> (32 - HASH_LOG);
+}
+
+/*
+ * EmitSequence
+ *	Literals from lit, then (if mlen) a match. Returns the new end of
+ *	the output, or NULL if it doesn't fit.
+ */
+static uint8_t *EmitSequence(uint8_t *op, uint8_t *oend, const uint8_t *lit,
+	size_t litLen, size_t off, size_t mlen)
+{
+	size_t need = 1 + litLen / 255 + 1 + litLen + 2 + mlen / 255 + 1;
+	if (need > (size_t) (oend - op))
+		return NULL;
+
+	uint8_t *token = op++;
+	size_t mcode = mlen ? mlen - MIN_MATCH : 0;
+
+	*token = (litLen < 15 ? litLen : 15) << 4;
+	if (litLen >= 15) {
+		size_t n = litLen - 15;
+		for (; n >= 255; n -= 255)
+			*op++ = 255;
+		*op++ = n;
+	}
+
+	memcpy(op, lit, litLen);
+	op += litLen;
+
+	if (!mlen)
+		return op;
+
+	*op++ = off;
+	*op++ = off >> 8;
+
+	*token |= mcode < 15 ? mcode : 15;
+	if (mcode >= 15) {
+		size_t n = mcode - 15;
+		for (; n >= 255; n -= 255)
+			*op++ = 255;
+		*op++ = n;
+	}
+
+	return op;
+}
+
+/*
+ * CompressBlock
+ *	Greedy parse with hash chains: head[] is the latest position for
+ *	each hash, chain[] links each position to the previous one with the
+ *	same hash. Positions are stored + 1 so 0 means none. Returns the
+ *	compressed size, or 0 if it wouldn't fit in cap.
+ */
+static size_t CompressBlock(const uint8_t *src, size_t len, uint8_t *dst,
+	size_t cap, int level, uint32_t *work)
+{
+	uint32_t *head = work;
+	uint32_t *chain = work + (1 << HASH_LOG);
+	uint32_t attempts = 1u << (level - 1);
+
+	uint8_t *op = dst, *oend = dst + cap;
+	size_t anchor = 0, i = 0;
+
+	memset(head, 0, (1 << HASH_LOG) * sizeof(*head));
+
+	while (len > MF_LIMIT && i < len - MF_LIMIT) {
+		uint32_t h = Hash4(src + i);
+		size_t maxLen = len - LAST_LITERALS - i;
+		size_t bestLen = 0, bestPos = 0;
+
+		uint32_t cand = head[h];
+		for (uint32_t n = attempts; cand && n > 0; n--) {
+			size_t c = cand - 1;
+			if (i - c > MAX_OFFSET)
+				break;
+
+			if (Get32(src + c) == Get32(src + i)) {
+				size_t l = MIN_MATCH;
+				while (l < maxLen && src[c + l] == src[i + l])
+					l++;
+
+				if (l > bestLen) {
+					bestLen = l;
+					bestPos = c;
+					if (l == maxLen)
+						break;
+				}
+			}
+
+			cand = chain[c & (WINDOW - 1)];
+		}
+
+		chain[i & (WINDOW - 1)] = head[h];
+		head[h] = i + 1;
+
+		if (bestLen < MIN_MATCH) {
+			i++;
+			continue;
+		}
+
+		op = EmitSequence(op, oend, src + anchor, i - anchor,
+			i - bestPos, bestLen);
+		if (!op)
+			return 0;
+
+		/* Level 1 doesn't index inside matches; it's much faster and
+		 * barely worse on text */
+		size_t end = i + bestLen;
+		size_t from = level > 1 ? i + 1 : end - 2;
+		for (size_t j = from; j < end && j < len - MF_LIMIT; j++) {
+			uint32_t hj = Hash4(src + j);
+			chain[j & (WINDOW - 1)] = head[hj];
+			head[hj] = j + 1;
+		}
+
+		i = anchor = end;
+	}
+
+	op = EmitSequence(op, oend, src + anchor, len - anchor, 0, 0);
+	if (!op)
+		return 0;
+
+	return op - dst;
+}
+
+/*
+ * lz4_compress
+ *	Independent 4MB blocks, with the content size in the header so the
+ *	reader can allocate exactly once.
+ */
+size_t lz4_compress(const void *src, size_t len, void *dst, size_t dstCap,
+	int level, void *work)
+{
+	const uint8_t *ip = src;
+	uint8_t *op = dst, *oend = op + dstCap;
+
+	assert(work != NULL);
+
+	if (level < LZ4_MIN_LEVEL)
+		level = LZ4_MIN_LEVEL;
+	if (level > LZ4_MAX_LEVEL)
+		level = LZ4_MAX_LEVEL;
+
+	if (dstCap < 15 + 4)
+		return 0;
+
+	Put32(op, LZ4_MAGIC);
+	op[4] = FLG_VERSION | FLG_INDEPENDENT | FLG_CONTENT_SIZE;
+	op[5] = BLOCK_MAX_CODE << 4;
+	Put64(op + 6, len);
+	op[14] = DescriptorSum(op + 4, 10);
+	op += 15;
+
+	while (len > 0) {
+		size_t n = len < BLOCK_MAX ? len : BLOCK_MAX;
+
+		if ((size_t) (oend - op) < 4)
+			return 0;
+
+		/* Anything that doesn't come out smaller is stored */
+		size_t room = oend - op - 4;
+		size_t csize = CompressBlock(ip, n, op + 4,
+			room < n - 1 ? room : n - 1, level, work);
+
+		if (csize) {
+			Put32(op, csize);
+			op += 4 + csize;
+		} else {
+			if (room < n)
+				return 0;
+
+			Put32(op, n | BLOCK_RAW);
+			memcpy(op + 4, ip, n);
+			op += 4 + n;
+		}
+
+		ip += n;
+		len -= n;
+	}
+
+	if ((size_t) (oend - op) < 4)
+		return 0;
+
+	Put32(op, 0);
+	op += 4;
+
+	return op - (uint8_t *) dst;
+}
@@ -0,0 +1,57 @@
+/*
+ * lz4.h
+ *	LZ4 compression, written from the format description. Decoding
+ *	handles the standard frame format (what the lz4 command line tool
+ *	writes), and frames written here can be read by lz4 -d.
+ *
+ *	Decoding is bounds checked throughout, so corrupt or truncated data
+ *	fails with LZ4_CORRUPT rather than reading or writing out of bounds.
+ *	It's done block by block, straight into the caller's buffer.
+ *
+ *	Nothing here allocates, traces or panics, so it's safe on any thread
+ *	and in the tools. The compressor's tables are passed in.
+ */
+#pragma once
+
+#define LZ4_MAGIC	0x184d2204
+
+/* Higher levels search harder for matches: level n looks at up to
+ * 2^(n-1) earlier positions for each one. Decoding speed doesn't depend
+ * on the level. */
+#define LZ4_MIN_LEVEL	1
+#define LZ4_MAX_LEVEL	9
+
+/* However it's crafted, a frame can't decompress to more than this many
+ * times its size: a match is at most 255 bytes longer for each byte of
+ * length it's given. So a header claiming more than that is lying. */
+#define LZ4_MAX_RATIO	255
+
+/* Size of the work area lz4_compress() needs. */
+#define LZ4_WORK_SIZE	(2 * 65536 * sizeof(uint32_t))
+
+typedef enum lz4_result {
+	LZ4_OK = 0,
+	LZ4_CORRUPT,		/* not a frame, or a damaged one */
+	LZ4_NOROOM		/* dst is too small */
+} lz4_result_t;
+
+/* Whether src starts with a frame header. */
+bool lz4_is_frame(const void *src, size_t len);
+
+/* The decompressed size recorded in the frame header, or 0 if there isn't
+ * one (the lz4 tool only writes it with --content-size). */
+uint64_t lz4_content_size(const void *src, size_t len);
+
+/* Decompress the frame in src into dst, setting *outLen to its size. On
+ * LZ4_NOROOM, try again with a bigger dst. */
+lz4_result_t lz4_decompress(const void *src, size_t srcLen, void *dst,
+	size_t dstCap, size_t *outLen);
+
+/* The most lz4_compress() can produce for len bytes. */
+size_t lz4_compress_bound(size_t len);
+
+/* Compress len bytes from src into a frame in dst. work must point to
+ * LZ4_WORK_SIZE bytes. Returns the frame's size, or 0 if dstCap is too
+ * small (it never is if it's lz4_compress_bound(len)). */
+size_t lz4_compress(const void *src, size_t len, void *dst, size_t dstCap,
+	int level, void *work);
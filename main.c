@@ -5,6 +5,8 @@
 #include "gameloop.h"
 #include "config.h"
 #include "files.h"
+#include "cache.h"
+#include "watch.h"
 #include "script.h"
 #include "memory.h"
 #include "event.h"
@@ -12,6 +14,7 @@
 #include "map.h"
 
 #define CONFIG_FILENAME "config.ini"
+#define MEMSITES_FILENAME "memsites.csv"
 
 /*
  * init_modules
@@ -23,9 +26,20 @@ static void init_modules()
 	if (load_config(CONFIG_FILENAME) != EOK)
 		panic("Failed to load configuration");
 
-	if (init_files(g_Config.filesRoot) != EOK)
+	if (init_files(g_Config.filesRoot, g_Config.mapFiles) != EOK)
 		panic("Failed to init file system");
 
+	/* Loose files still work without the pack */
+	if (g_Config.pack && mount_pack(g_Config.pack) != EOK)
+		trace(CHAN_INFO, "Failed to mount pack, using loose files");
+
+	if (init_cache(g_Config.cacheBudget) != EOK)
+		panic("Failed to init asset cache");
+
+	/* Only for development, so carry on without it */
+	if (g_Config.hotReload && init_watch() != EOK)
+		trace(CHAN_INFO, "No file watcher, so no hot reloading");
+
 	if (init_script() != EOK)
 		panic("Failed to init script system");
 
@@ -47,6 +61,12 @@ static void shutdown_modules()
 	if (shutdown_script() != EOK)
 		panic("Failed to shutdown script system");
 
+	if (g_Config.hotReload)
+		shutdown_watch();
+
+	if (shutdown_cache() != EOK)
+		panic("Failed to shutdown asset cache");
+
 	if (shutdown_files() != EOK)
 		panic("Failed to shutdown file system");
 
@@ -108,6 +128,7 @@ int main(int argc, char *argv[])
 	shutdown_modules();
 	shutdown_base();
 	check_memory();
+	MemWriteSiteCSV(MEMSITES_FILENAME);
 
 	return EXIT_SUCCESS;
 }
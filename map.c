@@ -10,16 +10,14 @@
 /*
  * load_map
  */
-static char *parse_tileset_val(const char *val)
+static sview_t parse_tileset_val(const char *val)
 {
-        char *ret = sstrdup(val);
-        char *p = ret;
+        const char *p = val;
 
         while (*p && *p != ',')
                 p++;
 
-        *p = '\0';
-        return ret;
+        return svn(val, p - val);
 }
 
 static void parse_tile_data(struct map *map, const char *val)
@@ -46,9 +44,8 @@ handler(void *usr, const char *sec, const char *key, const char *val)
         } else if (MATCH("header", "tileheight")) {
                 m->tile_height = atoi(val);
         } else if (MATCH("tilesets", "tileset")) {
-                char *parsed = parse_tileset_val(val);
-                m->tileset = sstrcat(MAPS_DIR, parsed);
-                sstrfree(parsed);
+                m->tileset = sstrcat_sv(SV_LIT(MAPS_DIR),
+                        parse_tileset_val(val));
         } else if (MATCH("layer", "data")) {
                 parse_tile_data(m, val);
         }
@@ -57,14 +54,23 @@ handler(void *usr, const char *sec, const char *key, const char *val)
 }
 #undef MATCH
 
-struct map *load_map(const char *name)
+/*
+ * parse_map
+ *      Parse a loaded map file, closing it. Returns NULL on failure.
+ */
+static struct map *parse_map(const char *name, filehandle_t file)
 {
-        assert(name != NULL);
+        if (file == FILE_INVALID) {
+                trace(CHAN_INFO, fmt("failed to load map '%s'", name));
+                return NULL;
+        }
 
-        char *path = sstrcat(get_root_path(), name);
         struct map *ret = MemAlloc(sizeof(*ret));
+        int err = ini_parse_buffer((const char *) file_get_data(file),
+                file_get_size(file), handler, ret);
+        close_file(file);
 
-        if (ini_parse(path, handler, ret) < 0) {
+        if (err < 0) {
                 MemFree(ret);
                 trace(CHAN_INFO, fmt("failed to load map '%s'", name));
                 return NULL;
@@ -76,10 +82,56 @@ struct map *load_map(const char *name)
                 ret->tile_width, ret->tile_height));
         trace(CHAN_INFO, fmt("  tileset: %s", ret->tileset));
 
-        sstrfree(path);
         return ret;
 }
 
+struct map *load_map(const char *name)
+{
+        assert(name != NULL);
+
+        return parse_map(name, open_file_ex(name, FILE_MAYFAIL));
+}
+
+struct map_load {
+        char *name;
+        map_load_fn fn;
+        void *user;
+};
+
+static void free_map_load(void *user)
+{
+        struct map_load *req = user;
+
+        sstrfree(req->name);
+        MemFree(req);
+}
+
+static void map_loaded(filehandle_t file, void *user)
+{
+        struct map_load *req = user;
+        struct map *m = parse_map(req->name, file);
+
+        req->fn(m, req->user);
+        free_map_load(req);
+}
+
+/*
+ * load_map_async
+ */
+void load_map_async(const char *name, map_load_fn fn, void *user)
+{
+        assert(name != NULL);
+        assert(fn != NULL);
+
+        struct map_load *req = MemAlloc(sizeof(*req));
+        req->name = sstrdup(name);
+        req->fn = fn;
+        req->user = user;
+
+        open_file_async(name, FILE_MAYFAIL, map_loaded, free_map_load,
+                req);
+}
+
 /*
  * free_map
  */
@@ -14,5 +14,11 @@ struct map {
         uint16_t *data;
 };
 
+/* Returns NULL if the map can't be loaded. */
 struct map *load_map(const char *name);
+
+/* Load the map without blocking; fn gets the map (or NULL) on the main
+ * thread, a frame or more later. See open_file_async(). */
+typedef void (*map_load_fn)(struct map *m, void *user);
+void load_map_async(const char *name, map_load_fn fn, void *user);
 void free_map(struct map *m);
@@ -1,94 +1,398 @@
 #include "base.h"
 #include "memory.h"
 #include "panic.h"
-#include "list.h"
+#include <pthread.h>
 
-struct PoolNode {
-	struct list_head list;
-	void *block;
+/* Pools are made of slabs, each one a single allocation holding a header
+ * followed by blockCount blocks laid out back to back. Free blocks are
+ * chained together through their own first bytes, so there's no per-block
+ * bookkeeping and PAlloc() / PFree() are just a pointer pop / push.
+ */
+struct PoolSlab {
+	struct PoolSlab *next;
+	size_t blockCount;
+} __attribute__((aligned(16)));
+
+/* In debug builds a free block is also marked as free, so freeing it
+ * again can be caught. A block is at least POOL_ALIGN bytes, so there's
+ * always room for both words. */
+struct FreeBlock {
+	struct FreeBlock *next;
+#ifndef NDEBUG
+	uint64_t freed;
+#endif
 };
 
+#define BLOCK_FREED	0xf8eeb10cf8eeb10cull
+
+#define SLAB_BLOCKS(slab) ((uint8_t *) ((struct PoolSlab *) (slab) + 1))
+
+/* Blocks are padded out to this so anything can be stored in them. */
+#define POOL_ALIGN	16
+
+/* A pool's free blocks live in its depot, guarded by the pool's lock, and
+ * are handed out from there OWNER_BLOCKS at a time to the thread that
+ * created the pool, or MAG_BLOCKS at a time to a magazine (see below) for
+ * any other thread. The owner keeps its share on freeList without any
+ * locking, and gives OWNER_BLOCKS back whenever it's holding more than
+ * twice that, so a POOL_FIXEDSIZE pool doesn't run dry for other threads
+ * while the owner sits on its blocks.
+ *
+ * Any thread may PFree(): blocks freed elsewhere are pushed onto remoteFree
+ * with a compare-and-swap, and whoever next finds its blocks run out takes
+ * the whole lot back in one go. The depot is only grown when that leaves
+ * it empty. Growing is always done under the lock, whoever does it; slabs
+ * are only ever added to the front of the list, so it can be walked
+ * without.
+ */
+#define OWNER_BLOCKS	32
+
 struct mem_pool {
-	struct list_head freeBlocks;
-	struct list_head usedBlocks;
-	size_t blockSize;
-	size_t blockCount;
+	struct FreeBlock *freeList;	/* owner only */
+	uint32_t freeCount;		/* blocks on freeList */
+	struct FreeBlock *remoteFree;	/* only touched atomically */
+	struct PoolSlab *slabs;		/* added to under lock */
+	pthread_t owner;
+
+	pthread_mutex_t lock;
+	struct FreeBlock *depot;	/* under lock */
+	struct Magazine *magazines;	/* under s_MagLock */
+
+	size_t blockSize;	/* as asked for */
+	size_t stride;		/* blockSize rounded up to POOL_ALIGN */
+	size_t blockCount;	/* changed under lock */
+	size_t usedCount;	/* by the owner, who counts its own frees */
+	size_t remoteUsed;	/* by the others; only touched atomically */
 	pool_policy_t policy;
+	mem_sys_t sys;
 	const char *debugName;
 };
 
-static struct PoolNode *NewPoolNode(size_t blocksz)
+/* A thread that doesn't own a pool allocates from it through a magazine:
+ * up to MAG_BLOCKS free blocks taken from the depot at once, so it only
+ * locks the pool every so often. Magazines live in the thread's own
+ * storage, one per pool it allocates from; past MAX_MAGAZINES pools it
+ * takes blocks from the depot one at a time instead. Each pool keeps a
+ * list of the magazines filled from it, so destroy_pool() can tell them
+ * it's gone, and a thread's magazines go back to their depots when it
+ * exits. s_MagLock guards those lists and every magazine's pool.
+ */
+#define MAG_BLOCKS	16
+#define MAX_MAGAZINES	8
+
+struct Magazine {
+	mem_pool_t *pool;		/* NULL if unused */
+	struct Magazine *next;		/* in pool->magazines */
+	struct FreeBlock *blocks;
+};
+
+static pthread_mutex_t s_MagLock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct Magazine s_Mags[MAX_MAGAZINES];
+static pthread_key_t s_MagKey;
+static pthread_once_t s_MagKeyOnce = PTHREAD_ONCE_INIT;
+
+/*
+ * AddSlab
+ *	Allocates a new slab of the specified number of blocks, threads them
+ *	all onto the given free list, and increments the pool's blockCount
+ *	accordingly. Called with the pool locked, or before anyone else can
+ *	see it.
+ */
+static void AddSlab(mem_pool_t *pool, size_t count, struct FreeBlock **list)
 {
-	struct PoolNode *node = MemAlloc(sizeof(*node));
-	node->block = MemAlloc(blocksz);
-	return node;
+	struct PoolSlab *slab = MemAllocSys(sizeof(*slab) + count * pool->stride,
+		pool->sys);
+	slab->blockCount = count;
+
+	/* Thread them in address order so fresh blocks come out in order. */
+	uint8_t *blocks = SLAB_BLOCKS(slab);
+	for (size_t i = count; i > 0; i--) {
+		struct FreeBlock *fb = (struct FreeBlock *)
+			(blocks + (i - 1) * pool->stride);
+#ifndef NDEBUG
+		fb->freed = BLOCK_FREED;
+#endif
+		fb->next = *list;
+		*list = fb;
+	}
+
+	slab->next = pool->slabs;
+	__atomic_store_n(&pool->slabs, slab, __ATOMIC_RELEASE);
+	pool->blockCount += count;
 }
 
+#ifndef NDEBUG
 /*
- * AddFreeNodes
- *	Adds the specified number of new nodes to the pool's free list,
- *	and increments the pool's blockCount accordingly.
+ * OwnsBlock
+ *	Returns true if the given pointer is the start of a block in one of
+ *	the pool's slabs. Only used to sanity check frees; slabs double in
+ *	size as the pool grows, so there aren't many to look through.
  */
-static void AddFreeNodes(mem_pool_t *pool, size_t count, size_t sz)
+static bool OwnsBlock(mem_pool_t *pool, void *block)
 {
-	if (sz != pool->blockSize) {
-		panic(fmt("Block size mismatch in '%s'"));
+	uint8_t *p = block;
+	struct PoolSlab *s = __atomic_load_n(&pool->slabs, __ATOMIC_ACQUIRE);
+
+	for (; s; s = s->next) {
+		uint8_t *start = SLAB_BLOCKS(s);
+		uint8_t *end = start + s->blockCount * pool->stride;
+
+		if (p >= start && p < end)
+			return (p - start) % pool->stride == 0;
 	}
 
-	for (size_t i = 0; i < count; i++) {
-		struct PoolNode *node = NewPoolNode(sz);
-                list_add(&node->list, &pool->freeBlocks);
+	return false;
+}
+
+/*
+ * MarkFreed
+ *	Mark the block free, panic()ing if it already was. Any thread can
+ *	free a block, so two frees of one block can race; only one of them
+ *	gets to see it unmarked.
+ */
+static void MarkFreed(mem_pool_t *pool, struct FreeBlock *fb)
+{
+	if (__atomic_exchange_n(&fb->freed, BLOCK_FREED, __ATOMIC_RELAXED) ==
+	    BLOCK_FREED)
+		panic(fmt("'%s': block freed twice", pool->debugName));
+}
+#endif /* NDEBUG */
+
+/*
+ * MoveBlocks
+ *	Move up to count blocks from the front of one free list to the front
+ *	of another, keeping them in order, and return how many were moved.
+ */
+static uint32_t MoveBlocks(struct FreeBlock **from, struct FreeBlock **to,
+	uint32_t count)
+{
+	struct FreeBlock *first = *from;
+	struct FreeBlock *last = first;
+	uint32_t n = 1;
+
+	if (!first)
+		return 0;
+
+	while (n < count && last->next) {
+		last = last->next;
+		n++;
 	}
 
-	pool->blockCount += count;
+	*from = last->next;
+	last->next = *to;
+	*to = first;
+	return n;
+}
+
+/*
+ * ReclaimRemote
+ *	Move every block other threads have freed onto the given free list,
+ *	returning how many there were. They couldn't check the block was one
+ *	of ours, so that's done here.
+ */
+static uint32_t ReclaimRemote(mem_pool_t *pool, struct FreeBlock **list)
+{
+	struct FreeBlock *fb = __atomic_exchange_n(&pool->remoteFree, NULL,
+		__ATOMIC_ACQUIRE);
+	uint32_t n = 0;
+
+	while (fb) {
+		struct FreeBlock *next = fb->next;
+#ifndef NDEBUG
+		if (!OwnsBlock(pool, fb))
+			panic(fmt("'%s': invalid block freed by another thread",
+				pool->debugName));
+		if (fb->freed != BLOCK_FREED)
+			panic(fmt("'%s': free block is corrupt",
+				pool->debugName));
+#endif
+		fb->next = *list;
+		*list = fb;
+		fb = next;
+		n++;
+	}
+
+	__atomic_sub_fetch(&pool->remoteUsed, n, __ATOMIC_RELAXED);
+	return n;
+}
+
+/*
+ * Grow
+ *	Add another slab as big as everything the pool already has, onto the
+ *	given free list, or panic() if the pool can't grow. Called with the
+ *	pool locked.
+ */
+static void Grow(mem_pool_t *pool, struct FreeBlock **list)
+{
+	if (pool->policy == POOL_FIXEDSIZE) {
+		panic(fmt("'%s' is empty", pool->debugName));
+	}
+
+	trace(CHAN_DBG, fmt("Resizing '%s'", pool->debugName));
+	AddSlab(pool, pool->blockCount, list);
+}
+
+/*
+ * TakeBlock
+ *	Pop a block off a free list, making sure it really was free.
+ */
+static struct FreeBlock *TakeBlock(mem_pool_t *pool, struct FreeBlock **list)
+{
+	struct FreeBlock *fb = *list;
+	*list = fb->next;
+
+#ifndef NDEBUG
+	if (fb->freed != BLOCK_FREED)
+		panic(fmt("'%s': free block is corrupt", pool->debugName));
+	fb->freed = 0;
+#endif
+
+	return fb;
+}
+
+/*
+ * FillFromDepot
+ *	Move up to count free blocks from the depot onto list, restocking it
+ *	first if it's empty, and return how many were moved. If there's
+ *	nothing to restock it with and the pool's policy is POOL_DYNGROW, then
+ *	we double the pool's size. Called with the pool locked.
+ */
+static uint32_t FillFromDepot(mem_pool_t *pool, struct FreeBlock **list,
+	uint32_t count)
+{
+	if (!pool->depot)
+		ReclaimRemote(pool, &pool->depot);
+	if (!pool->depot)
+		Grow(pool, &pool->depot);
+
+	return MoveBlocks(&pool->depot, list, count);
 }
 
 /*
  * NextFreeBlock
- *	Takes a free block from the pool's free list, moves it onto the pool's
- *	used list, and returns a pointer to it.
- *	If there are no free blocks available and the pool's policy is
- *	POOL_DYNGROW, then we double the pool's size with AddFreeNodes().
+ *	Pops a block off the owner's free list and returns a pointer to it,
+ *	refilling the list first if it's empty. Owner only.
  */
 static void *NextFreeBlock(mem_pool_t *pool)
 {
-	if (list_empty(&pool->freeBlocks)) {
-		if (pool->policy == POOL_FIXEDSIZE) {
-			panic(fmt("'%s' is empty", pool->debugName));
-		} else {
-			trace(CHAN_DBG, fmt("Resizing '%s'", pool->debugName));
-			AddFreeNodes(pool, pool->blockCount, pool->blockSize);
-		}
+	if (!pool->freeList)
+		pool->freeCount += ReclaimRemote(pool, &pool->freeList);
+
+	if (!pool->freeList) {
+		pthread_mutex_lock(&pool->lock);
+		pool->freeCount += FillFromDepot(pool, &pool->freeList,
+			OWNER_BLOCKS);
+		pthread_mutex_unlock(&pool->lock);
 	}
 
-        // FIXME: This is a stupid way to get the first element
-        // Just grabbing the head with list_entry() didn't work, though?
-        struct list_head *i, *safe;
-        struct PoolNode *ret = NULL;
-        list_for_each_safe(i, safe, &pool->freeBlocks) {
-                ret = list_entry(i, struct PoolNode, list);
-                list_move(i, &pool->usedBlocks);
-                break;
-        }
+	pool->freeCount--;
+	pool->usedCount++;
+	return TakeBlock(pool, &pool->freeList);
+}
+
+/*
+ * FlushMagazines
+ *	Called when a thread exits, to give its magazines' blocks back. Other
+ *	destructors can still PAlloc() afterwards; that fills a magazine
+ *	again, and pthreads calls this again for it.
+ */
+static void FlushMagazines(void *arg)
+{
+	struct Magazine *mags = arg;
+
+	pthread_mutex_lock(&s_MagLock);
+	for (int i = 0; i < MAX_MAGAZINES; i++) {
+		struct Magazine *mag = &mags[i];
+		mem_pool_t *pool = mag->pool;
+
+		if (!pool)
+			continue;
 
-        return ret->block;
+		pthread_mutex_lock(&pool->lock);
+		MoveBlocks(&mag->blocks, &pool->depot, MAG_BLOCKS);
+		pthread_mutex_unlock(&pool->lock);
+
+		struct Magazine **m = &pool->magazines;
+		while (*m != mag)
+			m = &(*m)->next;
+		*m = mag->next;
+
+		__atomic_store_n(&mag->pool, NULL, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&s_MagLock);
 }
 
-// FIXME: This can be removed eventually
-UNUSED static void DebugPool(mem_pool_t *pool)
+static void CreateMagKey()
 {
-	size_t u = 0, f = 0;
+	if (pthread_key_create(&s_MagKey, FlushMagazines) != 0)
+		panic("failed to create pool magazine key");
+}
 
-        struct list_head *i = NULL;
-        list_for_each(i, &pool->freeBlocks) {
-                f++;
-        }
+/*
+ * FindMagazine
+ *	This thread's magazine for the pool, setting one up if it hasn't got
+ *	one. NULL if all of them are in use for other pools.
+ */
+static struct Magazine *FindMagazine(mem_pool_t *pool)
+{
+	struct Magazine *unused = NULL;
 
-        list_for_each(i, &pool->usedBlocks) {
-                u++;
-        }
+	for (int i = 0; i < MAX_MAGAZINES; i++) {
+		mem_pool_t *p = __atomic_load_n(&s_Mags[i].pool,
+			__ATOMIC_RELAXED);
 
-	trace(CHAN_DBG, fmt("[%s] USED: %u, FREE: %u", pool->debugName, u, f));
+		if (p == pool)
+			return &s_Mags[i];
+		if (!p && !unused)
+			unused = &s_Mags[i];
+	}
+
+	if (!unused)
+		return NULL;
+
+	pthread_once(&s_MagKeyOnce, CreateMagKey);
+	pthread_setspecific(s_MagKey, s_Mags);
+
+	/* Whatever's left in it belonged to a pool that's been destroyed */
+	unused->blocks = NULL;
+
+	pthread_mutex_lock(&s_MagLock);
+	unused->next = pool->magazines;
+	pool->magazines = unused;
+	__atomic_store_n(&unused->pool, pool, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&s_MagLock);
+
+	return unused;
+}
+
+/*
+ * MagazineBlock
+ *	A free block for a thread that doesn't own the pool.
+ */
+static void *MagazineBlock(mem_pool_t *pool)
+{
+	struct Magazine *mag = FindMagazine(pool);
+	struct FreeBlock *single = NULL;
+	struct FreeBlock **list = mag ? &mag->blocks : &single;
+
+	if (!*list) {
+		pthread_mutex_lock(&pool->lock);
+		FillFromDepot(pool, list, mag ? MAG_BLOCKS : 1);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	__atomic_add_fetch(&pool->remoteUsed, 1, __ATOMIC_RELAXED);
+	return TakeBlock(pool, list);
+}
+
+// FIXME: This can be removed eventually
+UNUSED static void DebugPool(mem_pool_t *pool)
+{
+	size_t used = pool->usedCount +
+		__atomic_load_n(&pool->remoteUsed, __ATOMIC_RELAXED);
+
+	trace(CHAN_DBG, fmt("[%s] USED: %u, FREE: %u", pool->debugName,
+		used, pool->blockCount - used));
 }
 
 /*
@@ -97,20 +401,22 @@ UNUSED static void DebugPool(mem_pool_t *pool)
 mem_pool_t *create_pool(size_t blockCount,
 	size_t blockSize,
 	pool_policy_t policy,
+	mem_sys_t sys,
 	const char *debugName)
 {
 	assert(blockSize > 0);
 	assert(blockCount > 0);
 
-	mem_pool_t *pool = MemAlloc(sizeof(*pool));
+	mem_pool_t *pool = MemAllocSys(sizeof(*pool), sys);
 	pool->blockSize = blockSize;
+	pool->stride = (blockSize + POOL_ALIGN - 1) & ~(size_t) (POOL_ALIGN - 1);
 	pool->policy = policy;
+	pool->sys = sys;
 	pool->debugName = debugName;
+	pool->owner = pthread_self();
+	pthread_mutex_init(&pool->lock, NULL);
 
-        INIT_LIST_HEAD(&pool->freeBlocks);
-        INIT_LIST_HEAD(&pool->usedBlocks);
-
-	AddFreeNodes(pool, blockCount, blockSize);
+	AddSlab(pool, blockCount, &pool->depot);
 
 	trace(CHAN_DBG, fmt("Pool '%s' %u x %u bytes", debugName,
 		blockCount, blockSize));
@@ -127,28 +433,35 @@ void destroy_pool(mem_pool_t *pool)
 
         trace(CHAN_DBG, fmt("pool '%s'", pool->debugName));
 
-        struct PoolNode *i, *safe;
-        list_for_each_entry_safe(i, safe, &pool->usedBlocks, list) {
-                MemFree(i->block);
-                MemFree(i);
-        }
+	/* Other threads' magazines just forget about it */
+	pthread_mutex_lock(&s_MagLock);
+	for (struct Magazine *mag = pool->magazines; mag; mag = mag->next)
+		__atomic_store_n(&mag->pool, NULL, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&s_MagLock);
 
-        list_for_each_entry_safe(i, safe, &pool->freeBlocks, list) {
-                MemFree(i->block);
-                MemFree(i);
-        }
+	pthread_mutex_destroy(&pool->lock);
+
+	struct PoolSlab *slab = pool->slabs;
+	while (slab) {
+		struct PoolSlab *next = slab->next;
+		MemFree(slab);
+		slab = next;
+	}
 
 	MemFree(pool);
 }
 
 /*
  * PAlloc
+ *	Blocks are always handed out zeroed.
  */
 void *PAlloc(mem_pool_t *pool)
 {
 	assert(pool != NULL);
 
-	void *ret = NextFreeBlock(pool);
+	void *ret = pthread_equal(pool->owner, pthread_self()) ?
+		NextFreeBlock(pool) : MagazineBlock(pool);
+	memset(ret, 0, pool->blockSize);
 	// DebugPool(pool);
 	return ret;
 }
@@ -161,17 +474,36 @@ void PFree(mem_pool_t *pool, void *block)
 	assert(pool != NULL);
 	assert(block != NULL);
 
-        struct list_head *i, *safe;
-        list_for_each_safe(i, safe, &pool->usedBlocks) {
-                struct PoolNode *n = list_entry(i, struct PoolNode, list);
+	struct FreeBlock *fb = block;
+
+	if (!pthread_equal(pool->owner, pthread_self())) {
+#ifndef NDEBUG
+		MarkFreed(pool, fb);
+#endif
+		fb->next = __atomic_load_n(&pool->remoteFree, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&pool->remoteFree,
+			&fb->next, fb, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+		return;
+	}
+
+	/* Only the owner can look at the slab list safely; ReclaimRemote()
+	 * checks the others. */
+#ifndef NDEBUG
+	if (!OwnsBlock(pool, block))
+		panic("Invalid block");
+	MarkFreed(pool, fb);
+#endif
 
-                if (n->block == block) {
-                        memset(n->block, 0, pool->blockSize);
-                        list_move(i, &pool->freeBlocks);
-                        // DebugPool(pool);
-                        return;
-                }
-        }
+	fb->next = pool->freeList;
+	pool->freeList = fb;
+	pool->usedCount--;
 
-	panic("Invalid block");
+	if (++pool->freeCount > OWNER_BLOCKS * 2) {
+		pthread_mutex_lock(&pool->lock);
+		pool->freeCount -= MoveBlocks(&pool->freeList, &pool->depot,
+			OWNER_BLOCKS);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	// DebugPool(pool);
 }
@@ -1,5 +1,21 @@
 /*
  * mem_pool.h
+ *	Pools of fixed size blocks. Blocks come from contiguous slabs and
+ *	free ones are kept on an intrusive list, so PAlloc() and PFree() are
+ *	both O(1). PAlloc() always returns a zeroed block.
+ *
+ *	A POOL_FIXEDSIZE pool panic()s when it runs out, a POOL_DYNGROW pool
+ *	adds another slab as big as everything it already has.
+ *
+ *	Pools belong to the thread that created them, but any thread can
+ *	PAlloc(): each takes a few blocks at a time to keep to hand, so it
+ *	only locks the pool once per batch, and the owner can PFree() without
+ *	locking. Blocks can be PFree()d from any other thread without locking
+ *	too. Blocks a thread keeps to hand aren't there for the others, so a
+ *	POOL_FIXEDSIZE pool used from several threads wants some slack.
+ *
+ *	Slabs are charged to the subsystem given to create_pool(), so a pool
+ *	counts against its budget by capacity, not by how much of it is used.
  */
 #pragma once
 
@@ -13,6 +29,7 @@ typedef struct mem_pool mem_pool_t;
 mem_pool_t *create_pool(size_t blockCount,
 	size_t blockSize,
 	pool_policy_t policy,
+	mem_sys_t sys,
 	const char *debugName);
 void destroy_pool(mem_pool_t *pool);
 void *PAlloc(mem_pool_t *pool);
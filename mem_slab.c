@@ -0,0 +1,407 @@
+/*
+ * mem_slab.c
+ *	The MEM_RELEASE backend for MemAlloc() / MemFree(). See memory.h.
+ *
+ *	Requests are rounded up to one of a handful of size classes. Each
+ *	thread keeps its own free list per class, so the common case is a
+ *	pointer pop or push with no locking at all. When a thread's list runs
+ *	dry it grabs a batch from the class's central list (or carves a new
+ *	slab), and when it holds too many it hands a batch back. A block freed
+ *	on a different thread to the one that allocated it simply goes onto
+ *	the freeing thread's list.
+ *
+ *	Anything bigger than the largest class goes straight to malloc().
+ *	Slabs are never returned to the system; the central lists keep them
+ *	for reuse.
+ */
+#include "base.h"
+#include "panic.h"
+#include "memory.h"
+#include <pthread.h>
+
+#ifdef MEM_RELEASE
+
+/* Every block is prefixed with one of these. While the block is allocated
+ * it holds the requested size (for the usage counters), while it's free it
+ * links the block into a free list. cls never changes once carved, sys is
+ * whichever subsystem the block is currently charged to.
+ */
+typedef struct BlockHeader {
+	union {
+		size_t size;
+		struct BlockHeader *next;
+	};
+	uint32_t cls;
+	mem_sys_t sys;
+} __attribute__((aligned(16))) BlockHeader;
+
+#define HDR_TO_BLOCK(hdr) ((void *) ((BlockHeader *) (hdr) + 1))
+#define BLOCK_TO_HDR(ptr) ((BlockHeader *) (ptr) - 1)
+
+/* 16 byte steps up to 128, then powers of two up to 4K. */
+#define NUM_LINEAR	8
+#define NUM_CLASSES	13
+#define MAX_CLASS_SIZE	4096
+#define CLASS_LARGE	0xffffffff
+
+static const uint32_t s_ClassSizes[NUM_CLASSES] = {
+	16, 32, 48, 64, 80, 96, 112, 128, 256, 512, 1024, 2048, 4096
+};
+
+/* Blocks moved between a thread cache and the central list at a time. */
+#define BATCH_SIZE	32
+#define SLAB_BYTES	(64 * 1024)
+
+struct ThreadCache {
+	BlockHeader *free[NUM_CLASSES];
+	uint32_t count[NUM_CLASSES];
+	bool registered;
+	struct ThreadCache *next;	/* in s_Caches */
+};
+
+struct CentralList {
+	pthread_mutex_t lock;
+	BlockHeader *head;
+	uint32_t count;
+};
+
+static __thread struct ThreadCache s_Cache;
+static struct CentralList s_Central[NUM_CLASSES] = {
+	[0 ... NUM_CLASSES - 1] = { PTHREAD_MUTEX_INITIALIZER, NULL, 0 }
+};
+
+/* Every live thread's cache, so MemStats() can add them all up. */
+static pthread_mutex_t s_CachesLock = PTHREAD_MUTEX_INITIALIZER;
+static struct ThreadCache *s_Caches = NULL;
+
+static pthread_key_t s_CacheKey;
+static pthread_once_t s_CacheKeyOnce = PTHREAD_ONCE_INIT;
+
+static uint64_t s_CurrentUsage = 0;
+static uint64_t s_HighWater = 0;
+static uint64_t s_SlabBytes = 0;
+static uint32_t s_AllocCount = 0;
+static uint32_t s_FreeCount = 0;
+
+/*
+ * SizeToClass
+ */
+static inline uint32_t SizeToClass(size_t sz)
+{
+	if (sz <= 128)
+		return (sz + 15) / 16 - 1;
+
+	/* 129..256 -> 8, 257..512 -> 9, ... */
+	int bits = 64 - __builtin_clzl(sz - 1);
+	return NUM_LINEAR + (bits - 8);
+}
+
+/*
+ * CountAlloc / CountFree
+ *	Keep the global counters up to date. Relaxed ordering is fine, they
+ *	are only ever read for statistics.
+ */
+static inline void CountAlloc(size_t sz)
+{
+	uint64_t now = __atomic_add_fetch(&s_CurrentUsage, sz, __ATOMIC_RELAXED);
+	uint64_t high = __atomic_load_n(&s_HighWater, __ATOMIC_RELAXED);
+
+	while (now > high) {
+		if (__atomic_compare_exchange_n(&s_HighWater, &high, now, true,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+
+	__atomic_add_fetch(&s_AllocCount, 1, __ATOMIC_RELAXED);
+}
+
+static inline void CountFree(size_t sz)
+{
+	__atomic_sub_fetch(&s_CurrentUsage, sz, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s_FreeCount, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * ReleaseToCentral
+ *	Move up to count blocks of the given class from this thread's cache
+ *	back to the central list.
+ */
+static void ReleaseToCentral(struct ThreadCache *cache, uint32_t cls,
+	uint32_t count)
+{
+	BlockHeader *first = cache->free[cls];
+	BlockHeader *last = first;
+	uint32_t n = 1;
+
+	if (!first)
+		return;
+
+	while (n < count && last->next) {
+		last = last->next;
+		n++;
+	}
+
+	cache->free[cls] = last->next;
+	cache->count[cls] -= n;
+
+	struct CentralList *central = &s_Central[cls];
+	pthread_mutex_lock(&central->lock);
+	last->next = central->head;
+	central->head = first;
+	central->count += n;
+	pthread_mutex_unlock(&central->lock);
+}
+
+/*
+ * FlushCache
+ *	Called when a thread exits, so its cached blocks aren't lost. Other
+ *	destructors can still MemFree() afterwards; that registers the cache
+ *	again, and pthreads calls this again for it.
+ */
+static void FlushCache(void *arg)
+{
+	struct ThreadCache *cache = arg;
+
+	pthread_mutex_lock(&s_CachesLock);
+	for (struct ThreadCache **i = &s_Caches; *i; i = &(*i)->next) {
+		if (*i == cache) {
+			*i = cache->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&s_CachesLock);
+	cache->registered = false;
+
+	for (uint32_t cls = 0; cls < NUM_CLASSES; cls++) {
+		while (cache->free[cls])
+			ReleaseToCentral(cache, cls, BATCH_SIZE);
+	}
+}
+
+static void CreateCacheKey()
+{
+	if (pthread_key_create(&s_CacheKey, FlushCache) != 0)
+		panic("failed to create thread cache key");
+}
+
+static void RegisterCache(struct ThreadCache *cache)
+{
+	pthread_once(&s_CacheKeyOnce, CreateCacheKey);
+	pthread_setspecific(s_CacheKey, cache);
+	cache->registered = true;
+
+	pthread_mutex_lock(&s_CachesLock);
+	cache->next = s_Caches;
+	s_Caches = cache;
+	pthread_mutex_unlock(&s_CachesLock);
+}
+
+/*
+ * CarveSlab
+ *	Allocate a new slab and split it into blocks of the given class,
+ *	straight onto this thread's free list.
+ */
+static void CarveSlab(struct ThreadCache *cache, uint32_t cls)
+{
+	size_t stride = sizeof(BlockHeader) + s_ClassSizes[cls];
+	size_t count = SLAB_BYTES / stride;
+
+	if (count < BATCH_SIZE)
+		count = BATCH_SIZE;
+
+	uint8_t *slab = malloc(stride * count);
+	if (!slab)
+		panic(fmt("out of memory carving a %u byte slab",
+			s_ClassSizes[cls]));
+
+	__atomic_add_fetch(&s_SlabBytes, stride * count, __ATOMIC_RELAXED);
+
+	for (size_t i = 0; i < count; i++) {
+		BlockHeader *hdr = (BlockHeader *) (slab + i * stride);
+		hdr->cls = cls;
+		hdr->next = cache->free[cls];
+		cache->free[cls] = hdr;
+	}
+
+	cache->count[cls] += count;
+}
+
+/*
+ * Refill
+ *	Fill this thread's free list for the given class, from the central
+ *	list if it has anything, or a fresh slab if not.
+ */
+static void Refill(struct ThreadCache *cache, uint32_t cls)
+{
+	struct CentralList *central = &s_Central[cls];
+
+	if (!cache->registered)
+		RegisterCache(cache);
+
+	pthread_mutex_lock(&central->lock);
+	while (central->head && cache->count[cls] < BATCH_SIZE) {
+		BlockHeader *hdr = central->head;
+		central->head = hdr->next;
+		central->count--;
+
+		hdr->next = cache->free[cls];
+		cache->free[cls] = hdr;
+		cache->count[cls]++;
+	}
+	pthread_mutex_unlock(&central->lock);
+
+	if (!cache->free[cls])
+		CarveSlab(cache, cls);
+}
+
+/*
+ * MemAlloc
+ */
+void *_MemAllocFast(size_t sz, mem_sys_t sys)
+{
+	assert(sz > 0);
+	assert(sys < MEM_SYS_COUNT);
+
+	BlockHeader *hdr;
+
+	if (sz > MAX_CLASS_SIZE) {
+		hdr = malloc(sizeof(*hdr) + sz);
+		if (!hdr)
+			panic(fmt("out of memory allocating %zu bytes", sz));
+
+		hdr->cls = CLASS_LARGE;
+	} else {
+		struct ThreadCache *cache = &s_Cache;
+		uint32_t cls = SizeToClass(sz);
+
+		if (!cache->free[cls])
+			Refill(cache, cls);
+
+		hdr = cache->free[cls];
+		cache->free[cls] = hdr->next;
+		cache->count[cls]--;
+	}
+
+	hdr->size = sz;
+	hdr->sys = sys;
+	CountAlloc(sz);
+	_MemSysCharge(sys, sz);
+
+	void *block = HDR_TO_BLOCK(hdr);
+	memset(block, 0, sz);
+	return block;
+}
+
+/*
+ * MemFree
+ */
+void _MemFreeFast(void *ptr)
+{
+	if (!ptr)
+		return;
+
+	BlockHeader *hdr = BLOCK_TO_HDR(ptr);
+	CountFree(hdr->size);
+	_MemSysRelease(hdr->sys, hdr->size);
+
+	if (hdr->cls == CLASS_LARGE) {
+		free(hdr);
+		return;
+	}
+
+	struct ThreadCache *cache = &s_Cache;
+	uint32_t cls = hdr->cls;
+
+	if (!cache->registered)
+		RegisterCache(cache);
+
+	hdr->next = cache->free[cls];
+	cache->free[cls] = hdr;
+	cache->count[cls]++;
+
+	if (cache->count[cls] > BATCH_SIZE * 2)
+		ReleaseToCentral(cache, cls, BATCH_SIZE);
+}
+
+uint64_t MemCurrentUsage()
+{
+	return __atomic_load_n(&s_CurrentUsage, __ATOMIC_RELAXED);
+}
+
+uint64_t MemHighWater()
+{
+	return __atomic_load_n(&s_HighWater, __ATOMIC_RELAXED);
+}
+
+uint32_t MemAllocCount()
+{
+	return __atomic_load_n(&s_AllocCount, __ATOMIC_RELAXED);
+}
+
+uint32_t MemFreeCount()
+{
+	return __atomic_load_n(&s_FreeCount, __ATOMIC_RELAXED);
+}
+
+/*
+ * MemStats
+ *	No tags to list in a release build, so just show the totals and how
+ *	many free blocks are sitting in the thread caches and central lists.
+ *	The thread cache counts are read without stopping their owners, so
+ *	they're only a snapshot.
+ */
+void MemStats()
+{
+	uint64_t usage = MemCurrentUsage();
+	uint64_t high = MemHighWater();
+	uint64_t slabs = __atomic_load_n(&s_SlabBytes, __ATOMIC_RELAXED);
+
+	trace(CHAN_MEM, fmt("Total: %u %s, highest: %u %s, slabs: %u %s",
+		SaneVal(usage), SaneAff(usage), SaneVal(high), SaneAff(high),
+		SaneVal(slabs), SaneAff(slabs)));
+	trace(CHAN_MEM, fmt("%u allocs, %u frees", MemAllocCount(),
+		MemFreeCount()));
+
+	uint32_t threads = 0;
+	uint32_t cached[NUM_CLASSES] = {0};
+
+	pthread_mutex_lock(&s_CachesLock);
+	for (struct ThreadCache *c = s_Caches; c; c = c->next) {
+		for (uint32_t cls = 0; cls < NUM_CLASSES; cls++)
+			cached[cls] += __atomic_load_n(&c->count[cls],
+				__ATOMIC_RELAXED);
+		threads++;
+	}
+	pthread_mutex_unlock(&s_CachesLock);
+
+	trace(CHAN_MEM, fmt("%u thread caches", threads));
+	for (uint32_t cls = 0; cls < NUM_CLASSES; cls++) {
+		struct CentralList *central = &s_Central[cls];
+
+		pthread_mutex_lock(&central->lock);
+		uint32_t count = central->count;
+		pthread_mutex_unlock(&central->lock);
+
+		if (count == 0 && cached[cls] == 0)
+			continue;
+
+		trace(CHAN_MEM, fmt(" class %4u: %u cached, %u central",
+			s_ClassSizes[cls], cached[cls], count));
+	}
+
+	trace(CHAN_MEM, "By subsystem:");
+	MemSysStats();
+}
+
+void MemSiteStats(uint32_t maxSites)
+{
+	trace(CHAN_MEM, "no per-site statistics in MEM_RELEASE builds");
+}
+
+ecode_t MemWriteSiteCSV(const char *filename)
+{
+	trace(CHAN_MEM, "no per-site statistics in MEM_RELEASE builds");
+	return EFAIL;
+}
+
+#endif /* MEM_RELEASE */
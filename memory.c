@@ -1,85 +1,531 @@
 #include "base.h"
 #include "panic.h"
 #include "memory.h"
+#include "list.h"
+#include <time.h>
+#include <pthread.h>
+#include <strings.h>
 
-typedef struct MemTag {
-	struct MemTag *next;
+/* A linear allocator is a list of one or more chunks, each a header followed
+ * by the memory handed out. Fixed allocators only ever have the one.
+ * offset is how far into the whole allocator the chunk's memory starts, so
+ * usage can be worked out without walking the list.
+ */
+struct LAllocChunk {
+	struct LAllocChunk *next;
+	size_t size;
+	size_t offset;
+} __attribute__((aligned(16)));
 
-	void *block;
-	size_t blockSize;
+#define CHUNK_DATA(c) ((uint8_t *) ((struct LAllocChunk *) (c) + 1))
+
+struct LAllocState {
+        const char *name;
+	struct LAllocChunk *first;
+	struct LAllocChunk *chunk;	/* the one we're allocating from */
+	uint8_t *current;
+	uint8_t *end;
+	size_t chunkSize;
+	size_t highWater;
+	mem_sys_t sys;
+	bool chained;
+};
+
+#define KB_BYTES 1024
+#define MB_BYTES 1048576
+uint32_t SaneVal(uint64_t v)
+{
+	if (v < KB_BYTES) return v;
+	if (v >= KB_BYTES && v < MB_BYTES) return v / KB_BYTES;
+	return v / MB_BYTES;
+}
+
+const char *SaneAff(uint32_t v)
+{
+	if (v < KB_BYTES) return "bytes";
+	if (v >= KB_BYTES && v < MB_BYTES) return "KB";
+	return "MB";
+}
+#undef MB_BYTES
+#undef KB_BYTES
+
+/* Per-subsystem totals, shared by both backends. They're bumped with
+ * relaxed atomics outside any lock, so they cost next to nothing but may be
+ * a hair out of step with MemCurrentUsage() when read mid-allocation.
+ */
+static const char *s_SysNames[MEM_SYS_COUNT] = {
+	[MEM_SYS_GENERAL] = "General",
+	[MEM_SYS_RENDERER] = "Renderer",
+	[MEM_SYS_ENTITIES] = "Entities",
+	[MEM_SYS_SSTR] = "Sstr",
+	[MEM_SYS_FILES] = "Files",
+	[MEM_SYS_SCRIPT] = "Script",
+	[MEM_SYS_FRAME] = "Frame"
+};
+
+static uint64_t s_SysUsage[MEM_SYS_COUNT];
+static uint64_t s_SysPeak[MEM_SYS_COUNT];
+static uint64_t s_SysBudget[MEM_SYS_COUNT];
+
+static void DefaultBudgetFn(mem_sys_t sys, uint64_t usage, uint64_t budget)
+{
+	trace(CHAN_MEM, fmt("WARNING: %s over budget, %u %s of %u %s",
+		MemSysName(sys), SaneVal(usage), SaneAff(usage),
+		SaneVal(budget), SaneAff(budget)));
+}
+
+static mem_budget_fn s_BudgetFn = DefaultBudgetFn;
+
+/*
+ * _MemSysCharge
+ *	The budget callback fires only for the allocation that crosses the
+ *	line, not every one after it, so it's cheap to leave a subsystem
+ *	sitting over budget.
+ */
+void _MemSysCharge(mem_sys_t sys, size_t sz)
+{
+	assert(sys < MEM_SYS_COUNT);
+
+	uint64_t now = __atomic_add_fetch(&s_SysUsage[sys], sz,
+		__ATOMIC_RELAXED);
+	uint64_t peak = __atomic_load_n(&s_SysPeak[sys], __ATOMIC_RELAXED);
+
+	while (now > peak) {
+		if (__atomic_compare_exchange_n(&s_SysPeak[sys], &peak, now,
+			true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+
+	uint64_t budget = __atomic_load_n(&s_SysBudget[sys], __ATOMIC_RELAXED);
+	if (budget > 0 && now > budget && now - sz <= budget) {
+		mem_budget_fn fn = __atomic_load_n(&s_BudgetFn, __ATOMIC_ACQUIRE);
+		fn(sys, now, budget);
+	}
+}
+
+void _MemSysRelease(mem_sys_t sys, size_t sz)
+{
+	assert(sys < MEM_SYS_COUNT);
+	__atomic_sub_fetch(&s_SysUsage[sys], sz, __ATOMIC_RELAXED);
+}
+
+void MemSetBudget(mem_sys_t sys, uint64_t budget)
+{
+	assert(sys < MEM_SYS_COUNT);
+	__atomic_store_n(&s_SysBudget[sys], budget, __ATOMIC_RELAXED);
+}
+
+void MemSetBudgetCallback(mem_budget_fn fn)
+{
+	__atomic_store_n(&s_BudgetFn, fn ? fn : DefaultBudgetFn,
+		__ATOMIC_RELEASE);
+}
+
+uint64_t MemSysUsage(mem_sys_t sys)
+{
+	assert(sys < MEM_SYS_COUNT);
+	return __atomic_load_n(&s_SysUsage[sys], __ATOMIC_RELAXED);
+}
+
+uint64_t MemSysPeak(mem_sys_t sys)
+{
+	assert(sys < MEM_SYS_COUNT);
+	return __atomic_load_n(&s_SysPeak[sys], __ATOMIC_RELAXED);
+}
+
+uint64_t MemSysBudget(mem_sys_t sys)
+{
+	assert(sys < MEM_SYS_COUNT);
+	return __atomic_load_n(&s_SysBudget[sys], __ATOMIC_RELAXED);
+}
+
+const char *MemSysName(mem_sys_t sys)
+{
+	assert(sys < MEM_SYS_COUNT);
+	return s_SysNames[sys];
+}
+
+mem_sys_t MemSysFromName(const char *name)
+{
+	assert(name != NULL);
 
+	for (int i = 0; i < MEM_SYS_COUNT; i++) {
+		if (strcasecmp(name, s_SysNames[i]) == 0)
+			return i;
+	}
+
+	return MEM_SYS_COUNT;
+}
+
+/*
+ * MemSysStats
+ */
+void MemSysStats()
+{
+	for (int i = 0; i < MEM_SYS_COUNT; i++) {
+		uint64_t usage = MemSysUsage(i);
+		uint64_t peak = MemSysPeak(i);
+		uint64_t budget = MemSysBudget(i);
+
+		if (budget > 0) {
+			trace(CHAN_MEM, fmt(" %-8s %u %s (peak %u %s) of %u %s%s",
+				s_SysNames[i], SaneVal(usage), SaneAff(usage),
+				SaneVal(peak), SaneAff(peak),
+				SaneVal(budget), SaneAff(budget),
+				usage > budget ? " OVER" : ""));
+		} else {
+			trace(CHAN_MEM, fmt(" %-8s %u %s (peak %u %s)",
+				s_SysNames[i], SaneVal(usage), SaneAff(usage),
+				SaneVal(peak), SaneAff(peak)));
+		}
+	}
+}
+
+/* The tracking allocator; MEM_RELEASE builds use mem_slab.c instead. */
+#ifndef MEM_RELEASE
+
+/* Allocation statistics are aggregated per call site, i.e. per MemAlloc()
+ * file and line. Sites live in a fixed size open addressing table keyed on
+ * the __FILE__ pointer and line, so updating them is a hash and a probe or
+ * two. If the table ever fills up, everything else is lumped into one
+ * overflow site.
+ */
+typedef struct MemSite {
 	const char *file;
 	long line;
 	const char *func;
-} MemTag;
 
-struct LAllocState {
-        const char *name;
-	uint8_t *base;
-	uint8_t *current;
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t bytes;		/* total ever allocated */
+	uint64_t liveBytes;
+	uint64_t peakLiveBytes;
+} MemSite;
+
+#define MAX_SITES	4096	/* must be a power of two */
+static MemSite s_Sites[MAX_SITES];
+static MemSite s_OverflowSite = {.file = "<overflow>", .func = "<many>"};
+static uint32_t s_SiteCount = 0;
+static struct timespec s_SiteEpoch;
+
+/* Every block handed out by MemAlloc() is prefixed with a MemTag, so finding
+ * the tag for a pointer given to MemFree() is just pointer arithmetic. The
+ * tags are also kept on lists so MemStats() can walk all live blocks.
+ * The struct is 16-byte aligned so the block that follows it is too.
+ */
+typedef struct MemTag {
+	struct list_head list;
+	struct ThreadTags *owner;	/* whose list it's on */
+	struct MemTag *nextFree;	/* on owner->remoteFree */
+
 	size_t blockSize;
-};
+	MemSite *site;
+
+	uint32_t magic;
+	mem_sys_t sys;
+} __attribute__((aligned(16))) MemTag;
+
+#define MEMTAG_MAGIC	0x7a61b10c
+#define MEMTAG_FREED	0xdeadb10c
+
+/* Freed blocks aren't given back to free() straight away. The last
+ * QUARANTINE_SIZE of them are kept, poisoned and with their tags marked
+ * MEMTAG_FREED, so freeing one of them again reads a tag that's still ours
+ * and can be reported as a double free. A tag's magic is cleared as it
+ * leaves quarantine, so anything older is just a bad pointer.
+ */
+#define QUARANTINE_SIZE	64
+#define POISON_BYTE	0xdd
+
+#define TAG_TO_BLOCK(tag) ((void *) ((MemTag *) (tag) + 1))
+#define BLOCK_TO_TAG(ptr) ((MemTag *) (ptr) - 1)
+
+/* Each thread keeps the tags of the blocks it allocates on a list of its
+ * own, with its own counters and quarantine, so MemAlloc() and MemFree()
+ * never wait on another thread: a list's lock is only wanted by its owner
+ * and MemStats(). Freeing a block that another thread allocated doesn't
+ * touch that thread's list. The tag is pushed onto its remoteFree with a
+ * compare-and-swap instead, and the owner unlinks everything there the
+ * next time it allocates or frees.
+ *
+ * Lists are never freed. When a thread exits, its list stays on s_Lists,
+ * still holding whatever the thread allocated, and the next new thread
+ * takes it over. So there are never more lists than there have been
+ * threads at once, and the totals can always be added up from them.
+ */
+struct ThreadTags {
+	struct list_head tags;		/* first, aligned like a MemTag */
+	pthread_mutex_t lock;		/* for tags */
+	MemTag *remoteFree;		/* only touched atomically */
+	bool live;			/* false once its thread has exited */
+
+	MemTag *quarantine[QUARANTINE_SIZE];
+	uint32_t quarantineNext;
+
+	/* Only the owner writes these, anyone can read them */
+	int64_t unfolded;		/* see USAGE_BATCH */
+	uint32_t allocs;
+	uint32_t frees;
+
+	struct ThreadTags *next;	/* in s_Lists */
+} __attribute__((aligned(16)));
+
+/* Each thread's usage is folded into s_FoldedUsage once it's moved by
+ * USAGE_BATCH either way, so the shared counter is only touched now and
+ * then. MemCurrentUsage() adds the unfolded amounts back in. The high
+ * water mark is raised as usage is folded or read, so it can miss a brief
+ * peak by up to USAGE_BATCH per thread.
+ */
+#define USAGE_BATCH	(64 * 1024)
+
+static pthread_mutex_t s_ListsLock = PTHREAD_MUTEX_INITIALIZER;
+static struct ThreadTags *s_Lists = NULL;	/* only ever added to */
+static __thread struct ThreadTags *s_MyTags = NULL;
+static pthread_key_t s_TagsKey;
+static pthread_once_t s_TagsKeyOnce = PTHREAD_ONCE_INIT;
 
-static MemTag *s_Tags = NULL;
-static uint64_t s_CurrentUsage = 0;
+static int64_t s_FoldedUsage = 0;
 static uint64_t s_HighWater = 0;
 
-static uint32_t s_AllocCount = 0;
-static uint32_t s_FreeCount = 0;
+/* Finding a site that's already in the table doesn't lock. Adding one is
+ * done under s_SiteLock, with file filled in last, so nobody sees it half
+ * done. Site counters are bumped with relaxed atomics.
+ */
+static pthread_mutex_t s_SiteLock = PTHREAD_MUTEX_INITIALIZER;
 
-static MemTag *FindTag(void *ptr)
+/*
+ * FindSite
+ *	Returns the site record for the given file and line, creating it if
+ *	this is the first allocation from there.
+ */
+static MemSite *FindSite(const char *file, long line, const char *fn)
 {
-	if (!s_Tags) return NULL;
-	for (MemTag *i = s_Tags; i; i = i->next) {
-		if (i->block == ptr) {
-			return i;
+	uint32_t h = (uint32_t) (((uintptr_t) file >> 3) ^ (line * 2654435761u));
+	MemSite *site = &s_OverflowSite;
+	bool locked = false;
+
+	for (uint32_t n = 0; n < MAX_SITES; ) {
+		MemSite *s = &s_Sites[(h + n) & (MAX_SITES - 1)];
+		const char *f = __atomic_load_n(&s->file, __ATOMIC_ACQUIRE);
+
+		if (f == file && s->line == line) {
+			site = s;
+			break;
+		}
+
+		if (f != NULL) {
+			n++;
+			continue;
+		}
+
+		/* Not there. Look at this slot again with the lock held, in
+		 * case another thread's adding the same site. */
+		if (!locked) {
+			pthread_mutex_lock(&s_SiteLock);
+			locked = true;
+			continue;
 		}
+
+		if (s_SiteCount == 0)
+			clock_gettime(CLOCK_MONOTONIC, &s_SiteEpoch);
+
+		/* Leave some headroom so probes stay short. */
+		if (s_SiteCount >= MAX_SITES - MAX_SITES / 4)
+			break;
+
+		s->line = line;
+		s->func = fn;
+		__atomic_store_n(&s->file, file, __ATOMIC_RELEASE);
+		s_SiteCount++;
+		site = s;
+		break;
 	}
 
-	return NULL;
+	if (locked)
+		pthread_mutex_unlock(&s_SiteLock);
+
+	return site;
 }
 
-static void RemoveTag(MemTag *tag)
+static void RaiseHighWater(int64_t now)
 {
-	for (MemTag *i = s_Tags, *prev = i; i; prev = i, i = i->next) {
-		if (tag->block == i->block) {
-			if (i == s_Tags) {
-				s_Tags = i->next;
-				free(i);
-				return;
-			}
+	uint64_t high = __atomic_load_n(&s_HighWater, __ATOMIC_RELAXED);
+
+	while (now > 0 && (uint64_t) now > high) {
+		if (__atomic_compare_exchange_n(&s_HighWater, &high, now, true,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+}
+
+/*
+ * CountUsage
+ *	Add to this thread's share of the usage, folding it into the total if
+ *	it's gone far enough.
+ */
+static void CountUsage(struct ThreadTags *tags, int64_t delta)
+{
+	int64_t unfolded = tags->unfolded + delta;
+
+	if (unfolded >= USAGE_BATCH || unfolded <= -USAGE_BATCH) {
+		RaiseHighWater(__atomic_add_fetch(&s_FoldedUsage, unfolded,
+			__ATOMIC_RELAXED));
+		unfolded = 0;
+	}
+
+	__atomic_store_n(&tags->unfolded, unfolded, __ATOMIC_RELAXED);
+}
+
+/*
+ * Quarantine
+ *	Hold on to a freed tag, which must already be off every list, and
+ *	give the oldest one back to free().
+ */
+static void Quarantine(struct ThreadTags *tags, MemTag *tag)
+{
+	MemTag *old = tags->quarantine[tags->quarantineNext];
+
+	tags->quarantine[tags->quarantineNext] = tag;
+	tags->quarantineNext = (tags->quarantineNext + 1) % QUARANTINE_SIZE;
+
+	if (old) {
+		old->magic = 0;
+		free(old);
+	}
+}
+
+/*
+ * ReclaimRemote
+ *	Unlink every block other threads have freed from this thread's list.
+ */
+static void ReclaimRemote(struct ThreadTags *tags)
+{
+	if (!__atomic_load_n(&tags->remoteFree, __ATOMIC_RELAXED))
+		return;
+
+	MemTag *tag = __atomic_exchange_n(&tags->remoteFree, NULL,
+		__ATOMIC_ACQUIRE);
+
+	pthread_mutex_lock(&tags->lock);
+	for (MemTag *t = tag; t; t = t->nextFree)
+		list_del(&t->list);
+	pthread_mutex_unlock(&tags->lock);
+
+	while (tag) {
+		MemTag *next = tag->nextFree;
+		Quarantine(tags, tag);
+		tag = next;
+	}
+}
+
+/*
+ * ReleaseTags
+ *	Called when a thread exits, to leave its list for the next thread.
+ *	Other destructors can still MemAlloc() or MemFree() afterwards; that
+ *	takes a list again, and pthreads calls this again for it.
+ */
+static void ReleaseTags(void *arg)
+{
+	struct ThreadTags *tags = arg;
+
+	ReclaimRemote(tags);
+	s_MyTags = NULL;
+
+	pthread_mutex_lock(&s_ListsLock);
+	tags->live = false;
+	pthread_mutex_unlock(&s_ListsLock);
+}
+
+static void CreateTagsKey()
+{
+	if (pthread_key_create(&s_TagsKey, ReleaseTags) != 0)
+		panic("failed to create thread tags key");
+}
+
+/*
+ * MyTags
+ *	This thread's list, taking over a dead thread's or making a new one
+ *	the first time.
+ */
+static struct ThreadTags *MyTags()
+{
+	struct ThreadTags *tags = s_MyTags;
+
+	if (tags)
+		return tags;
+
+	pthread_once(&s_TagsKeyOnce, CreateTagsKey);
 
-			prev->next = i->next;
-			free(i);
-			return;
+	pthread_mutex_lock(&s_ListsLock);
+	for (tags = s_Lists; tags && tags->live; tags = tags->next)
+		;
+
+	if (!tags) {
+		tags = calloc(1, sizeof(*tags));
+		if (!tags) {
+			panic("out of memory allocating thread tags");
 		}
+
+		pthread_mutex_init(&tags->lock, NULL);
+		INIT_LIST_HEAD(&tags->tags);
+		tags->next = s_Lists;
+		__atomic_store_n(&s_Lists, tags, __ATOMIC_RELEASE);
 	}
+
+	tags->live = true;
+	pthread_mutex_unlock(&s_ListsLock);
+
+	pthread_setspecific(s_TagsKey, tags);
+	s_MyTags = tags;
+
+	return tags;
 }
 
 /*
  * MemAlloc
  */
-void *_MemAlloc(size_t sz, const char *file, long line, const char *fn)
+void *_MemAlloc(size_t sz, mem_sys_t sys, const char *file, long line,
+	const char *fn)
 {
 	assert(sz > 0);
+	assert(sys < MEM_SYS_COUNT);
 
-	uint8_t *bytes = calloc(1, sz);
-	MemTag *tag = calloc(1, sizeof(*tag));
-	tag->block = bytes;
-	tag->blockSize = sz;
-	tag->file = file;
-	tag->line = line;
-	tag->func = fn;
-	tag->next = s_Tags;
-	s_Tags = tag;
-
-	s_CurrentUsage += sz;
-	if (s_CurrentUsage > s_HighWater) {
-		s_HighWater = s_CurrentUsage;
+	MemTag *tag = calloc(1, sizeof(*tag) + sz);
+	if (!tag) {
+		panic(fmt("out of memory allocating %zu bytes", sz));
 	}
 
-	s_AllocCount++;
-	return bytes;
+	struct ThreadTags *tags = MyTags();
+	ReclaimRemote(tags);
+
+	MemSite *site = FindSite(file, line, fn);
+	__atomic_add_fetch(&site->allocs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&site->bytes, sz, __ATOMIC_RELAXED);
+
+	uint64_t live = __atomic_add_fetch(&site->liveBytes, sz,
+		__ATOMIC_RELAXED);
+	uint64_t peak = __atomic_load_n(&site->peakLiveBytes, __ATOMIC_RELAXED);
+	while (live > peak) {
+		if (__atomic_compare_exchange_n(&site->peakLiveBytes, &peak,
+			live, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+
+	tag->owner = tags;
+	tag->blockSize = sz;
+	tag->site = site;
+	tag->magic = MEMTAG_MAGIC;
+	tag->sys = sys;
+
+	pthread_mutex_lock(&tags->lock);
+	list_add(&tag->list, &tags->tags);
+	pthread_mutex_unlock(&tags->lock);
+
+	CountUsage(tags, sz);
+	__atomic_store_n(&tags->allocs, tags->allocs + 1, __ATOMIC_RELAXED);
+
+	_MemSysCharge(sys, sz);
+	return TAG_TO_BLOCK(tag);
 }
 
 /*
@@ -92,45 +538,74 @@ void _MemFree(void *ptr)
 		return;
 	}
 
-	MemTag *tag = FindTag(ptr);
-	if (!tag) {
-		panic(fmt("failed to find tag for %p", ptr));
+	MemTag *tag = BLOCK_TO_TAG(ptr);
+	uint32_t magic = __atomic_load_n(&tag->magic, __ATOMIC_RELAXED);
+	if (magic != MEMTAG_MAGIC) {
+		panic(fmt("failed to find tag for %p (%s)", ptr,
+			magic == MEMTAG_FREED ? "double free" : "bad pointer"));
 	}
 
-	s_CurrentUsage -= tag->blockSize;
-	RemoveTag(tag);
+	/* Two threads freeing it at once both get this far; only one of them
+	 * gets to mark it */
+	if (__atomic_exchange_n(&tag->magic, MEMTAG_FREED, __ATOMIC_RELAXED) !=
+	    MEMTAG_MAGIC) {
+		panic(fmt("failed to find tag for %p (double free)", ptr));
+	}
+
+	struct ThreadTags *tags = MyTags();
+	ReclaimRemote(tags);
+
+	__atomic_add_fetch(&tag->site->frees, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&tag->site->liveBytes, tag->blockSize,
+		__ATOMIC_RELAXED);
+
+	CountUsage(tags, -(int64_t) tag->blockSize);
+	__atomic_store_n(&tags->frees, tags->frees + 1, __ATOMIC_RELAXED);
 
-	free(ptr);
-	s_FreeCount++;
+	_MemSysRelease(tag->sys, tag->blockSize);
+	memset(ptr, POISON_BYTE, tag->blockSize);
+
+	if (tag->owner == tags) {
+		pthread_mutex_lock(&tags->lock);
+		list_del(&tag->list);
+		pthread_mutex_unlock(&tags->lock);
+
+		Quarantine(tags, tag);
+		return;
+	}
+
+	struct ThreadTags *owner = tag->owner;
+	tag->nextFree = __atomic_load_n(&owner->remoteFree, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&owner->remoteFree, &tag->nextFree,
+		tag, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
 }
 
+/*
+ * MemCurrentUsage
+ *	Adds up every thread's share without stopping them, so it's only a
+ *	snapshot.
+ */
 uint64_t MemCurrentUsage()
 {
-	return s_CurrentUsage;
-}
+	int64_t usage = __atomic_load_n(&s_FoldedUsage, __ATOMIC_RELAXED);
 
-uint64_t MemHighWater()
-{
-	return s_HighWater;
-}
+	for (struct ThreadTags *t = __atomic_load_n(&s_Lists, __ATOMIC_ACQUIRE);
+	     t; t = t->next)
+		usage += __atomic_load_n(&t->unfolded, __ATOMIC_RELAXED);
 
-#define KB_BYTES 1024
-#define MB_BYTES 1048576
-uint32_t SaneVal(uint64_t v)
-{
-	if (v < KB_BYTES) return v;
-	if (v >= KB_BYTES && v < MB_BYTES) return v / KB_BYTES;
-	return v / MB_BYTES;
+	if (usage < 0)
+		usage = 0;
+
+	RaiseHighWater(usage);
+	return usage;
 }
 
-const char *SaneAff(uint32_t v)
+uint64_t MemHighWater()
 {
-	if (v < KB_BYTES) return "bytes";
-	if (v >= KB_BYTES && v < MB_BYTES) return "KB";
-	return "MB";
+	MemCurrentUsage();
+	return __atomic_load_n(&s_HighWater, __ATOMIC_RELAXED);
 }
-#undef MB_BYTES
-#undef KB_BYTES
 
 /*
  * MemStats
@@ -139,8 +614,8 @@ const char *SaneAff(uint32_t v)
  */
 static bool SameAlloc(MemTag *tag, MemTag *prev)
 {
-	if (strcmp(tag->file, prev->file) == 0 &&
-		strcmp(tag->func, prev->func) == 0 &&
+	if (strcmp(tag->site->file, prev->site->file) == 0 &&
+		strcmp(tag->site->func, prev->site->func) == 0 &&
 		/*tag->line == prev->line &&*/
 		tag->blockSize == prev->blockSize) {
 		return true;
@@ -170,32 +645,51 @@ void MemStats()
         uint64_t filtered = 0;
 
 	trace(CHAN_MEM, "Memory blocks being tracked:");
-	for (MemTag *i = s_Tags, *prev = i; i; prev = i, i = i->next) {
-                if (is_filtered(i->file)) {
-                        filtered++;
-                        continue;
-                }
 
-		if (i != s_Tags && SameAlloc(i, prev)) {
-			same++;
-			htotal += i->blockSize;
-			continue;
-		}
+	for (struct ThreadTags *t = __atomic_load_n(&s_Lists, __ATOMIC_ACQUIRE);
+	     t; t = t->next) {
+		MemTag *i, *prev = NULL;
 
-		if (same > 0) {
-			trace(CHAN_MEM, fmt("  (%d hidden totalling %u %s)",
-				same, SaneVal(htotal), SaneAff(htotal)));
-			same = 0;
-			htotal = 0;
-		}
+		pthread_mutex_lock(&t->lock);
+		list_for_each_entry(i, &t->tags, list) {
+			/* Freed by another thread, but not unlinked yet */
+			if (__atomic_load_n(&i->magic, __ATOMIC_RELAXED) !=
+			    MEMTAG_MAGIC)
+				continue;
+
+			bool repeat = prev && SameAlloc(i, prev);
+			prev = i;
 
-		trace(CHAN_MEM, fmt(" %u %s from %s:%ld in %s",
-			SaneVal(i->blockSize), SaneAff(i->blockSize),
-			i->file, i->line, i->func));
+			if (is_filtered(i->site->file)) {
+				filtered++;
+				continue;
+			}
+
+			if (repeat) {
+				same++;
+				htotal += i->blockSize;
+				continue;
+			}
+
+			if (same > 0) {
+				trace(CHAN_MEM, fmt("  (%d hidden totalling "
+					"%u %s)", same, SaneVal(htotal),
+					SaneAff(htotal)));
+				same = 0;
+				htotal = 0;
+			}
+
+			trace(CHAN_MEM, fmt(" %u %s from %s:%ld in %s",
+				SaneVal(i->blockSize), SaneAff(i->blockSize),
+				i->site->file, i->site->line, i->site->func));
+		}
+		pthread_mutex_unlock(&t->lock);
 	}
+
+	uint64_t usage = MemCurrentUsage();
+	uint64_t high = MemHighWater();
 	trace(CHAN_MEM, fmt("Total: %u %s, highest: %u %s",
-		SaneVal(s_CurrentUsage), SaneAff(s_CurrentUsage),
-		SaneVal(s_HighWater), SaneAff(s_HighWater)));
+		SaneVal(usage), SaneAff(usage), SaneVal(high), SaneAff(high)));
 
         if (filtered > 0) {
                 trace(CHAN_MEM, fmt("(%lu filtered) from:", filtered));
@@ -203,71 +697,477 @@ void MemStats()
                         trace(CHAN_MEM, fmt("\t%s", filt[i]));
                 }
         }
+
+	trace(CHAN_MEM, "By subsystem:");
+	MemSysStats();
 }
 
 uint32_t MemAllocCount()
 {
-	return s_AllocCount;
+	uint32_t count = 0;
+
+	for (struct ThreadTags *t = __atomic_load_n(&s_Lists, __ATOMIC_ACQUIRE);
+	     t; t = t->next)
+		count += __atomic_load_n(&t->allocs, __ATOMIC_RELAXED);
+
+	return count;
 }
 
 uint32_t MemFreeCount()
 {
-	return s_FreeCount;
+	uint32_t count = 0;
+
+	for (struct ThreadTags *t = __atomic_load_n(&s_Lists, __ATOMIC_ACQUIRE);
+	     t; t = t->next)
+		count += __atomic_load_n(&t->frees, __ATOMIC_RELAXED);
+
+	return count;
 }
 
 /*
- * LAlloc_Create
+ * SortedSites
+ *	Fill out with a copy of every site that has seen an allocation, most
+ *	allocations first, and return how many there are. Other threads can
+ *	be updating the sites meanwhile, so the copies are what's sorted.
+ */
+static int CompareSites(const void *a, const void *b)
+{
+	const MemSite *sa = a;
+	const MemSite *sb = b;
+
+	if (sa->allocs != sb->allocs)
+		return sa->allocs < sb->allocs ? 1 : -1;
+
+	return sa->bytes < sb->bytes ? 1 : (sa->bytes > sb->bytes ? -1 : 0);
+}
+
+static void CopySite(MemSite *out, MemSite *site)
+{
+	out->file = site->file;
+	out->line = site->line;
+	out->func = site->func;
+	out->allocs = __atomic_load_n(&site->allocs, __ATOMIC_RELAXED);
+	out->frees = __atomic_load_n(&site->frees, __ATOMIC_RELAXED);
+	out->bytes = __atomic_load_n(&site->bytes, __ATOMIC_RELAXED);
+	out->liveBytes = __atomic_load_n(&site->liveBytes, __ATOMIC_RELAXED);
+	out->peakLiveBytes = __atomic_load_n(&site->peakLiveBytes,
+		__ATOMIC_RELAXED);
+}
+
+static uint32_t SortedSites(MemSite *out)
+{
+	uint32_t n = 0;
+
+	for (uint32_t i = 0; i < MAX_SITES; i++) {
+		if (__atomic_load_n(&s_Sites[i].file, __ATOMIC_ACQUIRE) != NULL)
+			CopySite(&out[n++], &s_Sites[i]);
+	}
+
+	if (__atomic_load_n(&s_OverflowSite.allocs, __ATOMIC_RELAXED) > 0)
+		CopySite(&out[n++], &s_OverflowSite);
+
+	qsort(out, n, sizeof(*out), CompareSites);
+
+	return n;
+}
+
+/* Seconds since the first tracked allocation, for turning counts into
+ * rates. Never zero, so it's safe to divide by.
+ */
+static double SiteSeconds()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	double secs = (now.tv_sec - s_SiteEpoch.tv_sec) +
+		(now.tv_nsec - s_SiteEpoch.tv_nsec) / 1e9;
+
+	return secs > 0.001 ? secs : 0.001;
+}
+
+/*
+ * MemSiteStats
  */
-LAllocState *LAlloc_Create(size_t sz, const char *dbgName)
+void MemSiteStats(uint32_t maxSites)
+{
+	static MemSite sorted[MAX_SITES + 1];
+	uint32_t n = SortedSites(sorted);
+	double secs = SiteSeconds();
+
+	if (maxSites == 0 || maxSites > n)
+		maxSites = n;
+
+	trace(CHAN_MEM, fmt("Hottest %u of %u allocation sites over %.1fs:",
+		maxSites, n, secs));
+	for (uint32_t i = 0; i < maxSites; i++) {
+		MemSite *site = &sorted[i];
+
+		trace(CHAN_MEM, fmt(" %9.1f/s %8lu allocs %8lu frees, "
+			"live %u %s (peak %u %s) - %s:%ld in %s",
+			site->allocs / secs, site->allocs, site->frees,
+			SaneVal(site->liveBytes), SaneAff(site->liveBytes),
+			SaneVal(site->peakLiveBytes),
+			SaneAff(site->peakLiveBytes),
+			site->file, site->line, site->func));
+	}
+}
+
+/*
+ * MemWriteSiteCSV
+ */
+ecode_t MemWriteSiteCSV(const char *filename)
+{
+	assert(filename != NULL);
+
+	static MemSite sorted[MAX_SITES + 1];
+	uint32_t n = SortedSites(sorted);
+	double secs = SiteSeconds();
+
+	FILE *f = fopen(filename, "w");
+	if (!f) {
+		trace(CHAN_MEM, fmt("couldn't open %s for writing", filename));
+		return EFAIL;
+	}
+
+	fprintf(f, "file,line,function,allocs,frees,bytes,live_bytes,"
+		"peak_live_bytes,allocs_per_sec\n");
+	for (uint32_t i = 0; i < n; i++) {
+		MemSite *site = &sorted[i];
+
+		fprintf(f, "%s,%ld,%s,%lu,%lu,%lu,%lu,%lu,%.3f\n",
+			site->file, site->line, site->func, site->allocs,
+			site->frees, site->bytes, site->liveBytes,
+			site->peakLiveBytes, site->allocs / secs);
+	}
+
+	fclose(f);
+	trace(CHAN_MEM, fmt("wrote %u allocation sites to %s", n, filename));
+	return EOK;
+}
+#endif /* MEM_RELEASE */
+
+/*
+ * NewChunk
+ */
+static struct LAllocChunk *NewChunk(size_t sz, mem_sys_t sys)
+{
+	struct LAllocChunk *chunk = MemAllocSys(sizeof(*chunk) + sz, sys);
+	chunk->size = sz;
+	return chunk;
+}
+
+/*
+ * UseChunk
+ *	Start allocating from the beginning of the given chunk.
+ */
+static void UseChunk(LAllocState *state, struct LAllocChunk *chunk)
+{
+	state->chunk = chunk;
+	state->current = CHUNK_DATA(chunk);
+	state->end = state->current + chunk->size;
+}
+
+static LAllocState *CreateState(size_t sz, mem_sys_t sys, const char *dbgName,
+	bool chained)
 {
 	assert(sz > 0);
 
-	LAllocState *state = MemAlloc(sizeof(*state));
+	LAllocState *state = MemAllocSys(sizeof(*state), sys);
         if (!dbgName)
                 state->name = "unnamed";
         else
                 state->name = dbgName;
 
-	state->base = MemAlloc(sz);
-	state->current = state->base;
-	state->blockSize = sz;
+	state->chunkSize = sz;
+	state->sys = sys;
+	state->chained = chained;
+	state->first = NewChunk(sz, sys);
+	UseChunk(state, state->first);
 	return state;
 }
 
+/*
+ * LAlloc_Create
+ */
+LAllocState *LAlloc_Create(size_t sz, mem_sys_t sys, const char *dbgName)
+{
+	return CreateState(sz, sys, dbgName, false);
+}
+
+/*
+ * LAlloc_CreateChained
+ */
+LAllocState *LAlloc_CreateChained(size_t chunkSz, mem_sys_t sys,
+	const char *dbgName)
+{
+	return CreateState(chunkSz, sys, dbgName, true);
+}
+
 /*
  * LAlloc_Destroy
  */
 void LAlloc_Destroy(LAllocState *state)
 {
 	assert(state != NULL);
-	MemFree(state->base);
+
+	struct LAllocChunk *chunk = state->first;
+	while (chunk) {
+		struct LAllocChunk *next = chunk->next;
+		MemFree(chunk);
+		chunk = next;
+	}
+
 	MemFree(state);
 }
 
 /*
  * LAlloc_Reset
+ *	Chunks are kept, so a chained allocator that has grown to fit its
+ *	workload stops touching the heap.
  */
 void LAlloc_Reset(LAllocState *state)
 {
         assert(state != NULL);
-        state->current = state->base;
+        UseChunk(state, state->first);
+}
+
+/*
+ * LAlloc_GetMarker
+ */
+LAllocMarker LAlloc_GetMarker(LAllocState *state)
+{
+	assert(state != NULL);
+
+	LAllocMarker m = {state, state->chunk, state->current};
+	return m;
+}
+
+/*
+ * LAlloc_FreeToMarker
+ */
+void LAlloc_FreeToMarker(LAllocState *state, LAllocMarker marker)
+{
+	assert(state != NULL);
+	assert(marker.state == state);
+
+	struct LAllocChunk *chunk = marker.chunk;
+	state->chunk = chunk;
+	state->current = marker.pos;
+	state->end = CHUNK_DATA(chunk) + chunk->size;
+}
+
+void LAlloc_ScopeEnd(LAllocMarker *marker)
+{
+	LAlloc_FreeToMarker(marker->state, *marker);
+}
+
+/*
+ * NextChunk
+ *	Move on to a chunk with at least sz bytes free (plus room to align),
+ *	reusing the next one in the chain if it's big enough or inserting a
+ *	new one after the current chunk if not.
+ */
+static void NextChunk(LAllocState *state, size_t sz, size_t align)
+{
+	struct LAllocChunk *cur = state->chunk;
+	struct LAllocChunk *next = cur->next;
+
+	if (!next || next->size < sz + align) {
+		size_t chunkSz = state->chunkSize;
+		if (chunkSz < sz + align)
+			chunkSz = sz + align;
+
+		trace(CHAN_MEM, fmt("'%s' growing by %u %s", state->name,
+			SaneVal(chunkSz), SaneAff(chunkSz)));
+
+		struct LAllocChunk *chunk = NewChunk(chunkSz, state->sys);
+		chunk->next = next;
+		cur->next = chunk;
+		next = chunk;
+
+		/* Everything after the new chunk has moved along. */
+		for (struct LAllocChunk *c = cur; c->next; c = c->next)
+			c->next->offset = c->offset + c->size;
+	}
+
+	UseChunk(state, next);
+}
+
+/*
+ * LAlloc_Aligned
+ */
+void *LAlloc_Aligned(LAllocState *state, size_t sz, size_t align)
+{
+	assert(state != NULL);
+	assert(sz > 0);
+	assert(align > 0 && (align & (align - 1)) == 0);
+
+	uintptr_t p = ((uintptr_t) state->current + align - 1) & ~(align - 1);
+
+	if (p + sz > (uintptr_t) state->end) {
+		if (!state->chained) {
+			size_t left = state->end - state->current;
+			panic(fmt("Cannot satisfy allocation of %u %s from %s (%u %s left)",
+				SaneVal(sz), SaneAff(sz), state->name,
+				SaneVal(left), SaneAff(left)));
+		}
+
+		NextChunk(state, sz, align);
+		p = ((uintptr_t) state->current + align - 1) & ~(align - 1);
+	}
+
+	state->current = (uint8_t *) (p + sz);
+
+	size_t used = LAlloc_Used(state);
+	if (used > state->highWater)
+		state->highWater = used;
+
+	return (void *) p;
 }
 
 /*
  * LAlloc
  */
 void *LAlloc(LAllocState *state, size_t sz)
+{
+	return LAlloc_Aligned(state, sz, LALLOC_ALIGN);
+}
+
+/*
+ * LAlloc_Used
+ *	Bytes between the start of the allocator and the current position,
+ *	including any left unused at the end of earlier chunks.
+ */
+size_t LAlloc_Used(LAllocState *state)
 {
 	assert(state != NULL);
-	assert(sz > 0);
 
-	if (state->current + sz > state->base + state->blockSize) {
-		size_t left = state->blockSize - (state->current - state->base);
-		panic(fmt("Cannot satisfy allocation of %u %s from %s (%u %s left)",
-			SaneVal(sz), SaneAff(sz), state->name, SaneVal(left), SaneAff(left)));
+	return state->chunk->offset +
+		(state->current - CHUNK_DATA(state->chunk));
+}
+
+size_t LAlloc_HighWater(LAllocState *state)
+{
+	assert(state != NULL);
+	return state->highWater;
+}
+
+void LAlloc_ResetHighWater(LAllocState *state)
+{
+	assert(state != NULL);
+	state->highWater = LAlloc_Used(state);
+}
+
+/*
+ * LAlloc_Capacity
+ */
+size_t LAlloc_Capacity(LAllocState *state)
+{
+	assert(state != NULL);
+
+	struct LAllocChunk *last = state->first;
+	while (last->next)
+		last = last->next;
+
+	return last->offset + last->size;
+}
+
+/* The frame allocators, see memory.h. */
+static LAllocState *s_FrameMem[2] = {NULL, NULL};
+static uint32_t s_FrameIndex = 0;
+static size_t s_FrameLast = 0;
+static size_t s_FramePeak = 0;
+
+/*
+ * FrameMem_Init
+ */
+ecode_t FrameMem_Init(size_t chunkSz)
+{
+	if (s_FrameMem[0] != NULL) {
+		trace(CHAN_MEM, "frame memory already initialised");
+		return EFAIL;
 	}
 
-	void *ptr = state->current;
-	state->current += sz;
-	return ptr;
+	s_FrameMem[0] = LAlloc_CreateChained(chunkSz, MEM_SYS_FRAME, "frame0");
+	s_FrameMem[1] = LAlloc_CreateChained(chunkSz, MEM_SYS_FRAME, "frame1");
+	s_FrameIndex = 0;
+
+	return EOK;
+}
+
+/*
+ * FrameMem_Shutdown
+ */
+ecode_t FrameMem_Shutdown()
+{
+	if (s_FrameMem[0] == NULL) {
+		trace(CHAN_MEM, "frame memory wasn't initialised");
+		return EFAIL;
+	}
+
+	trace(CHAN_MEM, fmt("frame memory peak %u %s",
+		SaneVal(s_FramePeak), SaneAff(s_FramePeak)));
+
+	LAlloc_Destroy(s_FrameMem[0]);
+	LAlloc_Destroy(s_FrameMem[1]);
+	s_FrameMem[0] = s_FrameMem[1] = NULL;
+
+	return EOK;
+}
+
+/*
+ * FrameMem_NextFrame
+ *	Record how much the frame just finished used, then switch to the
+ *	other allocator and rewind it; its contents are two frames old now.
+ */
+void FrameMem_NextFrame()
+{
+	LAllocState *done = s_FrameMem[s_FrameIndex];
+	assert(done != NULL);
+
+	s_FrameLast = LAlloc_HighWater(done);
+	if (s_FrameLast > s_FramePeak)
+		s_FramePeak = s_FrameLast;
+
+	s_FrameIndex ^= 1;
+
+	LAllocState *next = s_FrameMem[s_FrameIndex];
+	LAlloc_Reset(next);
+	LAlloc_ResetHighWater(next);
+}
+
+/*
+ * FrameAlloc
+ */
+void *FrameAlloc(size_t sz)
+{
+	return LAlloc(s_FrameMem[s_FrameIndex], sz);
+}
+
+void *FrameAlloc_Aligned(size_t sz, size_t align)
+{
+	return LAlloc_Aligned(s_FrameMem[s_FrameIndex], sz, align);
+}
+
+/*
+ * FrameStrdup
+ */
+char *FrameStrdup(const char *str)
+{
+	assert(str != NULL);
+
+	size_t len = strlen(str);
+	char *ret = FrameAlloc_Aligned(len + 1, 1);
+	memcpy(ret, str, len + 1);
+	return ret;
+}
+
+size_t FrameMem_LastFrame()
+{
+	return s_FrameLast;
+}
+
+size_t FrameMem_Peak()
+{
+	return s_FramePeak;
 }
@@ -2,15 +2,99 @@
  * memory.h
  *	All memory allocations should go through MemAlloc(), frees through
  *	MemFree(). This module also provides a linear allocator API.
+ *
+ *	Each block carries its debugging tag in a header just before the
+ *	pointer returned, so MemAlloc() and MemFree() are both O(1) no
+ *	matter how many blocks are live.
+ *
+ *	MemAlloc() and MemFree() can be called from any thread, and a block
+ *	can be freed on a different thread to the one that allocated it.
+ *	Pools can be allocated from and freed into from any thread too (see
+ *	mem_pool.h), but linear and frame allocators belong to whoever uses
+ *	them.
  */
 #pragma once
+
+/* Subsystem tags
+ *	Every allocation is charged to one of these. Each has a running total
+ *	and an optional budget (set from the [MemoryBudgets] section of the
+ *	config file); when a subsystem goes over its budget the budget
+ *	callback is called. Plain MemAlloc() charges MEM_SYS_GENERAL, use
+ *	MemAllocSys() to charge something else. Pools, linear allocators and
+ *	slot maps take a tag when they're created and charge everything they
+ *	grab from the heap to it.
+ *
+ *	Keep MemSysName() in memory.c in step with this.
+ */
+typedef enum mem_sys {
+	MEM_SYS_GENERAL,
+	MEM_SYS_RENDERER,
+	MEM_SYS_ENTITIES,
+	MEM_SYS_SSTR,
+	MEM_SYS_FILES,
+	MEM_SYS_SCRIPT,
+	MEM_SYS_FRAME,
+	MEM_SYS_COUNT
+} mem_sys_t;
+
 #include "mem_pool.h"
+#include "slot_map.h"
 
-#define MemAlloc(sz) _MemAlloc(sz, __FILE__, __LINE__, __func__)
+/* Memory tracking mode
+ *	By default every block is tagged with the file, line and function
+ *	that allocated it, so MemStats() can tell you who's holding what.
+ *
+ *	Define MEM_RELEASE (build.sh has a line for it, and NDEBUG turns it
+ *	on too) to compile MemAlloc() and MemFree() down to the size-class
+ *	slab allocator in mem_slab.c instead: per-thread caches of fixed size
+ *	blocks, no tags, and only atomic usage counters. Blocks are still
+ *	zeroed, since plenty of code relies on that. Define MEM_TRACKING to
+ *	keep the tags in an NDEBUG build.
+ */
+#if defined(NDEBUG) && !defined(MEM_TRACKING) && !defined(MEM_RELEASE)
+#define MEM_RELEASE
+#endif
+
+#define MemAlloc(sz) MemAllocSys(sz, MEM_SYS_GENERAL)
+
+#ifdef MEM_RELEASE
+#define MemAllocSys(sz, sys) _MemAllocFast(sz, sys)
+#define MemFree(ptr) _MemFreeFast(ptr)
+
+void *_MemAllocFast(size_t sz, mem_sys_t sys);
+void _MemFreeFast(void *ptr);
+#else
+#define MemAllocSys(sz, sys) _MemAlloc(sz, sys, __FILE__, __LINE__, __func__)
 #define MemFree(ptr) _MemFree(ptr)
 
-void *_MemAlloc(size_t sz, const char *file, long line, const char *fn);
+void *_MemAlloc(size_t sz, mem_sys_t sys, const char *file, long line,
+	const char *fn);
 void _MemFree(void *ptr);
+#endif /* MEM_RELEASE */
+
+/* Used by both backends to keep the per-subsystem totals. */
+void _MemSysCharge(mem_sys_t sys, size_t sz);
+void _MemSysRelease(mem_sys_t sys, size_t sz);
+
+/* Budgets are in bytes, 0 for none. The callback is called on whichever
+ * thread made the allocation that took sys over its budget, once each time
+ * it crosses it; the default one trace()s a warning. Pass NULL to put the
+ * default back.
+ */
+typedef void (*mem_budget_fn)(mem_sys_t sys, uint64_t usage, uint64_t budget);
+
+void MemSetBudget(mem_sys_t sys, uint64_t budget);
+void MemSetBudgetCallback(mem_budget_fn fn);
+uint64_t MemSysUsage(mem_sys_t sys);
+uint64_t MemSysPeak(mem_sys_t sys);
+uint64_t MemSysBudget(mem_sys_t sys);
+const char *MemSysName(mem_sys_t sys);
+
+/* Case insensitive; returns MEM_SYS_COUNT if there's no such subsystem. */
+mem_sys_t MemSysFromName(const char *name);
+
+/* trace() every subsystem's usage, peak and budget. MemStats() does too. */
+void MemSysStats();
 
 
 /* Debugging */
@@ -22,6 +106,15 @@ void MemStats();
 uint32_t MemAllocCount();
 uint32_t MemFreeCount();
 
+/* Per call site statistics: allocs, frees, total bytes and live / peak live
+ * bytes for every file:line that calls MemAlloc(). MemSiteStats() traces the
+ * busiest maxSites of them (0 for all), ordered by allocation rate.
+ * MemWriteSiteCSV() writes them all out in the same order.
+ * Tracking builds only; MEM_RELEASE builds just say so.
+ */
+void MemSiteStats(uint32_t maxSites);
+ecode_t MemWriteSiteCSV(const char *filename);
+
 /*
  * Linear allocator API
  *	Use LAlloc_Create() to create a new linear allocator of the given size.
@@ -31,20 +124,79 @@ uint32_t MemFreeCount();
  *	A linear allocator is a simple way to manage allocations into one
  *	contiguous block of memory. It's extremely fast, since you're only
  *	doing some simple pointer manipulations, but as a tradeoff you can
- *	only free blocks in reverse order to which you allocated them. Or
- *	you just do what this API does and disallows freeing completely.
+ *	only free blocks in reverse order to which you allocated them. You do
+ *	that by taking a marker with LAlloc_GetMarker() and later rewinding to
+ *	it with LAlloc_FreeToMarker(), or by putting LALLOC_SCOPE(state) at
+ *	the top of a block, which rewinds when the block is left however that
+ *	happens. LAlloc_Reset() rewinds everything.
  *	Just LAlloc_Destroy() when you're done.
  *
- *	TODO: Freeing to markers?
+ *	An allocator from LAlloc_Create() panic()s when it runs out. One from
+ *	LAlloc_CreateChained() instead grabs another chunk (of at least chunkSz)
+ *	and carries on. Chunks are kept when rewinding, so once it has grown to
+ *	fit its workload it doesn't go near the heap again.
  */
 typedef struct LAllocState LAllocState;
 
-LAllocState *LAlloc_Create(size_t sz, const char *dbgName);
+typedef struct LAllocMarker {
+	LAllocState *state;
+	void *chunk;
+	uint8_t *pos;
+} LAllocMarker;
+
+/* What LAlloc() aligns to; use LAlloc_Aligned() to ask for something else. */
+#define LALLOC_ALIGN	16
+
+LAllocState *LAlloc_Create(size_t sz, mem_sys_t sys, const char *dbgName);
+LAllocState *LAlloc_CreateChained(size_t chunkSz, mem_sys_t sys,
+	const char *dbgName);
 void LAlloc_Destroy(LAllocState *state);
 void LAlloc_Reset(LAllocState *state);
 
+LAllocMarker LAlloc_GetMarker(LAllocState *state);
+void LAlloc_FreeToMarker(LAllocState *state, LAllocMarker marker);
+
+void LAlloc_ScopeEnd(LAllocMarker *marker);
+#define LALLOC_SCOPE_VAR2(n) _lalloc_scope_##n
+#define LALLOC_SCOPE_VAR(n) LALLOC_SCOPE_VAR2(n)
+#define LALLOC_SCOPE(state) \
+	LAllocMarker LALLOC_SCOPE_VAR(__LINE__) \
+	__attribute__((cleanup(LAlloc_ScopeEnd))) = LAlloc_GetMarker(state)
+
 /* Returns a pointer to a memory block of the given size from the memory
  * managed by the given allocator state, or panic()s and doesn't return if
- * there isn't enough memory to satisfy.
+ * there isn't enough memory to satisfy (fixed size allocators only).
+ * align must be a power of two.
  */
 void *LAlloc(LAllocState *state, size_t sz);
+void *LAlloc_Aligned(LAllocState *state, size_t sz, size_t align);
+
+/* Bytes currently allocated, the most there have been since creation or
+ * the last LAlloc_ResetHighWater(), and the total size of all chunks. */
+size_t LAlloc_Used(LAllocState *state);
+size_t LAlloc_HighWater(LAllocState *state);
+void LAlloc_ResetHighWater(LAllocState *state);
+size_t LAlloc_Capacity(LAllocState *state);
+
+/*
+ * Frame allocator API
+ *	Scratch memory that lives for a frame or so, with no need to free it.
+ *	It's a pair of chained linear allocators: mainloop() calls
+ *	FrameMem_NextFrame() at the start of every frame, which swaps them
+ *	over and rewinds the one now in use. So anything from FrameAlloc() is
+ *	good until the end of the frame after the one it was allocated in,
+ *	which is enough to hand data from one frame to the next.
+ *
+ *	Main thread only.
+ */
+ecode_t FrameMem_Init(size_t chunkSz);
+ecode_t FrameMem_Shutdown();
+void FrameMem_NextFrame();
+
+void *FrameAlloc(size_t sz);
+void *FrameAlloc_Aligned(size_t sz, size_t align);
+char *FrameStrdup(const char *str);
+
+/* High-water mark of the last complete frame, and of any frame so far. */
+size_t FrameMem_LastFrame();
+size_t FrameMem_Peak();
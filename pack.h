@@ -0,0 +1,45 @@
+/*
+ * pack.h
+ *	The pack file format. A pack holds a whole tree of game files in one
+ *	file, so the file system can map it once at startup instead of doing
+ *	an open()/fstat()/read() for every file. Packs are made offline with
+ *	tools/mkpak.c and mounted with mount_pack() (see files.h).
+ *
+ *	Layout, all integers in the host's byte order:
+ *
+ *	    struct pack_header
+ *	    file data, each file starting on a PACK_ALIGN boundary; files
+ *	    with PACK_LZ4 set are stored as LZ4 frames (see lz4.h)
+ *	    struct pack_entry[count], sorted by name (strcmp() order)
+ *	    names, each NUL terminated
+ *
+ *	Names are paths relative to the files root, with '/' separators and
+ *	no leading "./", exactly as they'd be passed to open_file().
+ */
+#pragma once
+
+#define PACK_MAGIC	"TPAK"
+#define PACK_VERSION	2
+#define PACK_ALIGN	16
+
+struct pack_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t count;
+	uint32_t namesSize;
+	uint64_t tocOffset;
+	uint64_t namesOffset;
+};
+
+/* pack_entry flags */
+#define PACK_LZ4	0x1
+
+struct pack_entry {
+	uint64_t offset;	/* from the start of the pack */
+	uint64_t size;		/* as stored */
+	uint64_t rawSize;	/* once decompressed; the same as size if not */
+	uint32_t nameOffset;	/* from namesOffset */
+	uint32_t nameLen;	/* not counting the NUL */
+	uint32_t flags;
+	uint32_t pad;
+};
@@ -14,8 +14,9 @@
 #define FONT_SMALLSIZE 13
 #define FONT_NORMSIZE 15
 
-/* We use a linear allocator to hold the render commands for each frame,
- * so a maximum of RCMD_POOL_SZ can exist at once. */
+/* We use a chained linear allocator to hold the render commands for each
+ * frame. It starts with room for RCMD_POOL_SZ and grows if a frame needs more.
+ */
 #define RCMD_POOL_SZ 32
 
 /* The global renderer state. */
@@ -224,7 +225,7 @@ static void destroy_command(struct render_command *cmd)
 {
         switch (cmd->type) {
         case RC_TEXT:
-                sstrfree(cmd->text.str);
+                /* str came from FrameStrdup() */
                 break;
         case RC_SHAPE:
                 break;
@@ -258,7 +259,7 @@ void r_add_string(FontSize sz, Colour c, int x, int y, const char *str)
         cmd->type = RC_TEXT;
         cmd->text.size = sz;
         cmd->text.colour = c;
-        cmd->text.str = sstrdup(str);
+        cmd->text.str = FrameStrdup(str);
         cmd->text.x = x;
         cmd->text.y = y;
 
@@ -372,8 +373,9 @@ ecode_t init_renderer()
 		panic("Renderer already initialised");
 	}
 
-        rcmd_pool = LAlloc_Create(RCMD_POOL_SZ * sizeof(struct render_command),
-                "rcmds");
+        rcmd_pool = LAlloc_CreateChained(
+                RCMD_POOL_SZ * sizeof(struct render_command),
+                MEM_SYS_RENDERER, "rcmds");
 
 	if (SDL_Init(SDL_INIT_VIDEO) < 0) {
 		panic(fmt("SDL_Init() failed (%s)", SDL_GetError()));
@@ -560,6 +562,38 @@ static void process_commands()
         LAlloc_Reset(rcmd_pool);
 }
 
+/*
+ * debug_memory
+ *      One line per subsystem that has anything allocated or a budget,
+ *      working up the screen from y. Red if it's over budget.
+ */
+static void debug_memory(int y)
+{
+        for (int i = MEM_SYS_COUNT - 1; i >= 0; i--) {
+                uint64_t usage = MemSysUsage(i);
+                uint64_t budget = MemSysBudget(i);
+                const char *s;
+
+                if (usage == 0 && budget == 0)
+                        continue;
+
+                if (budget > 0) {
+                        s = fmt("%s: %u %s / %u %s", MemSysName(i),
+                                SaneVal(usage), SaneAff(usage),
+                                SaneVal(budget), SaneAff(budget));
+                } else {
+                        s = fmt("%s: %u %s", MemSysName(i),
+                                SaneVal(usage), SaneAff(usage));
+                }
+
+                r_add_string(FONT_NORMAL,
+                        budget > 0 && usage > budget ? COLOUR_RED :
+                                COLOUR_WHITE,
+                        10, y, s);
+                y -= 20;
+        }
+}
+
 static void debug_commands()
 {
         struct render_command *iter = NULL;
@@ -589,12 +623,15 @@ static void debug_commands()
         const char *s = fmt("rcmds: %u (t: %u, sh: %u, sp: %u, p: %u) / %d" \
                                 " - discarded: %u",
                 total, counts[RC_TEXT], counts[RC_SHAPE],
-                counts[RC_SPRITE], counts[RC_PSYSTEM], RCMD_POOL_SZ,
+                counts[RC_SPRITE], counts[RC_PSYSTEM],
+                (int) (LAlloc_Capacity(rcmd_pool) /
+                        sizeof(struct render_command)),
                 discarded_cmds);
 
         accepting_cmds = true;
         r_add_string(FONT_NORMAL, COLOUR_WHITE, 10, g_Config.windowHeight - 50,
                 s);
+        debug_memory(g_Config.windowHeight - 70);
         accepting_cmds = false;
         discarded_cmds = 0;
 }
@@ -1,9 +1,19 @@
 #include "base.h"
 #include "panic.h"
 #include "script.h"
+#include "intern.h"
+#include "ch_hashtable.h"
+#include "watch.h"
 
 static Tcl_Interp *s_Interp = NULL;
-#define BASEDEFS_FILENAME "./res/tcl/basedefs.tcl"
+#define BASEDEFS_FILENAME "tcl/basedefs.tcl"
+
+/* Every file script_runfile() has run, keyed by the atom of its name, so
+ * they can be run again when they change. */
+static hashtable_t *s_Scripts = NULL;
+#define INITIAL_SCRIPTS 32
+
+static void reload_script(const char *name, void *user);
 
 SCRIPT_PROCEDURE(ScriptTests) {
 	trace(CHAN_SCRIPT, "In ScriptTests()");
@@ -37,12 +47,15 @@ ecode_t init_script()
 		return EFAIL;
 	}
 
+	s_Scripts = create_hashtable(INITIAL_SCRIPTS, HT_KEY_INT,
+		MEM_SYS_SCRIPT, "Scripts");
+	watch_add_handler(".tcl", reload_script, NULL);
+
 	script_register_command(ScriptTests, "scrtests");
 
 	/* Load and run bootstrap script */
-	if (Tcl_EvalFile(s_Interp, BASEDEFS_FILENAME) != TCL_OK) {
+	if (script_runfile(BASEDEFS_FILENAME) != EOK) {
 		trace(CHAN_SCRIPT, fmt("Couldn't eval %s", BASEDEFS_FILENAME));
-		print_error(s_Interp);
 		return EFAIL;
 	}
 
@@ -55,6 +68,10 @@ ecode_t shutdown_script()
 		panic("Script module not initialised");
 	}
 
+	watch_remove_handler(".tcl", reload_script);
+	destroy_hashtable(s_Scripts);
+	s_Scripts = NULL;
+
 	Tcl_DeleteInterp(s_Interp);
 	s_Interp = NULL;
 
@@ -89,7 +106,8 @@ ecode_t script_execfile(filehandle_t handle)
 	const char *contents = (const char *) file_get_data(handle);
 	const char *path = file_get_path(handle);
 
-	if (Tcl_Eval(s_Interp, contents) != TCL_OK) {
+	/* File data isn't NUL terminated. */
+	if (Tcl_EvalEx(s_Interp, contents, file_get_size(handle), 0) != TCL_OK) {
 		trace(CHAN_INFO, fmt("Failed to eval file '%s'", path));
 		print_error(s_Interp);
 		return EFAIL;
@@ -98,6 +116,46 @@ ecode_t script_execfile(filehandle_t handle)
 	return EOK;
 }
 
+/*
+ * script_runfile
+ */
+ecode_t script_runfile(const char *name)
+{
+	assert(name != NULL);
+
+	if (!s_Interp) {
+		panic("Script module not initialised");
+	}
+
+	filehandle_t handle = open_file(name);
+	ecode_t ret = script_execfile(handle);
+	close_file(handle);
+
+	const char *iname = intern(name);
+	HTSetInt(s_Scripts, atom_of(iname), (void *) iname);
+
+	return ret;
+}
+
+/*
+ * reload_script
+ *	Called by the file watcher when a script changes. Only ones that have
+ *	been run are run again; running the file redefines whatever it
+ *	defines, and leaves everything else alone.
+ */
+static void reload_script(const char *name, void *user)
+{
+	if (!HTHasInt(s_Scripts, atom_of(name)))
+		return;
+
+	filehandle_t handle = open_file_ex(name, FILE_MAYFAIL);
+	if (handle == FILE_INVALID)
+		return;
+
+	script_execfile(handle);
+	close_file(handle);
+}
+
 /*
  * script_register_command
  */
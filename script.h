@@ -24,6 +24,11 @@ ecode_t script_execstr(const char *str);
  */
 ecode_t script_execfile(filehandle_t handle);
 
+/* Open, run and close the named script (relative to the files root). If
+ * the file watcher is running, the script is run again whenever it's
+ * changed (see watch.h). */
+ecode_t script_runfile(const char *name);
+
 /* Register the given script command function, so it can be called from
  * Tcl code. (SCRIPT_PROCEDURE helps.) The script will reference it
  * by the given name.
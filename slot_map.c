@@ -0,0 +1,197 @@
+#include "base.h"
+#include "memory.h"
+#include "panic.h"
+
+/* Handles are a slot index in the low bits and the slot's generation in the
+ * high bits. Generations start at 1 and skip 0 when they wrap, so a handle
+ * is never SLOT_INVALID.
+ */
+#define INDEX_BITS	20
+#define INDEX_MASK	((1u << INDEX_BITS) - 1)
+#define GEN_MASK	((1u << (32 - INDEX_BITS)) - 1)
+
+#define MAKE_HANDLE(idx, gen) (((gen) << INDEX_BITS) | (idx))
+#define HANDLE_INDEX(h) ((h) & INDEX_MASK)
+#define HANDLE_GEN(h) ((h) >> INDEX_BITS)
+
+/* Points from a handle's slot to where its item currently is in the dense
+ * array. While the slot is unused, dense is the next free slot instead.
+ */
+struct Slot {
+	uint32_t dense;
+	uint32_t gen;
+};
+
+struct slot_map {
+	uint8_t *items;		/* capacity items, the first count live */
+	uint32_t *denseToSlot;	/* which slot owns each dense item */
+	struct Slot *slots;
+	uint32_t freeSlot;	/* head of the free slot list */
+	uint32_t count;
+	uint32_t capacity;
+	size_t itemSize;
+	slot_moved_fn moved;
+	const char *debugName;
+};
+
+#define ITEM(map, i) ((void *) ((map)->items + (size_t) (i) * (map)->itemSize))
+
+/*
+ * create_slot_map
+ */
+slot_map_t *create_slot_map(uint32_t capacity,
+	size_t itemSize,
+	slot_moved_fn moved,
+	mem_sys_t sys,
+	const char *debugName)
+{
+	assert(capacity > 0 && capacity <= INDEX_MASK);
+	assert(itemSize > 0);
+
+	slot_map_t *map = MemAllocSys(sizeof(*map), sys);
+	map->itemSize = (itemSize + 15) & ~(size_t) 15;
+	map->capacity = capacity;
+	map->moved = moved;
+	map->debugName = debugName;
+
+	map->items = MemAllocSys(capacity * map->itemSize, sys);
+	map->denseToSlot = MemAllocSys(capacity * sizeof(*map->denseToSlot),
+		sys);
+	map->slots = MemAllocSys(capacity * sizeof(*map->slots), sys);
+
+	for (uint32_t i = 0; i < capacity; i++) {
+		map->slots[i].dense = i + 1;
+		map->slots[i].gen = 1;
+	}
+	map->freeSlot = 0;
+
+	trace(CHAN_DBG, fmt("Slot map '%s' %u x %u bytes", debugName,
+		capacity, itemSize));
+
+	return map;
+}
+
+/*
+ * destroy_slot_map
+ */
+void destroy_slot_map(slot_map_t *map)
+{
+	assert(map != NULL);
+
+	trace(CHAN_DBG, fmt("slot map '%s'", map->debugName));
+
+	MemFree(map->slots);
+	MemFree(map->denseToSlot);
+	MemFree(map->items);
+	MemFree(map);
+}
+
+/*
+ * SMAlloc
+ */
+slot_handle_t SMAlloc(slot_map_t *map, void **item)
+{
+	assert(map != NULL);
+	assert(item != NULL);
+
+	if (map->count == map->capacity) {
+		panic(fmt("'%s' is full", map->debugName));
+	}
+
+	uint32_t idx = map->freeSlot;
+	struct Slot *slot = &map->slots[idx];
+	map->freeSlot = slot->dense;
+
+	uint32_t dense = map->count++;
+	slot->dense = dense;
+	map->denseToSlot[dense] = idx;
+
+	*item = ITEM(map, dense);
+	memset(*item, 0, map->itemSize);
+
+	return MAKE_HANDLE(idx, slot->gen);
+}
+
+/*
+ * LookupSlot
+ *	Returns the slot for the given handle if it refers to a live item.
+ */
+static struct Slot *LookupSlot(slot_map_t *map, slot_handle_t handle)
+{
+	uint32_t idx = HANDLE_INDEX(handle);
+
+	if (idx >= map->capacity)
+		return NULL;
+
+	struct Slot *slot = &map->slots[idx];
+	if (slot->gen != HANDLE_GEN(handle) || slot->dense >= map->count ||
+		map->denseToSlot[slot->dense] != idx)
+		return NULL;
+
+	return slot;
+}
+
+/*
+ * SMFree
+ *	Move the last live item into the hole, so they stay packed.
+ */
+void SMFree(slot_map_t *map, slot_handle_t handle)
+{
+	assert(map != NULL);
+
+	struct Slot *slot = LookupSlot(map, handle);
+	if (!slot) {
+		panic(fmt("stale handle %08x for '%s'", handle, map->debugName));
+	}
+
+	uint32_t dense = slot->dense;
+	uint32_t last = --map->count;
+
+	if (dense != last) {
+		void *to = ITEM(map, dense), *from = ITEM(map, last);
+		uint32_t movedSlot = map->denseToSlot[last];
+
+		memcpy(to, from, map->itemSize);
+		map->denseToSlot[dense] = movedSlot;
+		map->slots[movedSlot].dense = dense;
+
+		if (map->moved)
+			map->moved(to, from);
+	}
+
+	slot->gen = (slot->gen + 1) & GEN_MASK;
+	if (slot->gen == 0)
+		slot->gen = 1;
+
+	uint32_t idx = HANDLE_INDEX(handle);
+	slot->dense = map->freeSlot;
+	map->freeSlot = idx;
+}
+
+/*
+ * SMGet
+ */
+void *SMGet(slot_map_t *map, slot_handle_t handle)
+{
+	assert(map != NULL);
+
+	struct Slot *slot = LookupSlot(map, handle);
+	if (!slot)
+		return NULL;
+
+	return ITEM(map, slot->dense);
+}
+
+uint32_t SMCount(slot_map_t *map)
+{
+	assert(map != NULL);
+	return map->count;
+}
+
+void *SMAt(slot_map_t *map, uint32_t i)
+{
+	assert(map != NULL);
+	assert(i < map->count);
+
+	return ITEM(map, i);
+}
@@ -0,0 +1,50 @@
+/*
+ * slot_map.h
+ *	A fixed capacity container of same-sized items that can be iterated.
+ *
+ *	Live items are kept packed together at the front of one array, so
+ *	iterating over them never touches a dead slot. Freeing an item moves
+ *	the last live item into its place. That means pointers into the map
+ *	are only good until the next SMFree(); hold on to the slot_handle_t
+ *	instead and look it up with SMGet(), which is O(1) and returns NULL
+ *	if the item has since been freed (each slot has a generation count
+ *	that's baked into the handle).
+ *
+ *	If items need fixing up when they move (e.g. they contain a
+ *	list_head), pass a slot_moved_fn to create_slot_map(). It's called
+ *	with the item's new and old addresses, right after it was copied.
+ */
+#pragma once
+
+typedef uint32_t slot_handle_t;
+
+/* No valid handle is ever zero. */
+#define SLOT_INVALID	0
+
+typedef struct slot_map slot_map_t;
+typedef void (*slot_moved_fn)(void *item, void *oldItem);
+
+slot_map_t *create_slot_map(uint32_t capacity,
+	size_t itemSize,
+	slot_moved_fn moved,
+	mem_sys_t sys,
+	const char *debugName);
+void destroy_slot_map(slot_map_t *map);
+
+/* Allocate a zeroed item, returning its handle and putting a pointer to it
+ * in *item. panic()s if the map is full. */
+slot_handle_t SMAlloc(slot_map_t *map, void **item);
+void SMFree(slot_map_t *map, slot_handle_t handle);
+
+/* Returns the item for the given handle, or NULL if it's stale. */
+void *SMGet(slot_map_t *map, slot_handle_t handle);
+
+/* Number of live items, and the i'th of them (0 <= i < SMCount()). */
+uint32_t SMCount(slot_map_t *map);
+void *SMAt(slot_map_t *map, uint32_t i);
+
+/* Iterate over every live item. This goes backwards, so it's safe to
+ * SMFree() the current item or SMAlloc() new ones (which won't be visited)
+ * from inside the loop. */
+#define slot_map_for_each(pos, map) \
+	for (uint32_t __i = SMCount(map); __i-- > 0 && ((pos) = SMAt(map, __i));)
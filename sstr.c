@@ -2,19 +2,88 @@
 #include "sstr.h"
 #include "panic.h"
 #include "memory.h"
+#include "hash.h"
 
-#define BLOCK_SIZE 128
-#define BLOCK_COUNT 1024
+/* Strings are stored in size classes, each its own growable pool, with a
+ * small header just before the characters saying which class the block
+ * came from, so sstrfree() is O(1). Class sizes include the header.
+ * Anything too big for the largest class goes to MemAlloc().
+ * The header also holds the length, and the hash once someone asks for it.
+ */
+struct SStrHdr {
+        uint16_t cls;
+        uint16_t hashed;
+        uint32_t len;
+        uint32_t hash;
+};
+
+#define HDR_TO_STR(h) ((char *) ((struct SStrHdr *) (h) + 1))
+#define STR_TO_HDR(s) ((struct SStrHdr *) (s) - 1)
+
+#define NUM_CLASSES 5
+#define CLASS_LARGE NUM_CLASSES
+
+static const uint32_t s_ClassSizes[NUM_CLASSES] = {16, 32, 64, 128, 256};
+static const uint32_t s_ClassCounts[NUM_CLASSES] = {512, 1024, 512, 256, 64};
+static const char *s_ClassNames[NUM_CLASSES] = {
+        "sstr16", "sstr32", "sstr64", "sstr128", "sstr256"
+};
+
+struct SStrStats {
+        uint32_t allocs;
+        uint32_t frees;
+        uint32_t live;
+        uint32_t peak;
+};
+
+static mem_pool_t *s_Pools[NUM_CLASSES] = {NULL};
+static struct SStrStats s_Stats[NUM_CLASSES + 1];
+
+/*
+ * SizeToClass
+ *      Returns the class for a string of len characters, or CLASS_LARGE.
+ */
+static uint32_t SizeToClass(size_t len)
+{
+        size_t need = sizeof(struct SStrHdr) + len + 1;
+
+        for (uint32_t i = 0; i < NUM_CLASSES; i++) {
+                if (need <= s_ClassSizes[i])
+                        return i;
+        }
 
-static mem_pool_t *s_Pool = NULL;
+        return CLASS_LARGE;
+}
 
 /*
- * validate_length
+ * NewString
+ *      Returns space for a string of len characters, zeroed.
  */
-static void validate_length(const char *str)
+static char *NewString(size_t len)
 {
-        if (strlen(str) >= BLOCK_SIZE)
-                panic(fmt("String too large (%s)", str));
+        if (s_Pools[0] == NULL) {
+                panic("sstr not initialised");
+        }
+
+        uint32_t cls = SizeToClass(len);
+        struct SStrHdr *hdr;
+
+        if (cls == CLASS_LARGE) {
+                hdr = MemAllocSys(sizeof(*hdr) + len + 1, MEM_SYS_SSTR);
+        } else {
+                hdr = PAlloc(s_Pools[cls]);
+        }
+
+        hdr->cls = cls;
+        hdr->len = len;
+        hdr->hashed = false;
+
+        struct SStrStats *st = &s_Stats[cls];
+        st->allocs++;
+        if (++st->live > st->peak)
+                st->peak = st->live;
+
+        return HDR_TO_STR(hdr);
 }
 
 /*
@@ -22,13 +91,17 @@ static void validate_length(const char *str)
  */
 ecode_t sstr_init()
 {
-        if (s_Pool != NULL) {
+        if (s_Pools[0] != NULL) {
                 trace(CHAN_DBG, "sstr already initialised");
                 return EFAIL;
         }
 
-        /* Seems best to make this pool fixed size, at least for now. */
-        s_Pool = create_pool(BLOCK_COUNT, BLOCK_SIZE, POOL_FIXEDSIZE, "sstr");
+        for (uint32_t i = 0; i < NUM_CLASSES; i++) {
+                s_Pools[i] = create_pool(s_ClassCounts[i], s_ClassSizes[i],
+                        POOL_DYNGROW, MEM_SYS_SSTR, s_ClassNames[i]);
+        }
+
+        memset(s_Stats, 0, sizeof(s_Stats));
         return EOK;
 }
 
@@ -37,35 +110,74 @@ ecode_t sstr_init()
  */
 ecode_t sstr_shutdown()
 {
-        if (s_Pool == NULL) {
+        if (s_Pools[0] == NULL) {
                 trace(CHAN_DBG, "sstr wasn't initialised");
                 return EFAIL;
         }
 
-        destroy_pool(s_Pool);
+        for (uint32_t i = 0; i < NUM_CLASSES; i++) {
+                destroy_pool(s_Pools[i]);
+                s_Pools[i] = NULL;
+        }
 
         return EOK;
 }
 
+/*
+ * sstr_stats
+ */
+void sstr_stats()
+{
+        trace(CHAN_MEM, "sstr classes:");
+        for (uint32_t i = 0; i <= NUM_CLASSES; i++) {
+                struct SStrStats *st = &s_Stats[i];
+
+                trace(CHAN_MEM, fmt(" %8s: %u live (peak %u), %u allocs, "
+                        "%u frees", i == CLASS_LARGE ? "large" :
+                        s_ClassNames[i], st->live, st->peak, st->allocs,
+                        st->frees));
+        }
+}
+
 void sstrfree(char *str)
 {
-        PFree(s_Pool, str);
+        if (!str)
+                return;
+
+        struct SStrHdr *hdr = STR_TO_HDR(str);
+        uint32_t cls = hdr->cls;
+
+        if (cls > CLASS_LARGE) {
+                panic(fmt("%p isn't an sstr", str));
+        }
+
+        s_Stats[cls].frees++;
+        s_Stats[cls].live--;
+
+        if (cls == CLASS_LARGE)
+                MemFree(hdr);
+        else
+                PFree(s_Pools[cls], hdr);
 }
 
 /*
- * sstrdup
+ * sstrdup_sv
  */
-char *sstrdup(const char *str)
+char *sstrdup_sv(sview_t str)
 {
-        assert(str != NULL);
-
-        validate_length(str);
-        char *ret = PAlloc(s_Pool);
-        strncpy(ret, str, strlen(str));
+        char *ret = NewString(str.len);
+        if (str.len)
+                memcpy(ret, str.str, str.len);
 
 	return ret;
 }
 
+char *sstrdup(const char *str)
+{
+        assert(str != NULL);
+        return sstrdup_sv(sv(str));
+}
+
 /*
  * sstrdup_lower
  */
@@ -73,59 +185,67 @@ char *sstrdup_lower(const char *str)
 {
         assert(str != NULL);
 
-        char *copy = sstrdup(str);
-        sstrlower(copy);
+        size_t len = strlen(str);
+        char *copy = NewString(len);
+        for (size_t i = 0; i < len; i++)
+                copy[i] = tolower((unsigned char) str[i]);
+
         return copy;
 }
 
+/*
+ * sstrjoin
+ */
+char *sstrjoin(const sview_t *parts, uint32_t count)
+{
+        assert(parts != NULL);
+
+        size_t len = 0;
+        for (uint32_t i = 0; i < count; i++)
+                len += parts[i].len;
+
+        char *ret = NewString(len);
+        char *p = ret;
+        for (uint32_t i = 0; i < count; i++) {
+                if (parts[i].len == 0)
+                        continue;
+
+                memcpy(p, parts[i].str, parts[i].len);
+                p += parts[i].len;
+        }
+
+        return ret;
+}
+
 /*
  * sstrcat
  */
+char *sstrcat_sv(sview_t first, sview_t second)
+{
+        return SSTRJOIN(first, second);
+}
+
 char *sstrcat(const char *first, const char *second)
 {
         assert(first != NULL);
         assert(second != NULL);
 
-        validate_length(first);
-        validate_length(second);
-        if (strlen(first) + strlen(second) >= BLOCK_SIZE)
-                panic("concatenation would overflow");
-
-        char *ret = PAlloc(s_Pool);
-        strncpy(ret, first, strlen(first));
-        strncat(ret, second, strlen(second));
-        return ret;
+        return SSTRJOIN(sv(first), sv(second));
 }
 
 /*
  * sstrfname
  */
+char *sstrfname_sv(sview_t dir, sview_t name, sview_t ext)
+{
+        return SSTRJOIN(dir, name, ext);
+}
+
 char *sstrfname(const char *dir, const char *name, const char *ext)
 {
         assert(name != NULL);
 
-        validate_length(name);
-        if (dir) validate_length(dir);
-        if (ext) validate_length(ext);
-
-        size_t namesz = strlen(name);
-
-        if (dir) {
-                if (strlen(dir) + namesz >= BLOCK_SIZE)
-                        panic("dir + name would overflow");
-        }
-
-        if (ext) {
-                if (strlen(ext) + namesz >= BLOCK_SIZE)
-                        panic("name + ext would overflow");
-        }
-
-        char *ret = PAlloc(s_Pool);
-
-        if (dir) strncpy(ret, dir, strlen(dir));
-        strncat(ret, name, namesz);
-        if (ext) strncat(ret, ext, strlen(ext));
-        return ret;
+        return SSTRJOIN(sv(dir), sv(name), sv(ext));
 }
 
 /*
@@ -138,3 +258,54 @@ void sstrlower(char *str)
                 str++;
         }
 }
+
+/*
+ * sstr_view
+ */
+sview_t sstr_view(const char *sstr)
+{
+        assert(sstr != NULL);
+
+        sview_t v = {sstr, STR_TO_HDR(sstr)->len};
+        return v;
+}
+
+uint32_t sstrlen(const char *sstr)
+{
+        assert(sstr != NULL);
+        return STR_TO_HDR(sstr)->len;
+}
+
+/*
+ * sstrhash
+ */
+uint32_t sstrhash(const char *sstr)
+{
+        assert(sstr != NULL);
+
+        struct SStrHdr *hdr = STR_TO_HDR(sstr);
+        if (!hdr->hashed) {
+                hdr->hash = hash(sstr, hdr->len);
+                hdr->hashed = true;
+        }
+
+        return hdr->hash;
+}
+
+/*
+ * sstrtrunc
+ */
+void sstrtrunc(char *sstr, uint32_t len)
+{
+        assert(sstr != NULL);
+
+        struct SStrHdr *hdr = STR_TO_HDR(sstr);
+        if (len > hdr->len) {
+                panic(fmt("can't truncate a %u character sstr to %u",
+                        hdr->len, len));
+        }
+
+        sstr[len] = '\0';
+        hdr->len = len;
+        hdr->hashed = false;
+}
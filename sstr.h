@@ -3,21 +3,68 @@
  *      Small string library. For handling common operations on small strings
  *      (anything like file names, etc) in an efficient way. Instead of
  *      allocating memory every time a string operation happens, we maintain
- *      a memory pool and use blocks from it to allocate space for strings
+ *      memory pools and use blocks from them to allocate space for strings
  *      quickly, so these functions can be used anywhere without worrying
  *      about potential performance problems.
+ *
+ *      Strings are rounded up to one of a few size classes (16 to 256 bytes,
+ *      counting a small header), each with its own pool that grows as
+ *      needed. Longer strings are allocated with MemAlloc(), so there's no
+ *      limit on length. Main thread only.
+ *
+ *      Every sstr knows its own length, and its hash once it has been asked
+ *      for, so sstrlen() and sstrhash() never scan it twice. If you shorten
+ *      one in place, tell it with sstrtrunc().
+ *
+ *      The *_sv() functions take string views (sview_t) instead, which are
+ *      just a pointer and a length, so the caller's lengths get worked out
+ *      once and the result is built in a single pass. sstrjoin() glues any
+ *      number of views together in one allocation, which is how to build
+ *      paths:
+ *
+ *          char *path = SSTRJOIN(sv(root), SV_LIT("ent/"), sv(class),
+ *                  SV_LIT(".ent"));
  */
 
 #pragma once
 
+typedef struct sview {
+        const char *str;        /* not necessarily NUL terminated */
+        uint32_t len;
+} sview_t;
+
+/* A view of a C string, a string literal, or nothing at all. */
+static inline sview_t sv(const char *str)
+{
+        sview_t v = {str, str ? strlen(str) : 0};
+        return v;
+}
+
+#define SV_LIT(s)       ((sview_t) {"" s, sizeof(s) - 1})
+#define SV_NONE         ((sview_t) {NULL, 0})
+
+/* A view of the first len characters of str. */
+static inline sview_t svn(const char *str, uint32_t len)
+{
+        sview_t v = {str, len};
+        return v;
+}
+
+/* A view of an sstr, without scanning it. */
+sview_t sstr_view(const char *sstr);
+
 /* These are called by the base layer. */
 ecode_t sstr_init();
 ecode_t sstr_shutdown();
 
 /* It's good form to free any char* results you get from functions in this
- * module, but they will be freed on shutdown regardless. */
+ * module, but they will be freed on shutdown regardless (apart from ones
+ * too long for the pools, which show up as leaks). */
 void sstrfree(char *str);
 
+/* trace() how many strings of each size class are live. */
+void sstr_stats();
+
 /* Duplicate the given string. */
 char *sstrdup(const char *str);
 
@@ -35,3 +82,24 @@ char *sstrfname(const char *dir, const char *name, const char *ext);
 
 /* Make the given string lowercase. Modifies it in-place. */
 void sstrlower(char *str);
+
+/* The length of an sstr, and its hash() (worked out the first time, so
+ * don't change an sstr after hashing it). */
+uint32_t sstrlen(const char *sstr);
+uint32_t sstrhash(const char *sstr);
+
+/* Cut an sstr short at len characters, after editing it in place. */
+void sstrtrunc(char *sstr, uint32_t len);
+
+/* View versions of the above. sstrfname_sv() takes SV_NONE for no dir or
+ * ext. */
+char *sstrdup_sv(sview_t str);
+char *sstrcat_sv(sview_t first, sview_t second);
+char *sstrfname_sv(sview_t dir, sview_t name, sview_t ext);
+
+/* Concatenate count views into one new sstr. SSTRJOIN() counts them for
+ * you. */
+char *sstrjoin(const sview_t *parts, uint32_t count);
+#define SSTRJOIN(...) \
+        sstrjoin((const sview_t[]) {__VA_ARGS__}, \
+                sizeof((sview_t[]) {__VA_ARGS__}) / sizeof(sview_t))
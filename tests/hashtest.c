@@ -0,0 +1,214 @@
+/*
+ * hashtest.c
+ *	Checks ch_hashtable.c against a plain array, concentrating on what
+ *	happens while a table is part way through an incremental resize:
+ *	adding and removing entries then, and starting another resize before
+ *	the last one's finished.
+ *
+ *	Prints "ok" and exits 0 if everything matched; otherwise says what
+ *	didn't and exits 1. A hang counts as a failure too (after TIMEOUT
+ *	seconds).
+ *
+ *	Usage: hashtest
+ */
+#include "base.h"
+#include "panic.h"
+#include "memory.h"
+#include "ch_hashtable.h"
+#include <unistd.h>
+
+#define MAX_KEYS	4096
+#define TIMEOUT		30
+
+/* What the table should hold: model[k] is key k's value, or NULL. */
+static void *s_Model[MAX_KEYS];
+static uint32_t s_Count;
+static uint32_t s_Seed = 1;
+
+static uint32_t Rand()
+{
+	s_Seed = s_Seed * 1103515245 + 12345;
+	return s_Seed >> 8;
+}
+
+static void Fail(const char *what, uint32_t key)
+{
+	printf("FAILED: %s (key %u)\n", what, key);
+	exit(1);
+}
+
+static void *Val(uint32_t key)
+{
+	return (void *) (uintptr_t) (key * 2 + 1);
+}
+
+static const char *StrKey(uint32_t key)
+{
+	static char buf[32];
+	snprintf(buf, sizeof(buf), "key/%u", key);
+	return buf;
+}
+
+static void Set(hashtable_t *ht, ht_keytype_t type, uint32_t key)
+{
+	if (type == HT_KEY_STR)
+		HTSetStr(ht, StrKey(key), Val(key));
+	else
+		HTSetInt(ht, key, Val(key));
+
+	if (!s_Model[key])
+		s_Count++;
+	s_Model[key] = Val(key);
+}
+
+static void Remove(hashtable_t *ht, ht_keytype_t type, uint32_t key)
+{
+	void *val = type == HT_KEY_STR ? HTRemoveStr(ht, StrKey(key)) :
+		HTRemoveInt(ht, key);
+
+	if (val != s_Model[key])
+		Fail("remove returned the wrong value", key);
+
+	if (s_Model[key])
+		s_Count--;
+	s_Model[key] = NULL;
+}
+
+/*
+ * Check
+ *	Every key should be found (or not) with the right value, and
+ *	iterating should see exactly the live ones.
+ */
+static void Check(hashtable_t *ht, ht_keytype_t type)
+{
+	for (uint32_t k = 0; k < MAX_KEYS; k++) {
+		void *val = type == HT_KEY_STR ? HTGetStr(ht, StrKey(k)) :
+			HTGetInt(ht, k);
+
+		if (val != s_Model[k])
+			Fail("lookup returned the wrong value", k);
+	}
+
+	if (HTCount(ht) != s_Count)
+		Fail("count is wrong", HTCount(ht));
+
+	uint32_t seen = 0;
+	ht_iter_t it = HTIterate(ht);
+	ht_key_t key;
+	void *val;
+	while (HTNext(&it, &key, &val)) {
+		uint32_t k = type == HT_KEY_STR ?
+			(uint32_t) atoi(key.str + 4) : (uint32_t) key.num;
+
+		if (k >= MAX_KEYS || s_Model[k] != val)
+			Fail("iterated over something that isn't there", k);
+		seen++;
+	}
+
+	if (seen != s_Count)
+		Fail("iteration missed some", seen);
+}
+
+/*
+ * Churn
+ *	Fill a big table right up to its load limit, then empty it again
+ *	apart from the few entries in its highest slots (found by iterating,
+ *	which goes through the slots in order). The next add starts a resize
+ *	into a small table, and migrating works up from the bottom of the
+ *	big one, so those entries are still waiting there when more adds
+ *	fill the small table and force another resize.
+ */
+static void Churn(ht_keytype_t type, uint32_t keep, uint32_t add)
+{
+	memset(s_Model, 0, sizeof(s_Model));
+	s_Count = 0;
+
+	/* 1024 slots, and 767 is as many as fit without resizing */
+	uint32_t fill = 767;
+	hashtable_t *ht = create_hashtable(fill, type, MEM_SYS_GENERAL,
+		"hashtest");
+
+	for (uint32_t k = 0; k < fill; k++)
+		Set(ht, type, k);
+
+	static uint32_t order[MAX_KEYS];
+	uint32_t n = 0;
+	ht_iter_t it = HTIterate(ht);
+	ht_key_t key;
+	while (HTNext(&it, &key, NULL)) {
+		order[n++] = type == HT_KEY_STR ?
+			(uint32_t) atoi(key.str + 4) : (uint32_t) key.num;
+	}
+
+	for (uint32_t i = 0; i < n - keep; i++)
+		Remove(ht, type, order[i]);
+
+	for (uint32_t i = 0; i < add; i++) {
+		Set(ht, type, fill + i);
+
+		/* And take things out mid-resize now and then too */
+		if (i % 5 == 4)
+			Remove(ht, type, fill + i - 2);
+		if (i % 16 == 0)
+			Check(ht, type);
+	}
+
+	Check(ht, type);
+	destroy_hashtable(ht);
+}
+
+/*
+ * Random
+ *	Lots of random adds, replaces and removes.
+ */
+static void Random(ht_keytype_t type, uint32_t steps)
+{
+	memset(s_Model, 0, sizeof(s_Model));
+	s_Count = 0;
+
+	hashtable_t *ht = create_hashtable(0, type, MEM_SYS_GENERAL,
+		"hashtest");
+
+	for (uint32_t i = 0; i < steps; i++) {
+		/* Bias towards adding or removing in long stretches, so the
+		 * table keeps growing and shrinking */
+		bool adding = (i / 2000) % 2 == 0;
+		uint32_t key = Rand() % MAX_KEYS;
+
+		if (Rand() % 4 != 0 ? adding : !adding)
+			Set(ht, type, key);
+		else
+			Remove(ht, type, key);
+
+		if (i % 997 == 0)
+			Check(ht, type);
+	}
+
+	Check(ht, type);
+	destroy_hashtable(ht);
+}
+
+int main(int argc, char *argv[])
+{
+	alarm(TIMEOUT);
+	set_trace_channels(CHAN_INFO);
+
+	if (init_base() != EOK) {
+		printf("FAILED: init_base()\n");
+		return 1;
+	}
+
+	ht_keytype_t types[] = { HT_KEY_INT, HT_KEY_STR };
+
+	for (int t = 0; t < 2; t++) {
+		for (uint32_t keep = 2; keep <= 40; keep += 2)
+			Churn(types[t], keep, 600);
+
+		Random(types[t], 100000);
+	}
+
+	shutdown_base();
+	printf("ok\n");
+
+	return 0;
+}
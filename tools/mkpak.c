@@ -0,0 +1,297 @@
+/*
+ * mkpak.c
+ *	Builds a pack file (see pack.h) out of a directory tree, normally the
+ *	files root. Every regular file under dir goes in, named by its path
+ *	relative to dir; hidden files and directories (starting with '.') are
+ *	skipped, as are symbolic links and output.pak itself (if it's there
+ *	from a previous run).
+ *
+ *	With -z, files are LZ4 compressed at the given level (1-9) if that
+ *	saves at least an eighth of their size.
+ *
+ *	Usage: mkpak [-v] [-z level] output.pak dir
+ */
+#include "base.h"
+#include "pack.h"
+#include "lz4.h"
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define PATH_LEN	4096
+
+struct PackFile {
+	char *name;	/* relative to the root */
+	uint64_t size;		/* as stored */
+	uint64_t rawSize;
+	uint64_t offset;
+	uint32_t flags;
+};
+
+static struct PackFile *s_Files = NULL;
+static uint32_t s_Count = 0;
+static uint32_t s_MaxCount = 0;
+static bool s_Verbose = false;
+static int s_Level = 0;		/* 0 for no compression */
+static void *s_Work = NULL;
+static struct stat s_Out;	/* st_ino 0 if there's no output file yet */
+
+static void Die(const char *msg, const char *what)
+{
+	fprintf(stderr, "mkpak: %s %s: %s\n", msg, what, strerror(errno));
+	exit(EXIT_FAILURE);
+}
+
+static void *Xrealloc(void *p, size_t sz)
+{
+	p = realloc(p, sz);
+	if (!p) {
+		fprintf(stderr, "mkpak: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	return p;
+}
+
+/*
+ * JoinPath
+ *	buf must be PATH_LEN bytes.
+ */
+static void JoinPath(char *buf, const char *a, const char *b)
+{
+	int n = a[0] ? snprintf(buf, PATH_LEN, "%s/%s", a, b) :
+		snprintf(buf, PATH_LEN, "%s", b);
+
+	if (n < 0 || n >= PATH_LEN) {
+		fprintf(stderr, "mkpak: path too long: %s/%s\n", a, b);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void AddFile(const char *name, uint64_t size)
+{
+	if (s_Count == s_MaxCount) {
+		s_MaxCount = s_MaxCount ? s_MaxCount * 2 : 256;
+		s_Files = Xrealloc(s_Files, s_MaxCount * sizeof(*s_Files));
+	}
+
+	struct PackFile *f = &s_Files[s_Count++];
+	size_t len = strlen(name);
+	f->name = Xrealloc(NULL, len + 1);
+	memcpy(f->name, name, len + 1);
+	f->size = size;
+	f->rawSize = size;
+	f->offset = 0;
+	f->flags = 0;
+}
+
+/*
+ * Walk
+ *	Add everything under root/rel. rel is "" for the root itself.
+ */
+static void Walk(const char *root, const char *rel)
+{
+	char path[PATH_LEN];
+	JoinPath(path, root, rel);
+
+	DIR *dir = opendir(path);
+	if (!dir)
+		Die("can't open directory", path);
+
+	struct dirent *de;
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+
+		char name[PATH_LEN];
+		JoinPath(name, rel, de->d_name);
+		JoinPath(path, root, name);
+
+		struct stat st;
+		if (lstat(path, &st) == -1)
+			Die("can't stat", path);
+
+		if (st.st_dev == s_Out.st_dev && st.st_ino == s_Out.st_ino)
+			continue;
+
+		if (S_ISDIR(st.st_mode))
+			Walk(root, name);
+		else if (S_ISREG(st.st_mode))
+			AddFile(name, st.st_size);
+	}
+
+	closedir(dir);
+}
+
+static int CompareNames(const void *a, const void *b)
+{
+	return strcmp(((const struct PackFile *) a)->name,
+		((const struct PackFile *) b)->name);
+}
+
+static uint64_t AlignUp(uint64_t n, uint64_t align)
+{
+	return (n + align - 1) & ~(align - 1);
+}
+
+static void Pad(FILE *out, uint64_t to)
+{
+	while ((uint64_t) ftell(out) < to)
+		fputc(0, out);
+}
+
+/*
+ * ReadWhole
+ */
+static uint8_t *ReadWhole(const char *root, struct PackFile *f)
+{
+	char path[PATH_LEN];
+
+	JoinPath(path, root, f->name);
+	FILE *in = fopen(path, "rb");
+	if (!in)
+		Die("can't open", path);
+
+	uint8_t *data = Xrealloc(NULL, f->rawSize ? f->rawSize : 1);
+	if (fread(data, 1, f->rawSize, in) != f->rawSize)
+		Die("short read from", path);
+
+	fclose(in);
+	return data;
+}
+
+/*
+ * WriteFile
+ *	Compress it if that's worth it, then write it out.
+ */
+static void WriteFile(FILE *out, const char *root, struct PackFile *f)
+{
+	uint8_t *data = ReadWhole(root, f);
+	uint8_t *packed = NULL;
+	size_t size = f->rawSize;
+
+	if (s_Level && f->rawSize > 0) {
+		size_t bound = lz4_compress_bound(f->rawSize);
+		packed = Xrealloc(NULL, bound);
+		size = lz4_compress(data, f->rawSize, packed, bound, s_Level,
+			s_Work);
+
+		if (size && size <= f->rawSize - f->rawSize / 8) {
+			f->flags |= PACK_LZ4;
+		} else {
+			size = f->rawSize;
+		}
+	}
+
+	f->size = size;
+	fwrite(f->flags & PACK_LZ4 ? packed : data, 1, size, out);
+
+	free(packed);
+	free(data);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "vz:")) != -1) {
+		switch (opt) {
+		case 'v':
+			s_Verbose = true;
+			break;
+		case 'z':
+			s_Level = atoi(optarg);
+			if (s_Level < LZ4_MIN_LEVEL || s_Level > LZ4_MAX_LEVEL)
+				goto usage;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (argc - optind != 2)
+		goto usage;
+
+	const char *outName = argv[optind];
+	const char *root = argv[optind + 1];
+
+	if (s_Level)
+		s_Work = Xrealloc(NULL, LZ4_WORK_SIZE);
+
+	if (stat(outName, &s_Out) == -1)
+		s_Out.st_ino = 0;
+
+	Walk(root, "");
+	qsort(s_Files, s_Count, sizeof(*s_Files), CompareNames);
+
+	FILE *out = fopen(outName, "wb");
+	if (!out)
+		Die("can't create", outName);
+
+	struct pack_header hdr = {0};
+	fwrite(&hdr, sizeof(hdr), 1, out);
+
+	uint64_t total = 0, stored = 0;
+	for (uint32_t i = 0; i < s_Count; i++) {
+		struct PackFile *f = &s_Files[i];
+
+		f->offset = AlignUp(ftell(out), PACK_ALIGN);
+		Pad(out, f->offset);
+		WriteFile(out, root, f);
+		total += f->rawSize;
+		stored += f->size;
+
+		if (s_Verbose)
+			printf("%10llu %10llu  %s\n",
+				(unsigned long long) f->rawSize,
+				(unsigned long long) f->size, f->name);
+	}
+
+	memcpy(hdr.magic, PACK_MAGIC, sizeof(hdr.magic));
+	hdr.version = PACK_VERSION;
+	hdr.count = s_Count;
+	hdr.tocOffset = AlignUp(ftell(out), sizeof(uint64_t));
+	hdr.namesOffset = hdr.tocOffset + s_Count * sizeof(struct pack_entry);
+	Pad(out, hdr.tocOffset);
+
+	uint32_t nameOffset = 0;
+	for (uint32_t i = 0; i < s_Count; i++) {
+		struct pack_entry e = {0};
+		e.offset = s_Files[i].offset;
+		e.size = s_Files[i].size;
+		e.rawSize = s_Files[i].rawSize;
+		e.flags = s_Files[i].flags;
+		e.nameOffset = nameOffset;
+		e.nameLen = strlen(s_Files[i].name);
+		fwrite(&e, sizeof(e), 1, out);
+
+		nameOffset += e.nameLen + 1;
+	}
+
+	for (uint32_t i = 0; i < s_Count; i++)
+		fwrite(s_Files[i].name, 1, strlen(s_Files[i].name) + 1, out);
+	hdr.namesSize = nameOffset;
+
+	rewind(out);
+	fwrite(&hdr, sizeof(hdr), 1, out);
+
+	if (ferror(out) || fclose(out) != 0)
+		Die("can't write", outName);
+
+	printf("%s: %u files, %llu bytes of data stored in %llu\n", outName,
+		s_Count, (unsigned long long) total,
+		(unsigned long long) stored);
+
+	for (uint32_t i = 0; i < s_Count; i++)
+		free(s_Files[i].name);
+	free(s_Files);
+	free(s_Work);
+
+	return EXIT_SUCCESS;
+
+usage:
+	fprintf(stderr, "usage: %s [-v] [-z level] output.pak dir\n", argv[0]);
+	return EXIT_FAILURE;
+}
@@ -37,7 +37,7 @@ static char *remove_spaces(const char *str)
                 *pc++ = *ps;
         }
 
-        *pc = '\0';
+        sstrtrunc(copy, pc - copy);
         return copy;
 }
 
@@ -0,0 +1,378 @@
+#include "base.h"
+#include "panic.h"
+#include "memory.h"
+#include "files.h"
+#include "intern.h"
+#include "ch_hashtable.h"
+#include "cache.h"
+#include "watch.h"
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+struct Handler {
+	const char *ext;	/* interned; NULL for everything */
+	uint32_t extLen;
+	watch_fn fn;
+	void *user;
+};
+
+#define MAX_HANDLERS	16
+static struct Handler s_Handlers[MAX_HANDLERS];
+static uint32_t s_HandlerCount = 0;
+
+/*
+ * watch_add_handler
+ */
+void watch_add_handler(const char *ext, watch_fn fn, void *user)
+{
+	assert(fn != NULL);
+
+	if (s_HandlerCount == MAX_HANDLERS) {
+		panic("too many watch handlers");
+	}
+
+	struct Handler *h = &s_Handlers[s_HandlerCount++];
+	h->ext = ext ? intern(ext) : NULL;
+	h->extLen = ext ? intern_len(h->ext) : 0;
+	h->fn = fn;
+	h->user = user;
+}
+
+/*
+ * watch_remove_handler
+ */
+void watch_remove_handler(const char *ext, watch_fn fn)
+{
+	const char *iext = ext ? intern_find(ext) : NULL;
+
+	for (uint32_t i = 0; i < s_HandlerCount; i++) {
+		if (s_Handlers[i].ext == iext && s_Handlers[i].fn == fn) {
+			s_Handlers[i] = s_Handlers[--s_HandlerCount];
+			return;
+		}
+	}
+}
+
+#ifdef __linux__
+
+/* Files changed since the last process_file_changes(), in the order they
+ * were first seen. Interned, so duplicates can be spotted by pointer. */
+static const char **s_Dirty = NULL;
+static uint32_t s_DirtyCount = 0;
+static uint32_t s_DirtyCap = 0;
+
+#define INITIAL_DIRTY	32
+
+/*
+ * MarkDirty
+ *	Note that the named file changed, unless it's already been noted.
+ *	foo.lz4 is served as foo, so that's what changed as far as anyone
+ *	else is concerned.
+ */
+static void MarkDirty(const char *name)
+{
+	uint32_t len = strlen(name);
+	const char *iname;
+
+	if (len > 4 && strcmp(name + len - 4, ".lz4") == 0) {
+		char *base = sstrdup(name);
+		sstrtrunc(base, len - 4);
+		iname = intern(base);
+		sstrfree(base);
+	} else {
+		iname = intern(name);
+	}
+
+	for (uint32_t i = 0; i < s_DirtyCount; i++) {
+		if (s_Dirty[i] == iname)
+			return;
+	}
+
+	if (s_DirtyCount == s_DirtyCap) {
+		uint32_t cap = s_DirtyCap ? s_DirtyCap * 2 : INITIAL_DIRTY;
+		const char **dirty = MemAllocSys(cap * sizeof(*dirty),
+			MEM_SYS_FILES);
+
+		if (s_DirtyCount)
+			memcpy(dirty, s_Dirty, s_DirtyCount * sizeof(*dirty));
+		MemFree(s_Dirty);
+		s_Dirty = dirty;
+		s_DirtyCap = cap;
+	}
+
+	s_Dirty[s_DirtyCount++] = iname;
+}
+
+/*
+ * Reload
+ *	Refresh the cached copies of the file, then let the handlers rebuild
+ *	whatever was made from it.
+ */
+static void Reload(const char *iname)
+{
+	uint32_t len = intern_len(iname);
+	uint32_t reloaded = cache_reload(iname);
+
+	for (uint32_t i = 0; i < s_HandlerCount; i++) {
+		struct Handler *h = &s_Handlers[i];
+
+		if (h->ext && (len < h->extLen ||
+		    strcmp(iname + len - h->extLen, h->ext) != 0))
+			continue;
+
+		h->fn(iname, h->user);
+		reloaded++;
+	}
+
+	if (reloaded) {
+		trace(CHAN_INFO, fmt("reloaded %s", iname));
+	}
+}
+
+/* Every directory under the root is watched separately (inotify doesn't
+ * do whole trees); s_Dirs maps each watch descriptor to its directory,
+ * relative to the root and ending in a '/'. The root itself is "".
+ */
+static int s_Fd = -1;
+static hashtable_t *s_Dirs = NULL;
+
+#define WATCH_MASK	(IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | \
+			 IN_ONLYDIR | IN_EXCL_UNLINK)
+#define INITIAL_DIRS	64
+
+/*
+ * WatchTree
+ *	Watch the directory and everything under it. markFiles is for
+ *	directories that have just appeared: anything already in them was
+ *	written before we were watching, so it's treated as changed.
+ */
+static void WatchTree(const char *rel, bool markFiles)
+{
+	char *path = sstrcat(get_root_path(), rel);
+
+	int wd = inotify_add_watch(s_Fd, path, WATCH_MASK);
+	if (wd == -1) {
+		trace(CHAN_INFO, fmt("can't watch %s (%s)", path,
+			strerror(errno)));
+		sstrfree(path);
+		return;
+	}
+
+	/* The same directory always gets the same descriptor */
+	char *old = HTGetInt(s_Dirs, wd);
+	sstrfree(old);
+	HTSetInt(s_Dirs, wd, sstrdup(rel));
+
+	DIR *dir = opendir(path);
+	if (!dir) {
+		sstrfree(path);
+		return;
+	}
+
+	struct dirent *de;
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+
+		char *name = sstrcat(rel, de->d_name);
+		char *full = sstrcat(path, de->d_name);
+		struct stat st;
+
+		/* lstat() so a link back up the tree can't loop forever */
+		if (lstat(full, &st) == 0) {
+			if (S_ISDIR(st.st_mode)) {
+				char *sub = sstrcat(name, "/");
+				WatchTree(sub, markFiles);
+				sstrfree(sub);
+			} else if (S_ISREG(st.st_mode) && markFiles) {
+				MarkDirty(name);
+			}
+		}
+
+		sstrfree(full);
+		sstrfree(name);
+	}
+
+	closedir(dir);
+	sstrfree(path);
+}
+
+/*
+ * HandleEvent
+ */
+static void HandleEvent(const struct inotify_event *ev)
+{
+	if (ev->mask & IN_Q_OVERFLOW) {
+		trace(CHAN_INFO, "too many file changes at once, some were "
+			"missed");
+		return;
+	}
+
+	/* The directory's gone */
+	if (ev->mask & IN_IGNORED) {
+		sstrfree(HTRemoveInt(s_Dirs, ev->wd));
+		return;
+	}
+
+	const char *dir = HTGetInt(s_Dirs, ev->wd);
+	if (!dir || ev->len == 0 || ev->name[0] == '.')
+		return;
+
+	char *name = sstrcat(dir, ev->name);
+
+	if (ev->mask & IN_ISDIR) {
+		if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+			char *sub = sstrcat(name, "/");
+			WatchTree(sub, true);
+			sstrfree(sub);
+		}
+	} else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+		/* Just created isn't interesting; it's written next */
+		MarkDirty(name);
+	}
+
+	sstrfree(name);
+}
+
+/*
+ * ReadEvents
+ *	Drain everything inotify has for us without blocking.
+ */
+static ecode_t ReadEvents()
+{
+	char buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+
+	for (;;) {
+		ssize_t len = read(s_Fd, buf, sizeof(buf));
+		if (len == -1) {
+			if (errno == EAGAIN)
+				return EOK;
+			if (errno == EINTR)
+				continue;
+
+			trace(CHAN_INFO, fmt("can't read file changes (%s)",
+				strerror(errno)));
+			return EFAIL;
+		}
+
+		const char *p = buf;
+		while (p < buf + len) {
+			const struct inotify_event *ev = (const void *) p;
+
+			HandleEvent(ev);
+			p += sizeof(*ev) + ev->len;
+		}
+	}
+}
+
+/*
+ * init_watch
+ */
+ecode_t init_watch()
+{
+	if (s_Fd != -1) {
+		trace(CHAN_INFO, "file watcher already initialised");
+		return EFAIL;
+	}
+
+	if (!get_root_path()) {
+		panic("init_watch() called before init_files()");
+	}
+
+	s_Fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (s_Fd == -1) {
+		trace(CHAN_INFO, fmt("can't watch for file changes (%s)",
+			strerror(errno)));
+		return EFAIL;
+	}
+
+	s_Dirs = create_hashtable(INITIAL_DIRS, HT_KEY_INT, MEM_SYS_FILES,
+		"WatchedDirs");
+	WatchTree("", false);
+
+	if (HTCount(s_Dirs) == 0) {
+		shutdown_watch();
+		return EFAIL;
+	}
+
+	trace(CHAN_DBG, fmt("watching %u directories under %s",
+		HTCount(s_Dirs), get_root_path()));
+
+	return EOK;
+}
+
+/*
+ * shutdown_watch
+ */
+ecode_t shutdown_watch()
+{
+	if (s_Fd == -1) {
+		trace(CHAN_INFO, "file watcher not initialised");
+		return EFAIL;
+	}
+
+	ht_iter_t it = HTIterate(s_Dirs);
+	void *dir;
+	while (HTNext(&it, NULL, &dir))
+		sstrfree(dir);
+
+	destroy_hashtable(s_Dirs);
+	s_Dirs = NULL;
+
+	close(s_Fd);
+	s_Fd = -1;
+
+	MemFree(s_Dirty);
+	s_Dirty = NULL;
+	s_DirtyCount = s_DirtyCap = 0;
+
+	return EOK;
+}
+
+/*
+ * process_file_changes
+ */
+ecode_t process_file_changes()
+{
+	if (s_Fd == -1)
+		return EOK;
+
+	if (ReadEvents() != EOK)
+		return EFAIL;
+
+	/* Handlers don't mark anything dirty, so the list holds still */
+	for (uint32_t i = 0; i < s_DirtyCount; i++)
+		Reload(s_Dirty[i]);
+
+	s_DirtyCount = 0;
+
+	return EOK;
+}
+
+#else
+
+ecode_t init_watch()
+{
+	trace(CHAN_INFO, "hot reloading isn't supported on this platform");
+	return EFAIL;
+}
+
+ecode_t shutdown_watch()
+{
+	trace(CHAN_INFO, "file watcher not initialised");
+	return EFAIL;
+}
+
+ecode_t process_file_changes()
+{
+	return EOK;
+}
+
+#endif
@@ -0,0 +1,40 @@
+/*
+ * watch.h
+ *	Hot reloading. Watches everything under the files root for changes
+ *	(with inotify, so only on Linux) and reloads what changed without
+ *	restarting the game.
+ *
+ *	Changed files are only noted as they're seen. Once a frame, at a safe
+ *	point, process_file_changes() refreshes any cached copies of them (see
+ *	cache_reload()) and then calls the handlers registered for their
+ *	extensions, which rebuild whatever was made from them: entity.c
+ *	re-reads entity definitions into live entities, script.c re-runs
+ *	scripts. Files that changed several times since the last frame are
+ *	only reloaded once.
+ *
+ *	Names passed to handlers are relative to the files root, as they'd be
+ *	passed to open_file(). A change to foo.map.lz4 is reported as foo.map,
+ *	since that's what files.c serves it as. Files in a mounted pack shadow
+ *	the loose ones, so edits to those don't show up while it's mounted.
+ *
+ *	Main thread only.
+ */
+#pragma once
+
+/* name is the file that was written. */
+typedef void (*watch_fn)(const char *name, void *user);
+
+/* Start watching the files root; call after init_files(). Returns EFAIL
+ * (after tracing why) if it can't be watched; the game runs fine without. */
+ecode_t init_watch();
+ecode_t shutdown_watch();
+
+/* Call fn for every changed file ending in ext (e.g. ".ent"), or every
+ * changed file if ext is NULL. Handlers can be added before init_watch(),
+ * and are simply never called if nothing is being watched. */
+void watch_add_handler(const char *ext, watch_fn fn, void *user);
+void watch_remove_handler(const char *ext, watch_fn fn);
+
+/* Reload everything that's changed since the last call. The main loop
+ * calls this every frame. */
+ecode_t process_file_changes();